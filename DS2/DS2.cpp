@@ -143,7 +143,8 @@ void DS2::OFF()
 Getters
 
 All getter functions take in a character array and its size. They clear the array,
-copy the respective variable to it, and return.
+copy the respective variable to it, and return. The variables know their own length, so
+nothing has to be measured.
 
 Returns:
 0:	Failed to copy, arary size too small
@@ -153,80 +154,75 @@ Returns:
 
 bool DS2::get_ubar(char* array, uint8_t size)
 {
-	memset(array, 0, size);
-
-	if(size > strlen(ubar))
-	{
-		strcpy(array, ubar);
-		return 1;
-	}
-
-	return 0;
+	return ubar.copyTo(array, size);
 }
 
 bool DS2::get_vbar(char* array, uint8_t size)
 {
-	memset(array, 0, size);
-
-	if(size > strlen(vbar))
-	{
-		strcpy(array, vbar);
-		return 1;
-	}
-	
-	return 0;
+	return vbar.copyTo(array, size);
 }
 
 bool DS2::getGust(char* array, uint8_t size)
 {
-	memset(array, 0, size);
-
-	if(size > strlen(gust))
-	{
-		strcpy(array, gust);
-		return 1;
-	}
-	
-	return 0;
+	return gust.copyTo(array, size);
 }
 
 bool DS2::getWindSpeed(char* array, uint8_t size)
 {
-	memset(array, 0, size);
-
-	if(size > strlen(windSpeed))
-	{
-		strcpy(array, windSpeed);
-		return 1;
-	}
-	
-	return 0;
+	return windSpeed.copyTo(array, size);
 }
 
 bool DS2::getWindDirection(char* array, uint8_t size)
 {
-	memset(array, 0, size);
-
-	if(size > strlen(windDirection))
-	{
-		strcpy(array, windDirection);
-		return 1;
-	}
-	
-	return 0;
+	return windDirection.copyTo(array, size);
 }
 
 bool DS2::getTemperature(char* array, uint8_t size)
 {
-	memset(array, 0, size);
+	return temperature.copyTo(array, size);
+}
 
-	if(size > strlen(temperature))
-	{
-		strcpy(array, temperature);
-		return 1;
-	}
-	
-	return 0;
+/******************************************************************************************
+
+Scaled Getters
+
+Parse the respective variable into an integer scaled by 10^decimals, so no float or string
+has to be kept for it.
+
+Returns:
+0:	The variable is empty or doesn't hold a number
+1:	The value was stored
+
+******************************************************************************************/
+
+bool DS2::get_ubar(int32_t* value, uint8_t decimals)
+{
+	return parseScaled(ubar.c_str(), decimals, value);
+}
+
+bool DS2::get_vbar(int32_t* value, uint8_t decimals)
+{
+	return parseScaled(vbar.c_str(), decimals, value);
+}
+
+bool DS2::getGust(int32_t* value, uint8_t decimals)
+{
+	return parseScaled(gust.c_str(), decimals, value);
+}
+
+bool DS2::getWindSpeed(int32_t* value, uint8_t decimals)
+{
+	return parseScaled(windSpeed.c_str(), decimals, value);
+}
+
+bool DS2::getWindDirection(int32_t* value, uint8_t decimals)
+{
+	return parseScaled(windDirection.c_str(), decimals, value);
+}
+
+bool DS2::getTemperature(int32_t* value, uint8_t decimals)
+{
+	return parseScaled(temperature.c_str(), decimals, value);
 }
 
 /******************************************************************************************
@@ -247,7 +243,8 @@ Returns:
 bool DS2::compChecksum()
 {
 	uint16_t crc = 0;							//	storing the sum
-	int i = 1;									//	index
+	uint8_t i = 1;								//	index
+	uint8_t len = responseBuffer.length();
 	char c;
 
 	do
@@ -255,9 +252,8 @@ bool DS2::compChecksum()
 		c = responseBuffer[i];					//	store the bit to add
 		crc += (uint8_t) c;						//	add its value to the sum
 		i++;									
-	}	while(	c != 0 &&						//	while the current bit isnt null
-				c != '_' &&						//	the underscore bit comes right before the checksum
-				i < sizeof(responseBuffer) );	//	and we aren't overflowing
+	}	while(	c != '_' &&						//	the underscore bit comes right before the checksum
+				i < len );						//	and we aren't past the end of the response
 	crc = crc % 64 + 32;
 
 	//	the next bit should either be the checksum or null
@@ -294,7 +290,7 @@ Returns:
 bool DS2::sendCommand(char* cmd, uint8_t length)
 {
 
-	memset(responseBuffer, 0, sizeof(responseBuffer));
+	responseBuffer.clear();
 
 	if(strlen(cmd) >= 5)
 	{
@@ -305,18 +301,11 @@ bool DS2::sendCommand(char* cmd, uint8_t length)
 	sdi12.sendCommand(fullCommand, strlen(fullCommand));	//	pass it to the DS-2
 	sdi12.readCommandAnswer(length, LISTEN_TIME);			//	receive the response and store it in the buffer
 
-	int i = 0;
 	while(	sdi12.available() &&							//	if there are bytes to be read
-			i < sizeof(responseBuffer) - 1)					//	and the responseBuffer won't overflow
-	{														//	and still has space for a null terminator
-
-		responseBuffer[i] = sdi12.read();					//	read a byte and store it in the buffer
-		i++;
+			responseBuffer.append((char) sdi12.read()) );	//	and the responseBuffer still has space
+															//	for them and a null terminator
 
-	}
-	responseBuffer[i] = 0;								//	append a null terminator
-
-	if(i==0)											//	if there was no response, say so and return 1
+	if(responseBuffer.length() == 0)					//	if there was no response, say so and return 1
 	{
 		#if DS2_DEBUG == 1
 			USB.println(F("No response."));
@@ -326,7 +315,7 @@ bool DS2::sendCommand(char* cmd, uint8_t length)
 	}
 
 	#if DS2_DEBUG == 1									//	otherwise print the response and return 0
-		USB.printf("Response: %s\n", responseBuffer);
+		USB.printf("Response: %s\n", responseBuffer.c_str());
 	#endif
 
 	return 1;
@@ -358,12 +347,12 @@ Returns:
 uint8_t DS2::read()
 {
 	//	empty all the strings that will store the measurements
-	memset(ubar, 0, strSize);
-	memset(vbar, 0, strSize);
-	memset(gust, 0, strSize);
-	memset(windSpeed, 0, strSize);
-	memset(windDirection, 0, strSize);
-	memset(temperature, 0, strSize);
+	ubar.clear();
+	vbar.clear();
+	gust.clear();
+	windSpeed.clear();
+	windDirection.clear();
+	temperature.clear();
 
 	memset(timeToNextMeasure, 0, sizeof(timeToNextMeasure));	//	sensor will say how long to wait
 
@@ -395,40 +384,30 @@ uint8_t DS2::read()
 	}
 
 	uint8_t counter = 0;							//	keeps track of which variable we are parsing
-	uint8_t bufIdx = 0;								//	track the index of the responseBuffer
-	uint8_t charIdx = 0;							//	track the index of the storage array
+	uint8_t length = responseBuffer.length();		//	measured once while reading the response
 
-	while(	bufIdx < strlen(responseBuffer) &&		//	haven't exceeded the range of responseBuffer
-			charIdx < this->strSize - 1 &&			//	haven't exceeded the range of the storage array
-			counter < 4)							//	we are storing into three variables
+	for(uint8_t bufIdx = 0; bufIdx < length && counter < 4; bufIdx++)
 	{
 		char c = responseBuffer[bufIdx];			//	snatch the next character to use
 
 		if( c == '+' || c == '-' )					//	in this case, + and - come before the variables
 		{											//	so we use them as delimiters AND store them
 			counter++;								//	change which variable we are storing into
-			charIdx = 0;
 		}
 		if( c != '\n' )
 		{
-			switch(counter)								//	based on counter, store char into specified variable
-			{
+			switch(counter)							//	based on counter, store char into specified variable
+			{										//	a full variable just drops the extra characters
 				case 1:
-					windSpeed[charIdx] = c;				//	set the character
-					charIdx ++; 						//	then increment the index and add a null terminator
-					windSpeed[charIdx] = 0;				//	which will be replaced if counter doesn't change
+					windSpeed.append(c);
 					break;
 
 				case 2:
-					windDirection[charIdx] = c;
-					charIdx ++;
-					windDirection[charIdx] = 0;
+					windDirection.append(c);
 					break;
 
 				case 3:
-					temperature[charIdx] = c;
-					charIdx ++;
-					temperature[charIdx] = 0;
+					temperature.append(c);
 					break;
 
 				default:
@@ -436,7 +415,6 @@ uint8_t DS2::read()
 
 			}
 		}
-		bufIdx ++;									//	increment the index of responseBuffer
 	}
 
 	if(counter == 0)								//	if no data had been stored, something went wrong
@@ -449,7 +427,7 @@ uint8_t DS2::read()
 
 	//print out the measurements
 	#if DS2_DEBUG == 1
-		USB.printf("\n---First Measurements---\nWS: %s\nWD: %s\nTemp: %s\n\n", windSpeed, windDirection, temperature);
+		USB.printf("\n---First Measurements---\nWS: %s\nWD: %s\nTemp: %s\n\n", windSpeed.c_str(), windDirection.c_str(), temperature.c_str());
 	#endif
 
 	if( this->sendCommand("R3!", 30) == 0 )			//	send the second data request, return if unresponsive
@@ -459,43 +437,32 @@ uint8_t DS2::read()
 
 	// this is mostly all the same as before
 	counter = 0;
-	bufIdx = 0;
-	charIdx = 0;
+	length = responseBuffer.length();
 
-	while(	bufIdx < strlen(responseBuffer) &&
-			charIdx < this->strSize - 1 &&
-			counter < 4)
+	for(uint8_t bufIdx = 0; bufIdx < length && counter < 4; bufIdx++)
 	{
 		char c = responseBuffer[bufIdx];
 
 		if( c == ' ' || c == '\t')					//	this time the delimiters are spaces and tabs
 		{											//	since only the negative signs are included
 			counter++;
-			charIdx = 0;
 		}
 		switch(counter)
 		{
 			case 1:
-				ubar[charIdx] = c;
-				charIdx ++;
-				ubar[charIdx] = 0;
+				ubar.append(c);
 				break;
 
 			case 2:
-				vbar[charIdx] = c;
-				charIdx ++;
-				vbar[charIdx] = 0;
+				vbar.append(c);
 				break;
 
 			case 3:
-				gust[charIdx] = c;
-				charIdx ++;
-				gust[charIdx] = 0;
+				gust.append(c);
 				break;
 			default:
 				break;
 		}
-		bufIdx++;
 	}
 
 	if(counter == 0)								//	if no data was stored, something went wrong
@@ -509,7 +476,7 @@ uint8_t DS2::read()
 
 	//	print out the measurements
 	#if DS2_DEBUG == 1
-		USB.printf("\n---Second Measurements---\nubar: %s\nvbar: %s\ngust: %s\n\n", ubar, vbar, gust);
+		USB.printf("\n---Second Measurements---\nubar: %s\nvbar: %s\ngust: %s\n\n", ubar.c_str(), vbar.c_str(), gust.c_str());
 	#endif
 
 	if( compChecksum() == 0 )						//	verify the checksum by calculating and comparing
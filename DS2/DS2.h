@@ -14,6 +14,7 @@ Date:		Aug 7, 2018
 ******************************************************************************************/
 
 #include <WaspSensorAgrXtr.h>
+#include <strbuf.h>
 
 #define DS2_DEBUG 0
 
@@ -25,13 +26,13 @@ private:
 
 	const static uint8_t strSize = 8;
 
-	char ubar[strSize];					//	meridial average velocity in m/s
-	char vbar[strSize];
-	char gust[strSize];					//	max gust speed since last querry
-	char windSpeed[strSize];			//	current wind speed
-	char windDirection[strSize];		//	current wind direction
-	char temperature[strSize];			//	current temperature
-	char responseBuffer[40];
+	fixedStr<strSize> ubar;				//	meridial average velocity in m/s
+	fixedStr<strSize> vbar;
+	fixedStr<strSize> gust;				//	max gust speed since last querry
+	fixedStr<strSize> windSpeed;		//	current wind speed
+	fixedStr<strSize> windDirection;	//	current wind direction
+	fixedStr<strSize> temperature;		//	current temperature
+	fixedStr<40> responseBuffer;
 
 	bool compChecksum();				//	calculates the expected checksum based on ubar, vbar, and gust
 
@@ -49,6 +50,15 @@ public:
 	bool getWindDirection(char*, uint8_t);	
 	bool getTemperature(char*, uint8_t);		
 
+	//	the same measurements as integers scaled by 10^decimals, so 1.25 m/s with 2 decimals is 125.
+	//	They return false if the last read() didn't provide the measurement.
+	bool get_ubar(int32_t*, uint8_t);
+	bool get_vbar(int32_t*, uint8_t);
+	bool getGust(int32_t*, uint8_t);
+	bool getWindSpeed(int32_t*, uint8_t);
+	bool getWindDirection(int32_t*, uint8_t);
+	bool getTemperature(int32_t*, uint8_t);
+
 	uint8_t read();						//	reads all measurements from the DS2 and stores them in their variables
 	bool sendCommand(char*, uint8_t);	//	used for generically sending commands and storing the response in
 										//	responseBuffer
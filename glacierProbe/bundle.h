@@ -0,0 +1,444 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include "header.h"
+/******************************************************************************************
+bundle.h
+
+Catches up on a backlog of unsent files, such as after an outage of a few weeks, with
+fewer FTP transfers. Once BUNDLE_THRESHOLD files or more wait for an upload, the oldest of
+them, up to BUNDLE_MAX_FILES or BUNDLE_MAX_BYTES, are copied into a single bundle file next
+to the first of them ("18-07-26.gpb" for "18-07-26.bin"), each one packed as it would be
+for its own upload (see packing.h). The bundle starts with a table of contents of
+BUNDLE_MAX_FILES entries, filled in as the files are added (see bundleHeader in header.h).
+
+The bundle is handed to the FTP batch ahead of the other files and uploaded as one object,
+so a backlog costs one transfer instead of one per day. Its progress is kept in bundleState,
+in BUNDLE_STATE_NAME, like that of any other file, so a broken off upload resumes. Once it
+is on the server the state is set to BUNDLE_SENT in a single write, which is the moment all
+its files count as sent; marking their slots afterwards is repeated after a reset until it
+is done. tools/unbundle.cpp restores the files on the server.
+
+All functions expect the SD to be on and the upload state to be open.
+******************************************************************************************/
+
+bundleState bundle;                             //  the bundle waiting for an upload, if any
+
+/*
+bundlePath()
+SD path of the bundle file, next to the first file in it. path must hold FILENAME_SIZE bytes.
+ */
+
+void bundlePath(char* path)
+{
+  siblingName(bundle.name, BUNDLE_EXTENSION, path);
+}
+
+/*
+writeBundleState()
+Writes bundle to BUNDLE_STATE_NAME.
+
+Returns:
+- true if the state was written
+- false if the SD failed to write it
+ */
+
+bool writeBundleState()
+{
+  char fname [16] = {0};
+  strcpy_P(fname, BUNDLE_STATE_NAME);
+
+  memcpy(bundle.magic, BUNDLE_MAGIC, sizeof(bundle.magic));
+  bundle.check = 0;
+  bundle.check = uploadCheck((uint8_t*) &bundle, sizeof(bundle));
+
+  SdFile file;
+  if( !sdOpen(fname, &file, O_WRITE | O_CREAT) )
+  {
+    return false;
+  }
+  bool written = file.write(&bundle, sizeof(bundle)) == sizeof(bundle);
+  return sdClose(&file) && written;
+}
+
+/*
+readBundleState()
+Loads bundle from BUNDLE_STATE_NAME. A missing or corrupt state means there is no bundle.
+ */
+
+void readBundleState()
+{
+  char fname [16] = {0};
+  strcpy_P(fname, BUNDLE_STATE_NAME);
+
+  SdFile file;
+  bool valid = sdOpen(fname, &file, O_READ);
+  if( valid )
+  {
+    valid = file.read(&bundle, sizeof(bundle)) == sizeof(bundle);
+    sdClose(&file);
+  }
+
+  uint8_t check = bundle.check;
+  bundle.check = 0;
+  if( !valid ||
+      uploadCheck((uint8_t*) &bundle, sizeof(bundle)) != check ||
+      memcmp(bundle.magic, BUNDLE_MAGIC, sizeof(bundle.magic)) != 0 )
+  {
+    memset(&bundle, 0, sizeof(bundle));
+    bundle.status = BUNDLE_NONE;
+  }
+}
+
+/*
+countUnsentFiles()
+Counts the unsent files before the current day's file, up to limit.
+ */
+
+uint8_t countUnsentFiles(uint8_t limit)
+{
+  uploadWalk walk;
+  beginWalk(&walk, uploadState.head);
+  uint8_t count = 0;
+  while( count < limit && findUnsentSlot(&walk) )
+  {
+    count++;
+    walk.idx = nextSlot(walk.idx);
+  }
+  return count;
+}
+
+/*
+appendToBundle()
+Copies a file to the current position of the open bundle file and stores its size.
+
+Returns:
+- true if the whole file was copied
+- false if it couldn't be read or the bundle couldn't be written
+ */
+
+bool appendToBundle(SdFile* out, const char* fname, uint32_t* size)
+{
+  SdFile in;
+  if( !sdOpen(fname, &in, O_READ) )
+  {
+    return false;
+  }
+
+  uint8_t chunk [64];
+  int16_t n;
+  bool ok = true;
+  *size = 0;
+  while( ( n = in.read(chunk, sizeof(chunk)) ) > 0 )
+  {
+    if( *size % LOG_SECTOR_SIZE == 0 )
+    {
+RTC.setWatchdog(8);
+    }
+    if( out->write(chunk, n) != n )
+    {
+      ok = false;
+      break;
+    }
+    *size += n;
+  }
+
+  sdClose(&in);
+  return ok && n == 0;
+}
+
+/*
+buildBundle()
+Copies the oldest unsent files into a new bundle file, packing each one first if UPLOAD_CODEC is set, until
+the bundle holds BUNDLE_MAX_FILES files or has reached BUNDLE_MAX_BYTES. A file that can't be copied ends
+the bundle before it, as every unsent file between bundle.first and bundle.end has to be in it. Packing
+and copying take a few seconds per file, so the 8 second watchdog is restarted as it goes, and the bundle
+also ends before a file that wouldn't be packed within the time left of the slice (see sliceLeft). The
+first file goes in as it is then, unpacked, so a bundle is made even from a slice that is already used up
+without running over it. A file whose own upload is under way (sentBytes) is left to finish on its own, so
+the bundle ends before it.
+
+Parameters:
+- uint32_t started, uint32_t maxMillis: the time of the slice
+
+Returns:
+- 0 if the bundle was built and its state saved
+- 1 if there is no unsent file, or the oldest one is being uploaded on its own
+- 2 if the bundle or its state couldn't be written
+ */
+
+uint8_t buildBundle(uint32_t started, uint32_t maxMillis)
+{
+  uploadWalk walk;
+  beginWalk(&walk, uploadState.head);
+  uploadSlot slot;
+  if( !findUnsentSlot(&walk) || !readSlot(walk.idx, &slot) || slot.sentBytes > 0 )
+  {
+    return 1;
+  }
+
+  memset(&bundle, 0, sizeof(bundle));
+  strncpy(bundle.name, slot.name, min(sizeof(slot.name), sizeof(bundle.name) - 1));
+  bundle.first = walk.idx;
+
+  char path [FILENAME_SIZE] = {0};
+  bundlePath(path);
+  SdFile out;
+  if( !sdOpen(path, &out, O_WRITE | O_CREAT | O_TRUNC) )
+  {
+    return 2;
+  }
+
+  bundleHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+  header.version = BUNDLE_VERSION;
+
+  bundleEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  bool ok = out.write(&header, sizeof(header)) == sizeof(header);
+  for(uint8_t i = 0; i < BUNDLE_MAX_FILES && ok; i++)      //  room for the table of contents
+  {
+    ok = out.write(&entry, sizeof(entry)) == sizeof(entry);
+  }
+
+  uint32_t offset = sizeof(header) + BUNDLE_MAX_FILES * sizeof(entry);
+  while( ok && header.count < BUNDLE_MAX_FILES && offset < BUNDLE_MAX_BYTES &&
+         findUnsentSlot(&walk) && readSlot(walk.idx, &slot) )
+  {
+    char fname [FILENAME_SIZE + 1] = {0};
+    strncpy(fname, slot.name, sizeof(slot.name));
+
+    if( slot.sentBytes > 0 )            //  partly on the server already as a file of its own
+    {
+      #if GLACIERPROBE_DEBUG == 1
+        USB.print(F("Upload under way, bundle ends before "));
+        USB.println(fname);
+      #endif
+      break;
+    }
+
+    bool pack = packMillis(SD.getFileSize(fname)) < sliceLeft(started, maxMillis);
+    if( !pack && header.count > 0 )
+    {
+      #if GLACIERPROBE_DEBUG == 1
+        USB.print(F("Out of time, bundle ends before "));
+        USB.println(fname);
+      #endif
+      break;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    const char* source = fname;
+    char packed [FILENAME_SIZE] = {0};
+    #if UPLOAD_CODEC != UPLOAD_PLAIN
+      siblingName(fname, PACK_EXTENSION, packed);
+      if( pack && packDataFile(fname, packed) == 0 )
+      {
+        source = packed;
+        entry.codec = UPLOAD_CODEC;
+      }
+    #endif
+    strncpy(entry.name, source, sizeof(entry.name));
+
+    bool copied = out.seekSet(offset) && appendToBundle(&out, source, &entry.size);
+    removePacked(fname);
+    if( !copied )
+    {
+      #if GLACIERPROBE_DEBUG == 1
+        USB.print(F("Bundle ends before "));
+        USB.println(fname);
+      #endif
+      ok = out.truncate(offset);
+      break;
+    }
+
+    if( !out.seekSet(sizeof(header) + header.count * sizeof(entry)) ||
+        out.write(&entry, sizeof(entry)) != sizeof(entry) )
+    {
+      ok = false;
+      break;
+    }
+
+    offset += entry.size;
+    header.count++;
+    walk.idx = nextSlot(walk.idx);
+    bundle.end = walk.idx;
+  }
+
+  ok = ok && header.count > 0 &&
+       out.seekSet(0) && out.write(&header, sizeof(header)) == sizeof(header);
+  sdClose(&out);
+
+  if( !ok )
+  {
+    SD.del(path);
+    memset(&bundle, 0, sizeof(bundle));
+    return 2;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Bundled %u files into %lu bytes\n", header.count, offset);
+  #endif
+
+  bundle.count = header.count;
+  bundle.status = BUNDLE_BUILT;
+  bundle.sentBytes = 0;
+  return writeBundleState() ? 0 : 2;
+}
+
+/*
+markBundleSent()
+Marks every unsent file of an uploaded bundle as sent, moves the head past them and deletes the bundle
+file. Repeating it after a reset does no harm. If the first slot of the bundle no longer holds its first
+file, because the upload state was rebuilt or the slots were reused since, the slots can't be told apart
+any more, so none is marked and the bundle is dropped; its files are then uploaded again on their own.
+
+Returns:
+- true if the bundle is done with
+- false if the upload state or bundle state couldn't be written, so it has to be repeated
+ */
+
+bool markBundleSent()
+{
+  char path [FILENAME_SIZE] = {0};
+  bundlePath(path);
+
+  uploadSlot slot;
+  if( !readSlot(bundle.first, &slot) || !slotIs(&slot, bundle.name) )
+  {
+    SD.del(path);
+    bundle.status = BUNDLE_NONE;
+    return writeBundleState();
+  }
+
+  for(uint16_t idx = bundle.first; idx != bundle.end; idx = nextSlot(idx))
+  {
+    if( readSlot(idx, &slot) && !( slot.flags & UPLOAD_SENT ) )
+    {
+      slot.flags |= UPLOAD_SENT;
+      if( !writeSlot(idx, &slot) )
+      {
+        return false;
+      }
+    }
+  }
+
+  if( !advanceHead() )
+  {
+    return false;
+  }
+
+  SD.del(path);
+
+  bundle.status = BUNDLE_NONE;
+  return writeBundleState();
+}
+
+/*
+prepareBundle()
+Finishes the marking of a bundle that a reset interrupted, and checks whether there is a bundle to upload,
+building a new one if the backlog has reached BUNDLE_THRESHOLD files within the time of the slice, see
+buildBundle(). A bundle whose first slot no longer holds its first file, because the upload state was
+rebuilt, or whose file is gone, is thrown away.
+
+Returns:
+- true if the bundle is ready to be handed to the FTP batch
+- false if there is none
+ */
+
+bool prepareBundle(uint32_t started, uint32_t maxMillis)
+{
+#if BUNDLE_THRESHOLD > 0
+  char path [FILENAME_SIZE] = {0};
+  uploadSlot slot;
+
+  readBundleState();
+  if( bundle.status == BUNDLE_SENT )
+  {
+    markBundleSent();
+  }
+
+  if( bundle.status == BUNDLE_BUILT )
+  {
+    bundlePath(path);
+    if( readSlot(bundle.first, &slot) && slotIs(&slot, bundle.name) && SD.isFile(path) == 1 )
+    {
+      return true;
+    }
+    SD.del(path);
+    bundle.status = BUNDLE_NONE;
+    writeBundleState();
+  }
+
+  if( bundle.status != BUNDLE_NONE || countUnsentFiles(BUNDLE_THRESHOLD) < BUNDLE_THRESHOLD )
+  {
+    return false;
+  }
+  return buildBundle(started, maxMillis) == 0;
+#else
+  return false;
+#endif
+}
+
+/*
+nextBundle()
+Hands out the bundle file like nextUnsentFile() hands out a data file.
+ */
+
+bool nextBundle(char* sdPath, uint8_t sdSize,
+                char* serverPath, uint8_t serverSize,
+                uint32_t* fileSize,
+                uint32_t* resumeFrom)
+{
+  char path [FILENAME_SIZE] = {0};
+  bundlePath(path);
+  if( strlen(path) >= sdSize || ftpPath(path, serverPath, serverSize) != 0 )
+  {
+    return false;
+  }
+  strcpy(sdPath, path);
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Uploading a bundle of %u files: ", bundle.count);
+    USB.println(serverPath);
+  #endif
+
+  int32_t size = SD.getFileSize(sdPath);
+  *fileSize = ( size > 0 ) ? size : 0;
+  *resumeFrom = bundle.sentBytes;
+  return true;
+}
+
+/*
+bundleProgress()
+Keeps the offset the upload of the bundle has reached, see uploadProgress().
+ */
+
+void bundleProgress(uint32_t offset)
+{
+  bundle.sentBytes = offset;
+  writeBundleState();
+}
+
+/*
+bundleDone()
+Commits an uploaded bundle: once BUNDLE_SENT is written all its files count as sent, then their slots are
+marked, see markBundleSent().
+ */
+
+void bundleDone(uint8_t error)
+{
+  if( error != 0 )
+  {
+    return;
+  }
+
+  bundle.status = BUNDLE_SENT;
+  if( writeBundleState() )
+  {
+    markBundleSent();
+  }
+}
+
+#endif
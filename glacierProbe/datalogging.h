@@ -4,15 +4,29 @@
 #include "header.h"
 
 uint8_t lastDate = 0;
-char SD_filename [16] = {0};
-char FTP_filename [44] = {0};
+uint32_t sampleEpoch = 0;
+uint32_t recordSeq = 0;
+uint32_t seqFloor = 0;
+uint16_t seqFloorDay = 0;
+uint32_t logOffset = 0;
+uint16_t logSegment = 0;
+uint16_t segmentRecords = 0;
+uint32_t segmentBytes = 0;
+char SD_filename [FILENAME_SIZE] = {0};
+char FTP_filename [FTP_NAME_SIZE] = {0};
 #if FTP_UPLOAD_RATE == FTP_UPLOAD_HOURLY
-  uint8_t lastUploadHour = 0;
+  uint8_t lastUploadHour = 0;           //  hour of the last upload of new records, see checkRecentUpload
+  uint32_t recentSeq = 0;               //  recordSeq at the last upload of new records
 #endif
+sampleBatch batch;
 /*
 setFileNames()
 Updates the SD_filename to correspond with the current date, then updates FTP_filename's filename by
-appending it after the base directory
+appending it after the base directory (see ftpPath). With SHARD_DIRS day files go into a "YYYY/MM/"
+directory. With SINGLE_FILE the name is that of the current segment, which is rotated first if it is full
+(see nextLogSegment). With SD_PREALLOCATE, a change of date also trims the previous file and preallocates the new
+one (see rollDataFile). In journal mode a change of file also saves the sequence number reached so far
+(see saveSeqMark).
 
 returns: 
 - 0 if directory is successfully saved
@@ -25,26 +39,47 @@ uint8_t setFileNames(char* SD_filename,                    // name of file stori
                     char* FTP_filename,                   //  name of file and directory for FTP server
                     uint8_t FTP_length)                   //  length of the FTP server directory
 {
+  #if SD_PREALLOCATE == 1 || SD_JOURNAL == 1
+    char previous [FILENAME_SIZE] = {0};            //  to notice the date rolling over
+    strncpy(previous, SD_filename, sizeof(previous) - 1);
+  #endif
+
+  strbuf name(SD_filename, SD_len);
+  #if SHARD_DIRS == 1
+    if( SD_FILEFORMAT != SINGLE_FILE )
+    {
+      name.appendf_P(PSTR("20%.2u/%.2u/"), RTC.year, RTC.month);
+    }
+  #endif
 
 //  update the SD filename based on the current date and format settings
   switch(SD_FILEFORMAT){
     case(DAY_MONTH_YEAR):
-      sprintf_P(SD_filename, PSTR("%.2u-%.2u-%.2u.csv"), RTC.date,RTC.month,RTC.year);
+      name.appendf_P(PSTR("%.2u-%.2u-%.2u" LOG_EXTENSION), RTC.date,RTC.month,RTC.year);
       break;
     case(YEAR_MONTH_DAY):
-      sprintf_P(SD_filename, PSTR("%.2u-%.2u-%.2u.csv"), RTC.year,RTC.month,RTC.date);   
+      name.appendf_P(PSTR("%.2u-%.2u-%.2u" LOG_EXTENSION), RTC.year,RTC.month,RTC.date);   
       break;
     case(SINGLE_FILE):
-      strcpy(SD_filename, "SENSOR_DATA");
+      nextLogSegment();
+      name.appendf_P(PSTR(LOG_SEGMENT_PREFIX "%.5u" LOG_EXTENSION), logSegment);
       break;
   }
 
-  if(FTP_length > sizeof(FTP_DIR) + SD_len - 1)             //  check for name overflow
-  {
-    //  append the filename to the directory for the FTP server
-    strcpy(FTP_filename, FTP_DIR);
-    strcpy(FTP_filename + sizeof(FTP_DIR) - 1, SD_filename);
+  #if SD_PREALLOCATE == 1 || SD_JOURNAL == 1
+    if( previous[0] != 0 && strcmp(previous, SD_filename) != 0 )
+    {
+      #if SD_PREALLOCATE == 1
+        rollDataFile(previous, SD_filename);        //  trim yesterday's file, preallocate today's
+      #endif
+      #if SD_JOURNAL == 1
+        saveSeqMark();                              //  after the roll, which still checks against the old floor
+      #endif
+    }
+  #endif
 
+  if( ftpPath(SD_filename, FTP_filename, FTP_length) == 0 )
+  {
     #if GLACIERPROBE_DEBUG == 1
       USB.println(F("Directory successfully created"));
     #endif
@@ -58,316 +93,1689 @@ uint8_t setFileNames(char* SD_filename,                    // name of file stori
 }
 
 /*
-writeDataSet()
-Formats a large characterarray dataString representing the key value pairs. Keys are separated from their
-values with equal signs, keyval pairs are separated from each other with commas, and cyles of measurements are
-separated with semicolons.
+nextLogSegment()
+Moves logSegment on to a new segment when the current one holds LOG_SEGMENT_RECORDS records or
+LOG_SEGMENT_BYTES bytes. After a reboot the count of the last segment is unknown, so the first call
+always starts a new segment after the newest one, see findLogSegment().
+ */
 
-returns: 
-- 0 if dataSet is successfully saved to SD file
-- 1 if directory is not successfully saved
-- 2 if SD card fails to initialize
-- 3 if SD failed to append data to file
-- 4 if SD failed to close directory
-*/
+void nextLogSegment()
+{
+  if( logSegment == 0 )
+  {
+    logSegment = findLogSegment();
+  }
+  else if( segmentRecords < LOG_SEGMENT_RECORDS && segmentBytes < LOG_SEGMENT_BYTES )
+  {
+    return;                                         //  room left in the current segment
+  }
+
+  logSegment++;
+  if( logSegment == 0 )                             //  wrapped around, numbering starts at 1
+  {
+    logSegment = 1;
+  }
+  segmentRecords = 0;
+  segmentBytes = 0;
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Starting log segment %u\n", logSegment);
+  #endif
+}
 
-uint8_t writeDataSet(keyvalue* kvs, uint8_t numPairs, char* filename)
+/*
+findLogSegment()
+Finds the number of the newest segment: the highest "SEGnnnnn" data file in the root of the SD, as
+segments written while the battery was too low for uploads aren't in the upload state yet. The last
+slot of the upload state counts too, so numbers aren't used again on the server once the retention
+has deleted every segment on the SD.
+
+Returns:
+- the number of the newest segment
+- 0 if there is none, or the SD couldn't be read
+ */
+
+uint16_t findLogSegment()
 {
-  const uint8_t DATASIZE = 254;                 //  max length of the data string
+RTC.setWatchdog(8);
+//********** START 8 SECOND WATCHDOG ***************
 
-  //  Step 1:
-  //  set up the datastring to be written to the file
-  char dataString [DATASIZE] = { 0 };
-  uint8_t len = 0;
-  
-  for(int pairInd = 0; pairInd < numPairs; pairInd++)
-  {
-    //append the key string to the datastring
-    uint8_t size = sizeof(kvs[pairInd].key);
-    char* k = kvs[pairInd].key;
-    uint8_t index = 0;                          //  index of character array 'k'
-    
-    if(len + size < DATASIZE){                  //  if the key won't overflow the datastring
-      while( index < size && k[index] != 0){    //  making sure indices are in bounds and the character is not null
-        dataString[len] = k[index];
-        len++;
-        index++;
-      }
+  if(!sdOn())
+  {
+RTC.unSetWatchdog();
+    return 0;
+  }
+
+  uint16_t segment = 0;
+  char fname [FILENAME_SIZE] = {0};
+  dir_t entry;
+  SD.goRoot();
+  SD.currentDir.rewind();
+  while( SD.currentDir.readDir(&entry) > 0 )
+  {
+RTC.setWatchdog(8);
+
+    fname[0] = 0;
+    if( isDataFile(&entry, fname) &&
+        strncmp(fname, LOG_SEGMENT_PREFIX, sizeof(LOG_SEGMENT_PREFIX) - 1) == 0 )
+    {
+      segment = max(segment, (uint16_t) atol(fname + sizeof(LOG_SEGMENT_PREFIX) - 1));
     }
-    else{
-      #if GLACIERPROBE_DEBUG == 1
-        USB.println(F("data string overflow."));
-      #endif
-      return 1;
+  }
+
+  if( openUploadState() == 0 )
+  {
+    uploadSlot slot;
+    if( readSlot(prevSlot(uploadState.tail), &slot) &&
+        strncasecmp(slot.name, LOG_SEGMENT_PREFIX, sizeof(LOG_SEGMENT_PREFIX) - 1) == 0 )  //  "seg" in old tables
+    {
+      segment = max(segment, (uint16_t) atol(slot.name + sizeof(LOG_SEGMENT_PREFIX) - 1));
     }
+    closeUploadState();
+  }
+
+  SD.OFF();
 
-    dataString[len] = '=';                      // separate the key from the value
-    len++;
+//********** END 8 SECOND WATCHDOG *****************
+RTC.unSetWatchdog();
+  return segment;
+}
 
-    //append the val string to the datastring
-    size = sizeof(kvs[pairInd].val);
-    char* v = kvs[pairInd].val;
-    index = 0;
-    if(len + size < DATASIZE){
-      while( index < size && v[index] != 0){
-        dataString[len] = v[index];
-        len++;
-        index++;
-      }
+/*
+ftpPath()
+Builds the path on the FTP server for a file on the SD. With SHARD_DIRS the SD path, including its
+"YYYY/MM/" directories, goes below FTP_DIR. Without it the filename is appended straight to FTP_DIR,
+the way files have always been named on the server.
+
+Returns:
+- 0 if the path was built
+- 1 if it doesn't fit into len bytes
+ */
+
+uint8_t ftpPath(const char* sdPath, char* ftp, uint8_t len)
+{
+  #if SHARD_DIRS == 1
+    const char separator [] = "/";
+  #else
+    const char separator [] = "";
+  #endif
+
+  strbuf path(ftp, len);
+  if( !path.append(FTP_DIR) || !path.append(separator) || !path.append(sdPath) )  //  check for name overflow
+  {
+    return 1;
+  }
+  return 0;
+}
+
+/*
+makeParentDir()
+Creates the directories leading up to a file on the SD, such as "2018/07/" for "2018/07/18-07-26.bin".
+The SD must already be on.
+
+Returns:
+- true if the directories exist
+- false if they couldn't be created
+ */
+
+bool makeParentDir(const char* path)
+{
+  const char* slash = strrchr(path, '/');
+  if( slash == NULL )
+  {
+    return true;                                    //  file in the root
+  }
+
+  char dir [FILENAME_SIZE] = {0};
+  strncpy(dir, path, slash - path);
+  return SD.isDir(dir) == 1 || SD.mkdir(dir);
+}
+
+#if SD_LOGFORMAT == LOG_BINARY
+
+/*
+logChannels()
+Number of channels marked binary in CHANNEL_INFO, which is the number of values in every binary record.
+ */
+
+uint8_t logChannels()
+{
+  uint8_t channels = 0;
+  for(uint8_t i = 0; i < NUM_KEYVALS; i++)
+  {
+    if( pgm_read_byte(&CHANNEL_INFO[i].binary) )
+    {
+      channels++;
     }
-    else{
-      #if GLACIERPROBE_DEBUG == 1
-        USB.println(F("data string overflow."));
-      #endif
-      return 1;
+  }
+  return channels;
+}
+
+/*
+logRecordSize()
+Size in bytes of a binary record with the given number of channels: an optional sequence number, the
+epoch time, one int32 per channel and an optional CRC.
+ */
+
+uint16_t logRecordSize(uint8_t channels)
+{
+  #if SD_JOURNAL == 1
+    return sizeof(uint32_t) + sizeof(uint32_t) + channels * sizeof(int32_t) + sizeof(uint16_t);
+  #else
+    return sizeof(uint32_t) + channels * sizeof(int32_t);
+  #endif
+}
+
+/*
+writeLogHeader()
+Writes the schema header of a binary log file at the current position of an open, newly created file.
+The header is:
+
+  char    magic [4]       "GPBL"
+  uint8   version         LOG_VERSION
+  uint8   channels        number of logged channels
+  uint16  recordSize      bytes per record, see logRecordSize()
+  uint8   flags           LOG_FLAG_JOURNAL if records are journaled,
+                          LOG_FLAG_SECTORS if the file was preallocated
+  uint16  day             day the file was created, in days since 1970, 0 in older files
+  uint8   reserved
+
+followed by one descriptor per logged channel:
+
+  char    name [16]       key of the channel in CHANNEL_INFO
+  char    unit [6]
+  uint8   decimals        stored value = measurement * 10^decimals
+
+Records are [uint32 seq] uint32 epoch, int32 value [channels], [uint16 crc], where seq and crc are only
+present in journal mode. In a preallocated file the records start at offset LOG_SECTOR_SIZE and the rest
+of a sector is skipped when the next record wouldn't fit in it. All multi-byte fields are little endian.
+
+Returns:
+- 0 if the header was written
+- 1 if the SD failed to write it
+ */
+
+uint8_t writeLogHeader(SdFile* file)
+{
+  uint8_t channels = logChannels();
+
+  uint8_t header [LOG_HEADER_SIZE] = {0};
+  memcpy(header, LOG_MAGIC, 4);
+  header[4] = LOG_VERSION;
+  header[5] = channels;
+  uint16_t recordSize = logRecordSize(channels);
+  memcpy(header + 6, &recordSize, sizeof(recordSize));
+  #if SD_JOURNAL == 1
+    header[8] |= LOG_FLAG_JOURNAL;
+  #endif
+  #if SD_PREALLOCATE == 1
+    header[8] |= LOG_FLAG_SECTORS;
+  #endif
+  uint16_t day = RTC.getEpochTime() / 86400L;
+  memcpy(header + 9, &day, sizeof(day));
+
+  if( file->write(header, sizeof(header)) != sizeof(header) )
+  {
+    return 1;
+  }
+
+  for(uint8_t i = 0; i < NUM_KEYVALS; i++)
+  {
+    channelInfo info;
+    memcpy_P(&info, &CHANNEL_INFO[i], sizeof(info));
+    if( !info.binary )
+    {
+      continue;
     }
-    
-    if(pairInd < numPairs-1)                  //  if it isn't the last keyvalue, separate with a comma
+
+    uint8_t descriptor [LOG_CHANNEL_SIZE] = {0};
+    strncpy((char*) descriptor, info.key, sizeof(info.key));
+    memcpy(descriptor + keyvalue::KEYVAL_STRING_SIZE, info.unit, sizeof(info.unit));
+    descriptor[sizeof(descriptor) - 1] = info.decimals;
+
+    if( file->write(descriptor, sizeof(descriptor)) != sizeof(descriptor) )
     {
-      dataString[len] = ',';
-      len++;
+      return 1;
     }
   }
-  
-  if(len < DATASIZE-1)                        //  if doing so won't overflow the string
+
+  return 0;
+}
+
+#if SD_PREALLOCATE == 1
+
+/*
+alignRecord()
+Moves a write position to the start of the next sector if a record at that position would straddle
+a sector boundary, so every record can be written and read within a single sector.
+ */
+
+uint32_t alignRecord(uint32_t offset, uint16_t recordSize)
+{
+  uint16_t used = offset % LOG_SECTOR_SIZE;
+  if( used + recordSize > LOG_SECTOR_SIZE )
+  {
+    offset += LOG_SECTOR_SIZE - used;
+  }
+  return offset;
+}
+
+/*
+preallocateDataFile()
+Creates a data file as a single contiguous extent big enough for LOG_PREALLOC_RECORDS records, writes the
+log header into its first sector and points logOffset at the start of the second sector. The extent isn't
+cleared and may hold records of a deleted file, so the second sector is zeroed, which ends the walk of
+findLogOffset() there until the first record is written. The SD must already be on.
+
+Returns:
+- true if the file was created
+- false if there is no contiguous space for it, or the header couldn't be written
+ */
+
+bool preallocateDataFile(char* fname)
+{
+  uint16_t recordSize = logRecordSize(logChannels());
+  uint16_t perSector = LOG_SECTOR_SIZE / recordSize;
+  uint32_t size = LOG_SECTOR_SIZE * ( 1 + ( LOG_PREALLOC_RECORDS + perSector - 1 ) / perSector );
+
+  //  createContiguous only takes a plain name, so change into the file's directory first
+  const char* name = fname;
+  const char* slash = strrchr(fname, '/');
+  if( slash != NULL )
   {
-  dataString[len] = ';';                      //  add a semicolon to delineate successive measurement cycles
-  len++;
-  dataString[len] = 0;                        //  terminate the string
-  len++;
+    char dir [FILENAME_SIZE] = {0};
+    strncpy(dir, fname, slash - fname);
+    if( !makeParentDir(fname) || !SD.cd(dir) )
+    {
+      SD.goRoot();
+      return false;
+    }
+    name = slash + 1;
   }
-  else                                        //  too many characters to fit in dataString
+
+  SdFile file;
+  if( !file.createContiguous(&SD.currentDir, name, size) )
   {
     #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("data string too long."));
+      USB.println(F("Failed to preallocate file"));
     #endif
-    return 1;
+    SD.goRoot();
+    return false;
+  }
+
+  bool written = writeLogHeader(&file) == 0 && file.seekSet(LOG_SECTOR_SIZE);
+  uint8_t zero [32] = {0};
+  for(uint16_t i = 0; i < LOG_SECTOR_SIZE && written; i += sizeof(zero))
+  {
+    written = file.write(zero, sizeof(zero)) == sizeof(zero);
   }
+  sdClose(&file);
+  SD.goRoot();
+  logOffset = LOG_SECTOR_SIZE;
 
-  // print out the dataString to verify its format
   #if GLACIERPROBE_DEBUG == 1
-    for(int i = 0; i<sizeof(dataString); i++){
-      USB.print(dataString[i]);
-    }
+    USB.printf("Preallocated %lu bytes\n", size);
   #endif
+  return written;
+}
 
+/*
+findLogOffset()
+Finds the write position of an open preallocated file after a reset by walking its records from the
+start. The space after the last record holds whatever was on the card before, possibly valid records of a
+deleted file, so the walk stops at the first record that fails its CRC or doesn't continue the sequence
+numbers. The first record must also be newer than floor, and every record must be from around the day
+in the file's header. recordSeq is restored from the last good record.
+
+Returns: offset of the first free record position
+ */
 
-RTC.setWatchdog(2);
-//********** START 2 SECOND WATCHDOG ***************
+uint32_t findLogOffset(SdFile* file, uint16_t recordSize, uint32_t floor)
+{
+  uint8_t record [sizeof(uint32_t) + sizeof(uint32_t) + NUM_KEYVALS * sizeof(int32_t) + sizeof(uint16_t)];
+  uint32_t size = file->fileSize();
+  uint32_t offset = LOG_SECTOR_SIZE;
+  uint32_t seq = floor;
+  bool first = true;
+
+  uint16_t day = 0;                             //  0 in files written before the day was kept
+  if( file->seekSet(9) )
+  {
+    file->read(&day, sizeof(day));
+  }
 
-  //  Step 2: 
-  //  initialize the SD card
-  if(!SD.ON())                                //  if the SD card fails to turn on
+  while( recordSize <= sizeof(record) &&
+         alignRecord(offset, recordSize) + recordSize <= size )
   {
-    #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("Failed to init SD"));
-    #endif
+    uint32_t pos = alignRecord(offset, recordSize);
+    if( pos % LOG_SECTOR_SIZE == 0 )
+    {
+RTC.setWatchdog(8);                             //  a full day takes a while to walk
+    }
 
-RTC.unSetWatchdog();
-    return 2;
+    if( !file->seekSet(pos) || file->read(record, recordSize) != recordSize )
+    {
+      break;
+    }
+
+    uint16_t crc;
+    uint32_t recSeq;
+    uint32_t epoch;
+    memcpy(&crc, record + recordSize - sizeof(crc), sizeof(crc));
+    memcpy(&recSeq, record, sizeof(recSeq));
+    memcpy(&epoch, record + sizeof(recSeq), sizeof(epoch));
+    uint16_t recDay = epoch / 86400L;
+    if( crc16(record, recordSize - sizeof(crc), 0xFFFF) != crc ||
+        ( first ? (int32_t) ( recSeq - seq ) <= 0 : recSeq != seq + 1 ) ||
+        ( day != 0 && ( recDay + 1 < day || recDay > day + 1 ) ) )   //  a day either side for a late flush
+    {
+      break;
+    }
+
+    seq = recSeq;
+    first = false;
+    offset = pos + recordSize;
   }
 
-  #if GLACIERPROBE_DEBUG == 1
-    USB.println(filename);
-  #endif
-  
-  //  Step 3:
-  //  Check if file exists, if not then create it, open the file
-  if(SD.isFile(filename)==-1)
+  if( !first )
   {
-    SD.create(filename);
-    #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("File created"));
-    #endif
+    recordSeq = seq;
   }
+  return offset;
+}
 
-  //  Step 4:
-  //  Append dataString to the end of the file on a new line.
-  if(SD.appendln(filename, dataString))
+/*
+finalizeDataFile()
+Trims the unused, preallocated tail off a finished day's file so it can be uploaded like any other file,
+marks it LOG_FLAG_FINAL so recoverRecords() leaves it alone after a reset, and forgets logOffset so the
+next file starts fresh. Called before saveSeqMark(), so seqFloor is still the floor of this file. The SD
+must already be on.
+
+Returns:
+- true if the file was trimmed, or doesn't exist
+- false if it couldn't be opened or truncated
+ */
+
+bool finalizeDataFile(char* fname)
+{
+  if( SD.isFile(fname) != 1 )
   {
-    #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("SD append success"));
-    #endif
+    logOffset = 0;
+    return true;
   }
-  else
+
+  SdFile file;
+  if( !sdOpen(fname, &file, O_RDWR) )
   {
-    #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("SD append failure"));
-      for(int i=0; i<sizeof(SD.buffer); i++)            // print out the error message stored in the SD object
-      {
-        USB.print(SD.buffer[i]);
-      }
-    #endif
-    
-    SD.OFF();
-RTC.unSetWatchdog();
-    return 3;
+    return false;
   }
 
-  //  Step 5:
-  //  Close the file and turn off the SD card
-  SdFile* currDir = &SD.currentDir;                     //  the directory to the file is stored as an SdFile object
-  uint8_t error = SD.closeFile(currDir);                //  closeFile takes the SdFile object, not the character array
-  
-  
-  if(error != 1)
+  if( logOffset == 0 )
   {
-    #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("Failed to close directory"));
-    #endif
-    SD.OFF();
-RTC.unSetWatchdog();
-    return 4;
+    logOffset = findLogOffset(&file, logRecordSize(logChannels()), seqFloor);
   }
-  
-  SD.OFF();                                             //  turn of the SD while we don't use it
-  
-//********** END 2 SECOND WATCHDOG *****************
-RTC.unSetWatchdog();
 
-  
-  #if GLACIERPROBE_DEBUG == 1
-    USB.println(F("SD write completed, directory closed"));
-  #endif
-  
-  return 0;
+  bool trimmed = logOffset >= file.fileSize() || file.truncate(logOffset);
+  uint8_t flags = 0;
+  if( trimmed && file.seekSet(8) && file.read(&flags, 1) == 1 )
+  {
+    flags |= LOG_FLAG_FINAL;
+    trimmed = file.seekSet(8) && file.write(&flags, 1) == 1;
+  }
+  sdClose(&file);
+  logOffset = 0;
+  return trimmed;
 }
 
 /*
-updateTimes()
-Updates the data interval dynamically, so if the interval is supposed to be 60 seconds but
-it has been 62 seconds since the last cycle then it will reduce the interval to 58. Also
-updates the seconds variable. Also checks the date to see if it has changed, and if so returns
-1 to indicate that the file should transmitted and a new file should be created.
+rollDataFile()
+Called by setFileNames() when the date rolls over: writes the records still batched for the old file,
+trims the old file and preallocates the new one, all in one SD session.
 
-Parameters:
-- uint16_t seconds: the timestamp in seconds
-- char wtoStr[12]: character array representing the wakeTimeOffset for setting the RTC alarm.
 Returns:
-- 0 if the date is the same
-- 1 if the date changed
+- 0 if the files were rolled over
+- 2 if the SD failed to initialize
+- 3 if the old file couldn't be trimmed or the new one preallocated
+ */
+
+uint8_t rollDataFile(char* oldName, char* newName)
+{
+  flushDataSet();
+
+RTC.setWatchdog(8);
+//********** START 8 SECOND WATCHDOG ***************
+
+  if(!sdOn())
+  {
+RTC.unSetWatchdog();
+    return 2;
+  }
+
+  uint8_t result = 0;
+  if( !finalizeDataFile(oldName) )
+  {
+    result = 3;
+  }
+  if( SD.isFile(newName) == -1 && !preallocateDataFile(newName) )
+  {
+    result = 3;
+  }
+
+  SD.OFF();
+
+//********** END 8 SECOND WATCHDOG *****************
+RTC.unSetWatchdog();
+  return result;
+}
+
+#endif
+
+#endif
+
+/*
+serializeRecord()
+Serializes one measurement cycle straight into the free part of the RAM batch (see serializer.h). In
+LOG_TEXT format keys are separated from their values with equal signs, keyval pairs are separated from each
+other with commas, and cycles of measurements end with a semicolon and a line break. In LOG_BINARY format
+the cycle is a fixed-width record: the epoch time of the cycle followed by one scaled int32 for every
+channel marked binary in CHANNEL_INFO, or LOG_MISSING if the channel wasn't measured. In journal mode a record starts with the next sequence
+number and ends with a CRC-16 over everything before it, taken from the sink as it writes.
+
+Returns:
+- 0 if the record was serialized, with its length stored in len
+- 1 if it doesn't fit into the batch
+ */
+
+uint8_t serializeRecord(const sampleRecord* sample, uint16_t* len)
+{
+  uint16_t space = sizeof(batch.data) - batch.len;
+
+#if SD_LOGFORMAT == LOG_BINARY
+
+  ramSink sink(batch.data + batch.len, space);
+
+  #if SD_JOURNAL == 1
+    uint32_t seq = recordSeq + 1;
+    sink.write((uint8_t*) &seq, sizeof(seq));
+  #endif
+
+  sink.write((uint8_t*) &sampleEpoch, sizeof(sampleEpoch));
+  for(uint8_t ch = 0; ch < NUM_KEYVALS; ch++)
+  {
+    if( !pgm_read_byte(&CHANNEL_INFO[ch].binary) )
+    {
+      continue;                                 //  compiled-out sensors take no space
+    }
+    int32_t value = ( sample->valid & SAMPLE_BIT(ch) ) ? sample->value[ch] : LOG_MISSING;
+    sink.write((uint8_t*) &value, sizeof(value));
+  }
+
+  #if SD_JOURNAL == 1
+    uint16_t crc = sink.crc;
+    sink.write((uint8_t*) &crc, sizeof(crc));
+  #endif
+
+#else
+
+  ramSink sink(batch.data + batch.len, min(space, LOG_LINE_SIZE - 1));   //  recovery has to see the line break before a line
+
+  #if SD_JOURNAL == 1
+    sink.print("seq=");                         //  journal records start with their sequence number
+    sink.print(recordSeq + 1);
+    sink.print(',');
+  #endif
+
+  serializeFields(&sink, sample, sampleField, NUM_KEYVALS, KV_CSV);
+
+  #if SD_JOURNAL == 1                           //  journal records end with "*XXXX", the CRC of everything before it
+    char crc [6] = { 0 };
+    sprintf_P(crc, PSTR("*%04X"), sink.crc);
+    sink.print(crc);
+  #endif
+
+  sink.print("\r\n");                           //  each cycle goes on its own line
+
+#endif
+
+  *len = sink.len;
+  return sink.failed ? 1 : 0;
+}
+
+/*
+writeDataSet()
+Writes one measurement cycle to the SD file, serialized by serializeRecord(). A new binary file starts with
+the schema header (see writeLogHeader).
+
+Records are collected in the RAM batch and only written to the SD by flushDataSet() once batchSize()
+cycles have been collected, or earlier if the file changes or the batch is full. If the SD keeps failing
+the old records have to go to make room.
+
+returns: 
+- 0 if dataSet is successfully batched or saved to SD file
+- 1 if the record doesn't fit into an empty batch
+- 2 if SD card fails to initialize
+- 3 if SD failed to append data to file
+- 4 if SD failed to close directory
+*/
+
+uint8_t writeDataSet(const sampleRecord* sample, char* filename)
+{
+  //  Step 1:
+  //  The batch only holds records of a single file, so write it out first if the file changed.
+  if( batch.count > 0 && strcmp(batch.filename, filename) != 0 )
+  {
+    dropFailedBatch(flushDataSet());
+  }
+
+  //  Step 2:
+  //  Serialize the record into the batch, writing the batch out to make room if it won't fit.
+  uint16_t len = 0;
+  uint8_t result = serializeRecord(sample, &len);
+  if( result != 0 && batch.count > 0 )
+  {
+    dropFailedBatch(flushDataSet());
+    result = serializeRecord(sample, &len);
+  }
+  if( result != 0 )
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("data record too long."));
+    #endif
+    return 1;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    for(uint16_t i = 0; i < len; i++){
+      #if SD_LOGFORMAT == LOG_BINARY
+        USB.printf("%02X", batch.data[batch.len + i]);
+      #else
+        USB.print((char) batch.data[batch.len + i]);
+      #endif
+    }
+    USB.println();
+  #endif
+
+  //  Step 3:
+  //  Account for the record in the batch
+  if( batch.count == 0 )
+  {
+    strncpy(batch.filename, filename, sizeof(batch.filename) - 1);
+  }
+  batch.len += len;
+  batch.count++;
+  recordSeq++;
+
+  #if SD_FILEFORMAT == SINGLE_FILE
+    segmentRecords++;                           //  counts towards rotating the segment
+    segmentBytes += len;
+  #endif
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Batched %u of %u records\n", batch.count, batchSize());
+  #endif
+
+  //  Step 4:
+  //  Write the batch to the SD once it holds enough cycles for the current battery level
+  if( batch.count >= batchSize() )
+  {
+    return flushDataSet();
+  }
+
+  return 0;
+}
+
+/*
+dropFailedBatch()
+Empties the batch if flushing it failed, so new records still have room.
+ */
+
+void dropFailedBatch(uint8_t flushResult)
+{
+  if( flushResult != 0 )
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.printf("Dropping %u unwritten records\n", batch.count);
+    #endif
+    batch.count = 0;
+    batch.len = 0;
+  }
+}
+
+/*
+batchSize()
+Number of measurement cycles that are collected in RAM before they are written to the SD. The lower the
+battery level the more cycles are batched, trading possible data loss for fewer SD power-ups.
+ */
+
+uint8_t batchSize()
+{
+  switch( battery )
+  {
+    case BL_HIGH:
+      return LOG_BATCH_HIGH;
+    case BL_MEDIUM:
+      return LOG_BATCH_MEDIUM;
+    case BL_LOW:
+      return LOG_BATCH_LOW;
+    default:
+      return LOG_BATCH_CRITICAL;
+  }
+}
+
+/*
+writeBatch()
+Appends all batched records to the batch's file in a single write, creating the file (and its binary log
+header) if it doesn't exist yet. The batch is emptied once the records are on the card. Expects the SD to
+already be on and leaves it on, so it can be used in the middle of other SD work.
+
+returns:
+- 0 if the batch was written, or was empty
+- 3 if SD failed to append data to file
+- 4 if SD failed to close directory
+ */
+
+uint8_t writeBatch()
+{
+  if( batch.count == 0 )
+  {
+    return 0;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.println(batch.filename);
+  #endif
+
+#if SD_PREALLOCATE == 1
+
+  //  Create the file as one contiguous extent if it doesn't exist
+  if( SD.isFile(batch.filename) == -1 && !preallocateDataFile(batch.filename) )
+  {
+    return 3;
+  }
+
+  SdFile file;
+  if( !sdOpen(batch.filename, &file, O_RDWR) )
+  {
+    return 3;
+  }
+
+  uint16_t recordSize = logRecordSize(logChannels());
+  if( logOffset == 0 )                                  //  first write after a reset
+  {
+    logOffset = findLogOffset(&file, recordSize, seqFloor);
+  }
+
+  //  Write the records at the tracked offset, skipping to the next sector when one wouldn't fit. The SD
+  //  caches a whole sector, so the card only sees one write per sector.
+  for(uint16_t i = 0; i < batch.len; i += recordSize)
+  {
+    logOffset = alignRecord(logOffset, recordSize);
+    if( !file.seekSet(logOffset) || file.write(batch.data + i, recordSize) != recordSize )
+    {
+      #if GLACIERPROBE_DEBUG == 1
+        USB.println(F("SD write failure"));
+      #endif
+      sdClose(&file);
+      return 3;
+    }
+    logOffset += recordSize;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("SD write success, %u records, offset %lu\n", batch.count, logOffset);
+  #endif
+
+  bool closed = sdClose(&file);
+  batch.count = 0;                                      //  the records are safe on the card now
+  batch.len = 0;
+
+  if( !closed )
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("Failed to close file"));
+    #endif
+    return 4;
+  }
+
+  return 0;
+
+#else
+
+  //  Check if file exists, if not then create it
+  if(SD.isFile(batch.filename)==-1)
+  {
+    makeParentDir(batch.filename);
+    SD.create(batch.filename);
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("File created"));
+    #endif
+
+    #if SD_LOGFORMAT == LOG_BINARY
+    SdFile file;
+    bool written = sdOpen(batch.filename, &file, O_RDWR) &&
+                   writeLogHeader(&file) == 0;
+    sdClose(&file);
+    if( !written )
+    {
+      #if GLACIERPROBE_DEBUG == 1
+        USB.println(F("Failed to write log header"));
+      #endif
+      return 3;
+    }
+    #endif
+  }
+
+  //  Append every batched record to the end of the file at once
+  if(sdAppend(batch.filename, batch.data, batch.len))
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.printf("SD append success, %u records\n", batch.count);
+    #endif
+  }
+  else
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("SD append failure"));
+      for(int i=0; i<sizeof(SD.buffer); i++)            // print out the error message stored in the SD object
+      {
+        USB.print(SD.buffer[i]);
+      }
+    #endif
+    return 3;
+  }
+
+  batch.count = 0;                                      //  the records are safe on the card now
+  batch.len = 0;
+
+  //  Close the file
+  SdFile* currDir = &SD.currentDir;                     //  the directory to the file is stored as an SdFile object
+  uint8_t error = sdClose(currDir);                //  closeFile takes the SdFile object, not the character array
+  
+  if(error != 1)
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("Failed to close directory"));
+    #endif
+    return 4;
+  }
+
+  return 0;
+
+#endif
+}
+
+/*
+siblingName()
+Builds the name of a file that goes with a data file, such as its packed copy, by replacing the extension of the
+data file with ext, or appending it if there is none. sibling must hold FILENAME_SIZE bytes.
+ */
+
+void siblingName(const char* fname, const char* ext, char* sibling)
+{
+  strbuf name(sibling, FILENAME_SIZE);
+  name.append(fname);
+
+  const char* dot = strrchr(name.c_str(), '.');
+  if( dot != NULL && strchr(dot, '/') == NULL )
+  {
+    name.truncate(dot - name.c_str());
+  }
+  name.truncate(FILENAME_SIZE - 1 - strlen(ext));   //  always leave room for the extension
+  name.append(ext);
+}
+
+/*
+flushDataSet()
+Turns the SD on, writes out any records still held in the RAM batch, and turns it off again. Call this
+before anything that needs the data file to be complete or that would lose RAM, such as an FTP upload of
+the file, a change of battery level or a reboot. Deep sleep keeps RAM, so the batch survives between cycles.
+
+returns:
+- 0 if the batch was written, or was empty
+- 2 if SD card fails to initialize
+- 3 if SD failed to append data to file
+- 4 if SD failed to close directory
+ */
+
+uint8_t flushDataSet()
+{
+  if( batch.count == 0 )
+  {
+    return 0;
+  }
+
+RTC.setWatchdog(2);
+//********** START 2 SECOND WATCHDOG ***************
+
+  if(!sdOn())                                //  if the SD card fails to turn on
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("Failed to init SD"));
+    #endif
+
+RTC.unSetWatchdog();
+    return 2;
+  }
+
+  uint8_t error = writeBatch();
+  
+  SD.OFF();                                             //  turn of the SD while we don't use it
+  
+//********** END 2 SECOND WATCHDOG *****************
+RTC.unSetWatchdog();
+
+  #if GLACIERPROBE_DEBUG == 1
+    if( error == 0 )
+    {
+      USB.println(F("SD write completed, directory closed"));
+    }
+  #endif
+  
+  return error;
+}
+
+#if SD_JOURNAL == 1
+
+#if SD_LOGFORMAT == LOG_BINARY
+
+/*
+recoverRecords()
+Cuts an open binary log file back to its last record with a valid CRC and restores recordSeq from it.
+Files with a torn header or written without journaling are left for the caller to deal with. For a
+preallocated file the write position is found again instead, and the file is trimmed unless it is the
+current day's file. seqFloor only bounds the records of the current file, or of a file at least as new as
+the one it was saved for; after a reset in the first cycle of a day the previous day's file is recovered
+with records below it. A file rollDataFile() already trimmed is left as it is.
+
+Returns:
+- 0 if the file now ends with a valid record, or has no records
+- 2 if the file couldn't be read or truncated
+- 3 if the header itself is torn and the file should be deleted
+ */
+
+uint8_t recoverRecords(SdFile* file, bool current)
+{
+  uint32_t size = file->fileSize();
+  uint8_t header [LOG_HEADER_SIZE];
+
+  if( size < LOG_HEADER_SIZE ||
+      !file->seekSet(0) ||
+      file->read(header, sizeof(header)) != sizeof(header) ||
+      memcmp(header, LOG_MAGIC, 4) != 0 )
+  {
+    return 3;
+  }
+
+  uint16_t recordSize;
+  memcpy(&recordSize, header + 6, sizeof(recordSize));
+  uint32_t start = LOG_HEADER_SIZE + (uint32_t) header[5] * LOG_CHANNEL_SIZE;
+
+  uint8_t record [sizeof(uint32_t) + sizeof(uint32_t) + NUM_KEYVALS * sizeof(int32_t) + sizeof(uint16_t)];
+
+  if( size < start )
+  {
+    return 3;
+  }
+  if( header[4] != LOG_VERSION ||               //  nothing to check records against
+      !( header[8] & LOG_FLAG_JOURNAL ) ||
+      recordSize > sizeof(record) ||
+      recordSize < sizeof(uint32_t) + sizeof(uint16_t) )
+  {
+    return 0;
+  }
+
+  #if SD_PREALLOCATE == 1
+  if( header[8] & LOG_FLAG_SECTORS )            //  preallocated, the end is found from the start instead
+  {
+    if( header[8] & LOG_FLAG_FINAL )
+    {
+      return 0;
+    }
+
+    uint16_t day;
+    memcpy(&day, header + 9, sizeof(day));
+    bool floored = current || ( day != 0 && (int16_t) ( day - seqFloorDay ) >= 0 );
+    logOffset = findLogOffset(file, recordSize, floored ? seqFloor : 0);
+    if( !current )                              //  the day ended while the mote was down, trim it now
+    {
+      bool trimmed = logOffset >= size || file->truncate(logOffset);
+      logOffset = 0;
+      return trimmed ? 0 : 2;
+    }
+    return 0;
+  }
+  #endif
+
+  //  walk back from the last whole record until one passes its CRC
+  uint32_t records = ( size - start ) / recordSize;
+  while( records > 0 )
+  {
+RTC.setWatchdog(8);
+
+    if( !file->seekSet(start + ( records - 1 ) * recordSize) ||
+        file->read(record, recordSize) != recordSize )
+    {
+      return 2;
+    }
+
+    uint16_t crc;
+    memcpy(&crc, record + recordSize - sizeof(crc), sizeof(crc));
+    if( crc16(record, recordSize - sizeof(crc), 0xFFFF) == crc )
+    {
+      memcpy(&recordSeq, record, sizeof(recordSeq));
+      break;
+    }
+
+    records--;
+  }
+
+  uint32_t valid = start + records * recordSize;
+  if( valid != size )
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.printf("Truncating %lu torn bytes\n", size - valid);
+    #endif
+    if( !file->truncate(valid) )
+    {
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+#else
+
+/*
+recoverRecords()
+Cuts an open text log file back to its last complete line whose "*XXXX" CRC matches and restores
+recordSeq from its "seq=" key. Lines are never longer than LOG_LINE_SIZE (see serializeRecord), so the last
+line always fits in the window read from the end of the file. Lines without a sequence number were written
+before journaling was turned on and are left alone.
+
+Returns:
+- 0 if the file now ends with a valid record, or has no journaled records
+- 2 if the file couldn't be read or truncated
+ */
+
+uint8_t recoverRecords(SdFile* file, bool current)
+{
+  char window [LOG_LINE_SIZE];
+
+  while( true )
+  {
+RTC.setWatchdog(8);
+
+    uint32_t size = file->fileSize();
+    if( size == 0 )
+    {
+      return 0;
+    }
+
+    uint16_t n = size < sizeof(window) ? size : sizeof(window);
+    uint32_t offset = size - n;
+    if( !file->seekSet(offset) || file->read(window, n) != n )
+    {
+      return 2;
+    }
+
+    //  the file has to end with a line break, anything after the last one is a torn line
+    int16_t end = n - 1;
+    while( end >= 0 && window[end] != '\n' )
+    {
+      end--;
+    }
+
+    //  start of the last complete line
+    int16_t lineStart = end - 1;
+    while( lineStart >= 0 && window[lineStart] != '\n' )
+    {
+      lineStart--;
+    }
+    lineStart++;
+
+    uint32_t cut = size;
+    if( end < 0 )                               //  no line break at all in the window
+    {
+      cut = offset;
+    }
+    else if( end != n - 1 )                     //  torn line after the last line break
+    {
+      cut = offset + end + 1;
+    }
+    else if( lineStart == 0 && offset > 0 )     //  a line longer than any record can be
+    {
+      cut = offset;
+    }
+    else if( strncmp(window + lineStart, "seq=", 4) != 0 )
+    {
+      return 0;                                 //  written before journaling, can't be checked
+    }
+    else
+    {
+      //  a journaled line ends with ";*XXXX\r\n"
+      int16_t star = end - 6;
+      if( star > lineStart &&
+          window[star] == '*' &&
+          crc16((uint8_t*) window + lineStart, star - lineStart, 0xFFFF) == strtoul(window + star + 1, NULL, 16) )
+      {
+        recordSeq = strtoul(window + lineStart + 4, NULL, 10);
+        return 0;
+      }
+      cut = offset + lineStart;                 //  drop the corrupt line and check the one before it
+    }
+
+    #if GLACIERPROBE_DEBUG == 1
+      USB.printf("Truncating %lu torn bytes\n", size - cut);
+    #endif
+    if( !file->truncate(cut) )
+    {
+      return 2;
+    }
+  }
+}
+
+#endif
+
+#endif
+
+/*
+recoverDataFile()
+Boot-time recovery for journal mode. The newest data file (the last file in the upload state, or the
+current SD_filename if there isn't one) is cut back to its last complete record with a valid CRC, so a
+record torn by a watchdog reset in the middle of an append never reaches the server. The sequence number
+of that record is restored so numbering continues across the reboot. A binary file whose header was torn
+holds no records and is deleted, so it gets a fresh header with the next write. If the file doesn't exist
+yet, such as just after the date rolled over, or holds no valid record, numbering continues from the
+sequence number saved in EEPROM when it was started (see saveSeqMark), never from 1.
+
+Returns:
+- 0 if the file is valid or there was nothing to recover
+- 1 if the SD fails to initialize
+- 2 if the file couldn't be opened, read or truncated
+ */
+
+uint8_t recoverDataFile()
+{
+#if SD_JOURNAL == 1
+
+RTC.setWatchdog(8);
+//********** START 8 SECOND WATCHDOG ***************
+
+  if(!sdOn())
+  {
+RTC.unSetWatchdog();
+    return 1;                           //  SD failed to initialize
+  }
+
+  seqMark mark;
+  eeprom_read_block(&mark, (const void*) SEQ_EEPROM_START, sizeof(mark));
+  if( crc16((const uint8_t*) &mark, sizeof(mark) - sizeof(mark.crc), 0xFFFF) == mark.crc )
+  {
+    seqFloor = mark.seq;
+    seqFloorDay = mark.day;
+    recordSeq = seqFloor;
+  }
+
+  char fname [FILENAME_SIZE + 1] = {0};
+  strncpy(fname, SD_filename, sizeof(fname) - 1);
+
+  if( openUploadState() == 0 )
+  {
+    uploadSlot slot;
+    if( readSlot(prevSlot(uploadState.tail), &slot) )
+    {
+      memset(fname, 0, sizeof(fname));
+      strncpy(fname, slot.name, sizeof(slot.name));
+    }
+    closeUploadState();
+  }
+
+  uint8_t result = 0;
+  if( SD.isFile(fname) == 1 )
+  {
+    SdFile file;
+    if( !sdOpen(fname, &file, O_RDWR) )
+    {
+      result = 2;
+    }
+    else
+    {
+      result = recoverRecords(&file, strcmp(fname, SD_filename) == 0);
+      sdClose(&file);
+    }
+
+    if( result == 3 )
+    {
+      SD.del(fname);
+      result = 0;
+    }
+  }
+
+  if( (int32_t) ( recordSeq - seqFloor ) < 0 )  //  the file's records are all older than the mark
+  {
+    recordSeq = seqFloor;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Recovered %s, last sequence number %lu\n", fname, recordSeq);
+  #endif
+
+  SD.OFF();
+
+//********** END 8 SECOND WATCHDOG *****************
+RTC.unSetWatchdog();
+  return result;
+
+#else
+  return 0;
+#endif
+}
+
+/*
+saveSeqMark()
+Saves recordSeq to the EEPROM as the floor of the data file that is started next, together with that
+file's day, so recoverDataFile() can continue numbering from it even if that file holds no record yet.
+Only called when the file changes, about once a day, so the EEPROM isn't worn down.
+ */
+
+void saveSeqMark()
+{
+#if SD_JOURNAL == 1
+  seqMark mark;
+  mark.seq = recordSeq;
+  mark.day = RTC.getEpochTime() / 86400L;         //  the same day writeLogHeader() gives the new file
+  mark.crc = crc16((const uint8_t*) &mark, sizeof(mark) - sizeof(mark.crc), 0xFFFF);
+  eeprom_update_block(&mark, (void*) SEQ_EEPROM_START, sizeof(mark));
+  seqFloor = mark.seq;
+  seqFloorDay = mark.day;
+#endif
+}
+
+/*
+updateTimes()
+Updates the data interval dynamically, so if the interval is supposed to be 60 seconds but
+it has been 62 seconds since the last cycle then it will reduce the interval to 58. Also
+updates the seconds variable. Also checks the date to see if it has changed, and if so returns
+1 to indicate that the file should transmitted and a new file should be created.
+
+Parameters:
+- sampleRecord* sample: the sample whose KV_SECONDS channel gets the second of the day
+- char wtoStr[12]: character array representing the wakeTimeOffset for setting the RTC alarm.
+Returns:
+- 0 if the date is the same
+- 1 if the date changed
+ */
+ 
+bool updateTimes( sampleRecord* sample,
+                  char wtoStr [12]){
+  
+  uint32_t lastTime = (uint32_t) RTC.hour * 3600 + RTC.minute*60 + RTC.second;
+
+RTC.setWatchdog(2);
+//********** START 2 SECOND WATCHDOG ***************
+  
+  RTC.getTime();                                                  //  update the time variables
+  sampleEpoch = RTC.getEpochTime();                               //  full timestamp for binary records
+  //get the new time
+  uint32_t currentTime = (uint32_t) RTC.hour*3600 + RTC.minute*60 + RTC.second;
+  setSample(sample, KV_SECONDS, currentTime);                     //  the second of the day
+
+  //update the wakeTime interval. If the battery is low, double the time the device will sleep.
+  timestamp_t wto;
+  uint8_t multiplier = 1;
+  if( battery == BL_MEDIUM )
+  {
+    multiplier = 6;
+  }
+  if( battery == BL_LOW )
+  {
+    multiplier = 20;
+  }
+  if( battery == BL_CRITICAL )
+  {
+    multiplier = 25;
+  }
+  
+  RTC.breakTimeOffset(DATA_INTERVAL * multiplier, &wto);
+  
+  sprintf_P(wtoStr, PSTR("%.2u:%.2u:%.2u:%.2u"), wto.date, wto.hour, wto.minute, wto.second);
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("lastDATE: %u\tcurrDATE: %u\n",lastDate, RTC.date);
+  #endif
+
+//********** END 2 SECOND WATCHDOG *****************
+RTC.unSetWatchdog();
+  
+  if(RTC.date != lastDate){ 
+    lastDate = RTC.date;             
+    return 1;                            //  the day changed            
+  }
+
+  return 0;                              // the day didn't change
+  
+}
+
+/*
+unsentFile()
+Adds the current SD_filename to the tail of the upload state (see uploadstate.h), so it can later be
+checked for files that have not been sent due to errors such as a loss of connection and the device can
+retry sending them. Only the last slot is compared, so a file that is already the newest entry isn't
+added twice.
+
+Returns:
+- 0 if the file was successfully added to the list
+- 1 if the SD fails to initialize
+- 2 if the SD couldn't append the filename for some reason
+ */
+
+uint8_t appendUnsentFile()
+{
+  
+RTC.setWatchdog(2);
+//********** START 2 SECOND WATCHDOG ***************
+  
+  if(!sdOn())
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("Failed to init SD"));
+    #endif
+RTC.unSetWatchdog();
+    return 1;                           //  SD failed to initialize
+  }
+
+  if( openUploadState() != 0 )
+  {
+    SD.OFF();
+RTC.unSetWatchdog();
+    return 2;
+  }
+
+  if( lastSlotIs(SD_filename) ||        //  already the newest file in the list
+      addSlot(SD_filename, 0) )         //  or successfully added
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("file added to list of unsent files"));
+    #endif
+    collectSentFiles();                 //  make room for the new file if the SD is filling up
+    closeUploadState();
+    SD.OFF();
+RTC.unSetWatchdog();
+    return 0;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1           //  otherwise something went wrong
+    USB.println(F("ERROR: Could not append filename to list of unsent files."));
+  #endif
+  closeUploadState();
+  SD.OFF();
+  
+//********** END 2 SECOND WATCHDOG *****************
+RTC.unSetWatchdog();
+  return 2;
+  
+}
+
+/*
+beginWalk()
+Starts a walk through the upload state at slot from, see findUnsentSlot().
+ */
+
+void beginWalk(uploadWalk* walk, uint16_t from)
+{
+  memset(walk, 0, sizeof(uploadWalk));
+  walk->idx = from;
+  walk->current = from;
+  walk->status = UPLOAD_WALK_OPEN;
+  walk->start = from;
+  walk->cursor = from;
+}
+
+/*
+findUnsentSlot()
+Moves walk->idx forward to the next slot whose file hasn't been sent, stopping at the current day's file,
+which is still being written. A walk that started past the head, at the cursor of a slice, goes on from
+the head once it gets there, up to the slot it started at. A slot that fails its check is repaired on the
+way, see repairSlot(). The upload state must be open.
+
+Returns:
+- true if walk->idx is an unsent file
+- false if there is none, with the reason in walk->status
+ */
+
+bool findUnsentSlot(uploadWalk* walk)
+{
+  uploadSlot slot;
+  while( true )
+  {
+    bool end = walk->wrapped ? ( walk->idx == walk->start ) : ( walk->idx == uploadState.tail );
+    if( !end )
+    {
+      if( !readSlot(walk->idx, &slot) && !repairSlot(walk->idx, &slot) )
+      {
+        walk->status = UPLOAD_WALK_CORRUPT;
+        return false;
+      }
+
+      end = slotIs(&slot, SD_filename); //  the current day's file, which is uploaded once it's complete
+      if( !end && !( slot.flags & UPLOAD_SENT ) )
+      {
+        return true;
+      }
+    }
+
+    if( end )
+    {
+      if( walk->wrapped || walk->start == uploadState.head )
+      {
+        break;
+      }
+      walk->wrapped = 1;                //  go on with the files before the cursor
+      walk->idx = uploadState.head;
+    }
+    else
+    {
+      walk->idx = nextSlot(walk->idx);
+    }
+  }
+
+  walk->status = UPLOAD_WALK_END;
+  return false;
+}
+
+/*
+prepareUploads()
+Gets the files of a slice ready for the FTP batch before the modem is powered for it, so the modem doesn't
+wait while they are packed. Going along the walk from where it starts, after the bundle if there is one,
+the records of a file still held in RAM are written out and the file is packed (see packForUpload) until
+the files cover the byte quota of the slice. The batch hands out walk->ready files, see nextUnsentFile().
+A file that can't be packed in the time left of the slice (see sliceLeft) waits for the next slice, unless
+it would be the first upload of this one, which then goes as it is. The upload state must be open.
+
+Parameters:
+- uploadWalk* walk: the walk of the slice, with its bundle and time set
+- uint32_t quotaBytes: bytes the slice may send
+ */
+
+void prepareUploads(uploadWalk* walk, uint32_t quotaBytes)
+{
+  uploadWalk scan = *walk;
+  uint32_t bytes = 0;
+  if( walk->bundle )
+  {
+    char path [FILENAME_SIZE] = {0};
+    bundlePath(path);
+    int32_t size = SD.getFileSize(path);
+    bytes = ( size > (int32_t) bundle.sentBytes ) ? size - bundle.sentBytes : 0;
+    scan.idx = bundle.end;
+  }
+
+  uploadSlot slot;
+  while( bytes < quotaBytes && walk->ready < 255 && findUnsentSlot(&scan) && readSlot(scan.idx, &slot) )
+  {
+RTC.setWatchdog(8);
+
+    char fname [FILENAME_SIZE + 1] = {0};
+    strncpy(fname, slot.name, sizeof(slot.name));
+    if( strcmp(batch.filename, fname) == 0 )    //  upload any records of the file still held in RAM
+    {
+      writeBatch();
+    }
+
+    if( packForUpload(scan.idx, &slot, fname, sliceLeft(walk->started, walk->maxMillis)) == 2 )
+    {
+      if( walk->ready > 0 || walk->bundle )
+      {
+        #if GLACIERPROBE_DEBUG == 1
+          USB.println(F("Out of time for packing, the file goes first in the next slice"));
+        #endif
+        break;
+      }
+      if( slot.flags & UPLOAD_PACKED )          //  its packed file is gone, so start it over as it is
+      {
+        slot.flags &= ~UPLOAD_PACKED;
+        slot.sentBytes = 0;
+        writeSlot(scan.idx, &slot);
+      }
+    }
+
+    if( packedPath(&slot, fname, sizeof(fname)) )
+    {
+      int32_t size = SD.getFileSize(fname);
+      bytes += ( size > (int32_t) slot.sentBytes ) ? size - slot.sentBytes : 0;
+    }
+    walk->ready++;
+    scan.idx = nextSlot(scan.idx);
+  }
+
+  if( walk->ready == 0 && !walk->bundle )       //  nothing to send, keep why
+  {
+    walk->status = scan.status;
+  }
+}
+
+/*
+nextUnsentFile()
+ftpNextFile callback of the batch started by checkUnsentFiles(): hands out the next unsent file of the
+upload state with its path on the FTP server and the offset an earlier upload of it broke off at, or its
+packed file if prepareUploads() packed it. A bundle built by checkUnsentFiles() is handed out before any
+other file. Only the files prepared by prepareUploads() are handed out, the next one goes first in the
+next slice.
+ */
+
+bool nextUnsentFile(void* context,
+                    char* sdPath, uint8_t sdSize,
+                    char* serverPath, uint8_t serverSize,
+                    uint32_t* fileSize,
+                    uint32_t* resumeFrom)
+{
+  uploadWalk* walk = (uploadWalk*) context;
+  if( walk->status != UPLOAD_WALK_OPEN )
+  {
+    return false;
+  }
+
+RTC.setWatchdog(8);
+//********** START 8 SECOND WATCHDOG ***************
+
+  if( !sdOn() || openUploadState() != 0 )
+  {
+    walk->status = UPLOAD_WALK_SD;
+RTC.unSetWatchdog();
+    return false;
+  }
+
+  bool found = false;
+  if( walk->bundle )                    //  a bundle of the backlog goes first, see bundle.h
+  {
+    walk->bundle = 0;
+    found = nextBundle(sdPath, sdSize, serverPath, serverSize, fileSize, resumeFrom);
+    if( found )
+    {
+      walk->current = UPLOAD_WALK_BUNDLE;
+      walk->idx = bundle.end;
+    }
+  }
+
+  uploadSlot slot;
+  bool file = !found && findUnsentSlot(walk) && readSlot(walk->idx, &slot);
+  if( file )
+  {
+    memset(sdPath, 0, sdSize);
+    strncpy(sdPath, slot.name, min(sizeof(slot.name), (size_t) sdSize - 1));
+    found = walk->ready > 0 && packedPath(&slot, sdPath, sdSize);
+    if( !found )                        //  not prepared, so it goes first in the next slice
+    {
+      walk->cursor = walk->idx;
+    }
+  }
+
+  if( file && found )
+  {
+    walk->ready--;
+    ftpPath(sdPath, serverPath, serverSize);
+
+    #if GLACIERPROBE_DEBUG == 1
+      USB.print(F("Uploading "));
+      USB.print(sdPath);
+      USB.print(F(" to "));
+      USB.println(serverPath);
+    #endif
+
+    int32_t size = SD.getFileSize(sdPath);
+    *fileSize = ( size > 0 ) ? size : 0;
+    *resumeFrom = slot.sentBytes;
+
+    walk->current = walk->idx;
+    walk->cursor = walk->idx;           //  if the slice ends before this file is done, it goes first next time
+    walk->idx = nextSlot(walk->idx);
+  }
+  closeUploadState();                   //  the upload uses the SD on its own
+
+//********** END 8 SECOND WATCHDOG *****************
+RTC.unSetWatchdog();
+  return found;
+}
+
+/*
+uploadProgress()
+ftpFileProgress callback of the batch started by checkUnsentFiles(): keeps the offset the upload of the
+current file has reached in its slot, so the next attempt can resume from there after a broken link.
  */
- 
-bool updateTimes( char* seconds,
-                  char wtoStr [12]){
-  
-  uint32_t lastTime = (uint32_t) RTC.hour * 3600 + RTC.minute*60 + RTC.second;
+
+void uploadProgress(void* context, uint32_t offset)
+{
+  uploadWalk* walk = (uploadWalk*) context;
 
 RTC.setWatchdog(2);
 //********** START 2 SECOND WATCHDOG ***************
-  
-  RTC.getTime();                                                  //  update the time variables
-  //get the new time
-  uint32_t currentTime = (uint32_t) RTC.hour*3600 + RTC.minute*60 + RTC.second;
-  sprintf(seconds, "%lu", currentTime);  //  5 chars max, update the seconds character array
 
-  //update the wakeTime interval. If the battery is low, double the time the device will sleep.
-  timestamp_t wto;
-  uint8_t multiplier = 1;
-  if( battery == BL_MEDIUM )
-  {
-    multiplier = 6;
-  }
-  if( battery == BL_LOW )
+  uploadSlot slot;
+  if( walk->current == UPLOAD_WALK_BUNDLE )
   {
-    multiplier = 20;
+    bundleProgress(offset);
   }
-  if( battery == BL_CRITICAL )
+  else if( openUploadState() == 0 )     //  the upload keeps the SD on
   {
-    multiplier = 25;
+    if( readSlot(walk->current, &slot) )
+    {
+      slot.sentBytes = offset;
+      writeSlot(walk->current, &slot);
+    }
+    closeUploadState();
   }
-  
-  RTC.breakTimeOffset(DATA_INTERVAL * multiplier, &wto);
-  
-  sprintf_P(wtoStr, PSTR("%.2u:%.2u:%.2u:%.2u"), wto.date, wto.hour, wto.minute, wto.second);
-  #if GLACIERPROBE_DEBUG == 1
-    USB.printf("lastDATE: %u\tcurrDATE: %u\n",lastDate, RTC.date);
-  #endif
 
 //********** END 2 SECOND WATCHDOG *****************
 RTC.unSetWatchdog();
-  
-  if(RTC.date != lastDate){ 
-    lastDate = RTC.date;             
-    return 1;                            //  the day changed            
-  }
-
-  return 0;                              // the day didn't change
-  
 }
 
 /*
-unsentFile()
-Appends the current SD_filename to the list of files that have not been sent to the FTP server.
-This file list can later be checked for files that have not been sent due to errors such as a
-loss of connection and the device can retry sending them.
-
-Returns:
-- 0 if the file was successfully added to the list
-- 1 if the SD fails to initialize
-- 2 if the SD couldn't append the filename for some reason
+uploadDone()
+ftpFileDone callback of the batch started by checkUnsentFiles(): marks the file as sent as soon as it is
+on the server, so a reset later in the batch doesn't upload it again. The next slice starts after the file
+even if it failed, so a file the server keeps refusing doesn't hold up the rest of the backlog.
  */
 
-uint8_t appendUnsentFile()
+void uploadDone(void* context, uint8_t error)
 {
-  
-RTC.setWatchdog(2);
-//********** START 2 SECOND WATCHDOG ***************
-  
-  if(!SD.ON())
+  uploadWalk* walk = (uploadWalk*) context;
+  if( walk->current != UPLOAD_WALK_BUNDLE )
   {
-    #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("Failed to init SD"));
-    #endif
-RTC.unSetWatchdog();
-    return 1;                           //  SD failed to initialize
+    walk->cursor = walk->idx;
   }
-
-  char fList [20] = { 0 };                      //  name of the unsent file list
-  strcpy_P(fList, UNSENT_FILES_NAME );
-  
-  if(SD.isFile(fList)==-1)              //  if the file doesn't exist, create it
+  if( error != 0 )
   {
-    SD.create(fList);
-    #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("Filelist created"));
-    #endif
+    return;
   }
 
-  if( SD.appendln(fList, SD_filename) ) //  if the filename is successfully appended
+RTC.setWatchdog(8);
+//********** START 8 SECOND WATCHDOG ***************
+
+  if( sdOn() && openUploadState() == 0 )
   {
     #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("file added to list of unsent files"));
+      USB.println(F("Upload complete, marking file as sent."));
     #endif
-    SD.OFF();
-RTC.unSetWatchdog();
-    return 0;
+    uploadSlot slot;
+    if( walk->current == UPLOAD_WALK_BUNDLE )
+    {
+      bundleDone(error);
+    }
+    else if( markSentFile(walk->current) == 0 &&
+        readSlot(walk->current, &slot) && ( slot.flags & UPLOAD_PACKED ) )
+    {
+      char fname [FILENAME_SIZE + 1] = {0};
+      strncpy(fname, slot.name, sizeof(slot.name));
+      removePacked(fname);                      //  only needed for the upload
+    }
+    closeUploadState();
   }
 
-  #if GLACIERPROBE_DEBUG == 1           //  otherwise something went wrong
-    USB.println(F("ERROR: Could not append filename to list of unsent files."));
-  #endif
-  SD.OFF();
-  
-//********** END 2 SECOND WATCHDOG *****************
+//********** END 8 SECOND WATCHDOG *****************
 RTC.unSetWatchdog();
-  return 2;
-  
+}
+
+/*
+sliceQuota()
+Looks up the work quota of a slice of the backlog for the current battery level, see FTP_SLICE_BYTES_HIGH.
+
+Returns:
+- true if files may be uploaded, with the quota in bytes and millis
+- false if the battery is too low for uploads
+ */
+
+bool sliceQuota(uint32_t* bytes, uint32_t* millis)
+{
+  switch( battery )
+  {
+    case BL_HIGH:
+      *bytes = FTP_SLICE_BYTES_HIGH;
+      *millis = FTP_SLICE_MILLIS_HIGH;
+      break;
+    case BL_MEDIUM:
+      *bytes = FTP_SLICE_BYTES_MEDIUM;
+      *millis = FTP_SLICE_MILLIS_MEDIUM;
+      break;
+    default:
+      *bytes = 0;
+      *millis = 0;
+      break;
+  }
+  return *bytes > 0 && *millis > 0;
+}
+
+/*
+sliceLeft()
+Time left of a slice that started at millis() started and may take maxMillis.
+
+Returns: the milliseconds left, 0 once the time is used up
+ */
+
+uint32_t sliceLeft(uint32_t started, uint32_t maxMillis)
+{
+  uint32_t elapsed = millis() - started;
+  return ( elapsed < maxMillis ) ? maxMillis - elapsed : 0;
 }
 
 /*
 checkUnsentFiles()
-Searches through the list of unsent files. Filenames that start with '*' have been marked
-as sent. The search stops if it takes longer than a minute to send any unsent files, if the
-last file in the list is the current day's file, if the SD card reads an empty line, or if 
-for some reason the file directory buffer would overflow if the name is added (probably a
-corrupt file).
+Uploads one slice of the backlog of unsent files. The walk through the upload state starts at its cursor,
+where the last slice stopped, goes towards the current day's file and then on from the head, the oldest
+file that may still be unsent. If the battery is high enough and there are unsent files on the way, they
+are uploaded in a single FTP session (see my4G::ftpUploadBatch) until the quota of the battery level is
+used up (see sliceQuota), pausing a file in the middle if need be. The files are packed before the modem
+is powered (see prepareUploads). The time of the slice counts from the start of the modem session of the
+cycle, so building a bundle, packing files, powering the modem and logging in are charged to it as well.
+Each file is marked as sent as soon as it is on the server, a file whose upload broke off or was paused is resumed from the offset kept in its
+slot, and the cursor is saved for the next slice. A backlog of BUNDLE_THRESHOLD files or more is first
+bundled into one upload (see bundle.h). Without a quota nothing is uploaded, so only the newest slot is
+checked.
 
 Returns:
 - 0 if all files have been sent to the FTP server
 - 1 if the SD fails to initialize
-- 2 if the directory buffer would overflow
-- 3 if the operations took longer than a minute
+- 2 if the upload state couldn't be read or a slot of it repaired
+- 3 if the batch stopped before every file was sent
 - 4 if the current day's file hasn't been added
  */
 
@@ -376,193 +1784,251 @@ uint8_t checkUnsentFiles()
 RTC.setWatchdog(8);
 //********** START 8 SECOND WATCHDOG ***************
 
-  if(!SD.ON())
+  if(!sdOn())
   {
 RTC.unSetWatchdog();
     return 1;                           //  SD failed to initialize
   }
 
-  char fList [20] = {0};                      //  name of the list of files
-  memset(fList, 0, sizeof(fList));
-  strcpy_P(fList, UNSENT_FILES_NAME );
-  
-  #if GLACIERPROBE_DEBUG == 1
-    USB.print(F("File List: "));
-    USB.println(fList);
-  #endif
-  
-  if(SD.isFile(fList)==-1)              //  if the file list doesn't exist, create it
+  if( openUploadState() != 0 )
   {
-    SD.create(fList);
-    #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("File created"));
-    #endif
+    SD.OFF();
+RTC.unSetWatchdog();
+    return 2;
   }
+
   #if GLACIERPROBE_DEBUG == 1
-    USB.println(F("scanning list..."));
+    USB.printf("Upload state head: %u tail: %u\n", uploadState.head, uploadState.tail);
   #endif
-    
-  uint16_t i = 0;                       //  index representing line number in the SD file
-  uint32_t start = millis();
-  while ( millis() - start < 60000 )    //  time out if the rest of the operations take longer than a minute
-  {
-    
-RTC.setWatchdog(8);                     //  set the watchdog again
-    
-    SD.catln(fList, i, 1);              //  read in a line from the file and store it in the SD buffer
-    
+
+  uint32_t quotaBytes;
+  uint32_t quotaMillis;
+  if( !sliceQuota(&quotaBytes, &quotaMillis) )  //  no uploads, so just check for the current day's file
+  {
     #if GLACIERPROBE_DEBUG == 1
-      USB.println(F("SD Buffer: "));
-      USB.println(SD.buffer);
+      USB.println(F("Battery level too low for FTP upload"));
     #endif
-    
-    if( strncmp( SD.buffer, SD_filename, 8 ) == 0 ) //  if the filename is the same as the current day's file, finish
-    {
+    uint8_t result = lastSlotIs(SD_filename) ? 0 : 4;
+    closeUploadState();
+    SD.OFF();
 RTC.unSetWatchdog();
-      SD.OFF();
-      return 0;
-    }
+    return result;
+  }
+
+  uint32_t started = comms.sessionBegan != 0 ? comms.sessionBegan : millis();
+
+  uploadWalk walk;
+  bool bundled = prepareBundle(started, quotaMillis); //  a bundle covers the oldest files, so the walk goes on after it
+  beginWalk(&walk, bundled ? uploadState.head : sliceStart());
+  walk.bundle = bundled;
+  walk.started = started;
+  walk.maxMillis = quotaMillis;
+  prepareUploads(&walk, quotaBytes);
+  if( walk.bundle || walk.ready > 0 )   //  only power the modem if there is something to send
+  {
+    closeUploadState();
 
-    if( strlen( SD.buffer ) == 0 )       // if the SD reads in a blank line, finish
+RTC.unSetWatchdog();    //  the FTP batch has its own timeouts and will always take longer than 8 seconds.
+
+    ftpBatch upload = { nextUnsentFile, uploadProgress, uploadDone, &walk, quotaBytes, quotaMillis, started };
+    comms.ftpUploadBatch(FTP_SERVER, FTP_PORT, FTP_USER, FTP_PASS, &upload);
+
+RTC.setWatchdog(8);
+
+    if( !sdOn() || openUploadState() != 0 )
     {
       SD.OFF();
 RTC.unSetWatchdog();
-      return 4;
+      return 1;
     }
 
-    if( sizeof(FTP_DIR) + strlen(SD.buffer) >= 42 ) //  if adding the filename to the FTP directory would overflow,
-    {                                               //  an error occurred (such as corrupt data)
-      SD.OFF();
+    uploadState.cursor = walk.cursor;   //  where the next slice starts
+    writeUploadHeader();
+  }
+
+  if( walk.status == UPLOAD_WALK_CORRUPT )  //  a slot the SD failed to read or repair, try again next time
+  {
+    closeUploadState();
+    SD.OFF();
 RTC.unSetWatchdog();
-      return 2;
-    }
-    
-    if( SD.buffer[0] != '*' &&  //  if the file hasn't been sent previously
-        battery > BL_LOW )      //  and the battery isn't low
-    {
-      //  get the FTP directory using the filename of the first unsent file
-      char FTP_dir [40] = { 0 };
-      strcpy(FTP_dir, FTP_DIR);
-      strncpy(FTP_dir + sizeof(FTP_DIR) - 1, SD.buffer, 13);
+    return 2;
+  }
 
-      #if GLACIERPROBE_DEBUG == 1
-        USB.print(F("Directory to upload to server: "));
-        USB.println(FTP_dir);
-      #endif
+  if( walk.status == UPLOAD_WALK_END )  //  nothing left before the current day's file
+  {
+    uint8_t result = lastSlotIs(SD_filename) ? 0 : 4;
+    closeUploadState();
+    SD.OFF();
+RTC.unSetWatchdog();
+    return result;
+  }
 
-      char sd_fname [13];
-      strncpy(sd_fname, SD.buffer, 12);
-      sd_fname[12] = 0;
-      #if GLACIERPROBE_DEBUG == 1
-        USB.print(F("File to upload:"));
-        USB.println(sd_fname);
-        USB.print(F("Length of fname: "));
-        USB.println(strlen(sd_fname));
-      #endif
-      if( battery == BL_HIGH )
-      {
-        
-RTC.unSetWatchdog();    //  comms.postFTP has its own timeout and will always take longer than 8 seconds.
-
-        
-        //  attempt to send the file to the FTP server
-        if ( comms.postFTP(FTP_SERVER, FTP_PORT, FTP_USER, FTP_PASS, sd_fname, FTP_dir) == 1 )
-        {
-          #if GLACIERPROBE_DEBUG == 1
-            USB.println(F("Upload complete, marking file as sent."));
-          #endif
-
-          markSentFile(sd_fname);  //  mark file as sent
-        }
-      }
-      else
-      {
-        #if GLACIERPROBE_DEBUG == 1
-          USB.println(F("Battery level too low for FTP upload"));
-        #endif
-      }
-    }
+  closeUploadState();
+  SD.OFF();
+  
+//********** END WATCHDOG *****************
+RTC.unSetWatchdog();
+  return 3;                           //  the batch ran out of budget or failed
+}
+
+#if FTP_UPLOAD_RATE == FTP_UPLOAD_HOURLY
+/*
+sendRecent()
+Appends the records of the current file that the FTP server doesn't have yet to its copy of the file. The
+bytes the server already has are kept in sentBytes of the file's slot, the same offset an upload that broke
+off resumes from, so only new records go over the link and the nightly batch (see checkUnsentFiles) only
+sends the rest of the day once the file is complete. Records still held in RAM are written out first. In a
+preallocated file only the bytes up to logOffset are sent, not the empty space after it.
+
+Returns:
+- 0 if the server has every record written so far
+- 1 if the SD fails to initialize
+- 2 if the current file isn't the newest file of the upload state yet
+- 3 if the upload failed, the next call continues from the last reported offset
+ */
+
+uint8_t sendRecent()
+{
+RTC.setWatchdog(8);
+//********** START 8 SECOND WATCHDOG ***************
 
-    i++;                              //  increment to the next line
+  if( !sdOn() )
+  {
+RTC.unSetWatchdog();
+    return 1;
   }
 
-  #if ( FTP_UPLOAD_RATE == FTP_UPLOAD_HOURLY  )
-  if (  battery == BL_HIGH  )
+  if( strcmp(batch.filename, SD_filename) == 0 )  //  the records held in RAM are new records too
   {
-    if( RTC.hour != lastUploadHour  )
-    {
-      #if GLACIERPROBE_DEBUG == 1
-        USB.println(F("Attempting hourly upload."));
-      #endif
+    writeBatch();
+  }
 
-RTC.setWatchdog(2);
-//********** RESTART 2 SECOND WATCHDOG ***************
+  if( openUploadState() != 0 || !lastSlotIs(SD_filename) )
+  {
+    closeUploadState();
+    SD.OFF();
+RTC.unSetWatchdog();
+    return 2;                           //  appendUnsentFile adds it on the next check
+  }
 
-      if( comms.postFTP(FTP_SERVER, FTP_PORT, FTP_USER, FTP_PASS, sd_fname, FTP_dir) == 1 )
-      {
-        #if GLACIERPROBE_DEBUG == 1
-          USB.println(F("Hourly upload complete."));
-        #endif
-        lastUploadHour = RTC.hour;
-      }
-      else
-      {
-        #if GLACIERPROBE_DEBUG == 1
-          USB.println(F("Hourly upload failed."));
-        #endif
-      }
-//********** END 2 SECOND WATCHDOG *****************
+  uploadWalk walk = { uploadState.tail, prevSlot(uploadState.tail), UPLOAD_WALK_END, 0 };
+  uploadSlot slot;
+  readSlot(walk.current, &slot);
+  closeUploadState();
+
+  #if SD_PREALLOCATE == 1
+    uint32_t length = logOffset;        //  0 if nothing was written since the last reset
+  #else
+    int32_t size = SD.getFileSize(SD_filename);
+    uint32_t length = ( size > 0 ) ? size : 0;
+  #endif
+
+  if( length <= slot.sentBytes )        //  nothing new
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("No new records to upload"));
+    #endif
+    SD.OFF();
 RTC.unSetWatchdog();
+    return 0;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Uploading bytes %lu to %lu of ", slot.sentBytes, length);
+    USB.println(SD_filename);
+  #endif
+
+RTC.unSetWatchdog();    //  the FTP session has its own timeouts and will always take longer than 8 seconds.
 
+  uint8_t result = 3;
+  if( comms.acquire() == 0 && comms.ftpOpenSession(FTP_SERVER, FTP_PORT, FTP_USER, FTP_PASS) == 0 )
+  {
+    if( comms.ftpUploadResume(FTP_filename, SD_filename, slot.sentBytes, uploadProgress, &walk, length) == 0 )
+    {
+      result = 0;
     }
+    comms.ftpCloseSession();
   }
-  else
+  comms.release();
+  SD.OFF();
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.println(result == 0 ? F("New records uploaded.") : F("Upload of new records failed."));
+  #endif
+  return result;
+}
+
+/*
+checkRecentUpload()
+Calls sendRecent() once an hour, or every FTP_RECENT_RECORDS records if that is set, as long as the
+battery is high enough. A failed upload is tried again on the next cycle.
+
+Returns:
+- 0 if nothing was due or the upload succeeded
+- the result of sendRecent() otherwise
+ */
+
+uint8_t checkRecentUpload()
+{
+  #if FTP_RECENT_RECORDS > 0
+    bool due = ( recordSeq - recentSeq >= FTP_RECENT_RECORDS );
+  #else
+    bool due = ( RTC.hour != lastUploadHour );
+  #endif
+
+  if( !due )
+  {
+    return 0;
+  }
+
+  if( battery != BL_HIGH )
   {
     #if GLACIERPROBE_DEBUG == 1
       USB.println(F("Battery too low for hourly upload."));
     #endif
+    return 0;
   }
-  #endif
-  
-  SD.OFF();
-  
-//********** END WATCHDOG *****************
-RTC.unSetWatchdog();
-  return 3;                           //  timeout condition was met
+
+  uint8_t result = sendRecent();
+  if( result == 0 )
+  {
+    lastUploadHour = RTC.hour;
+    recentSeq = recordSeq;
+  }
+  return result;
 }
+#endif
 
 /*
 markSentFile()
-Marks the specified file as sent in the list of unsent files.
+Marks the file in a slot of the upload state as sent. If it was the head of the list, the head moves
+past it and any other sent files behind it, so the next check starts at the oldest unsent file. The
+upload state must be open.
 
 Parameters:
-- char* fname: name of the file to mark as sent
+- uint16_t idx: slot of the file to mark as sent
 
 Returns:
-- 0 if all files have been sent to the FTP server
-- 1 if the SD fails to initialize
+- 0 if the file was marked as sent
+- 1 if the slot couldn't be read
 - 2 if there was an error writing to the SD
  */
 
-uint8_t markSentFile(char* fname)
+uint8_t markSentFile(uint16_t idx)
 {
 
 RTC.setWatchdog(2);
 //********** START 2 SECOND WATCHDOG ***************
 
-  // get the name of the list of sent files
-  char fList [20] = {0};
-  strcpy_P(fList, UNSENT_FILES_NAME );
-
-  //  get the index of the start of the filename to mark
-  int32_t idx = SD.indexOf(fList, fname, 0);
+  uploadSlot slot;
+  if( !readSlot(idx, &slot) )
+  {
+RTC.unSetWatchdog();
+    return 1;
+  }
 
-  #if GLACIERPROBE_DEBUG == 1
-    USB.println(F("Found filename in index: "));
-    USB.printf("%lu\n",idx);
-  #endif
-  char* c = "*"; 
-  if( SD.writeSD(fList, c, idx) == 0 )  //  if there was an error marking it
+  slot.flags |= UPLOAD_SENT;
+  if( !writeSlot(idx, &slot) )          //  if there was an error marking it
   {
     #if GLACIERPROBE_DEBUG == 1
       USB.println(F("Failed to mark file"));
@@ -571,12 +2037,39 @@ RTC.unSetWatchdog();
     return 2;
   }
 
+  if( !advanceHead() )
+  {
+RTC.unSetWatchdog();
+    return 2;
+  }
+
 //********** END 2 SECOND WATCHDOG *****************
 RTC.unSetWatchdog();
 
   return 0; // if the file was successfully marked as sent
 }
 
+/*
+advanceHead()
+Moves the head of the open upload state past every sent file and saves it.
+
+Returns:
+- true if the header was written
+- false if there was an error writing to the SD
+ */
+
+bool advanceHead()
+{
+  uploadSlot slot;
+  while( uploadState.head != uploadState.tail &&
+         readSlot(uploadState.head, &slot) &&
+         ( slot.flags & UPLOAD_SENT ) )
+  {
+    uploadState.head = nextSlot(uploadState.head);
+  }
+  return writeUploadHeader();
+}
+
 #endif
 
 
@@ -20,20 +20,16 @@ const char* const SMS_CMD_KEYS[] PROGMEM =
   SMS_CMD_VAL_FAILED
 };
 
-keyvalue currData[] = {keyvalue("temperature"),   //  BME
-                       keyvalue("humidity"),      //  BME
-                       keyvalue("pressure"),      //  BME
-                       keyvalue("sonic"),         //  SONIC
-                       keyvalue("wetness"),       //  PHYTOS
-                       keyvalue("solar"),         //  SOLAR
-                       keyvalue("ubar"),          //  DS2
-                       keyvalue("vbar"),          //  DS2
-                       keyvalue("gust"),          //  DS2
-                       keyvalue("wSpeed"),        //  DS2
-                       keyvalue("wDirect"),       //  DS2
-                       keyvalue("ds2Temp"),       //  DS2
-                       keyvalue("seconds")        //  timestamp
-};      
+sampleRecord currSample;                          //  measurements of the current cycle, see sample.h
+
+//  key, unit, number of decimals kept and whether the channel is stored in binary records, indexed by the
+//  KV_* channels. Generated from the sensor registry in header.h.
+const channelInfo CHANNEL_INFO [] PROGMEM = {
+  #define CHANNEL_ENTRY(name, key, unit, decimals)  {key, unit, decimals, 1},
+  SENSOR_CHANNELS(CHANNEL_ENTRY)
+  #undef CHANNEL_ENTRY
+  {"seconds", "s", 0, 0}                          //  timestamp, replaced by the record's epoch time in binary files
+};
 
 
 
@@ -42,7 +38,11 @@ void setup(){
   RTC.ON();
   RTC.getTime();
   lastDate = RTC.date;
+  openSdHealth();       //  count an SD operation cut off by a watchdog reset
   setFileNames(SD_filename, sizeof(SD_filename), FTP_filename, sizeof(FTP_filename));
+  recoverDataFile();    //  cut off any record torn by a reset and pick up the sequence numbers again
+  openHistory();        //  find the newest sample in the EEPROM history
+  comms.useNetworkCache(MODEM_EEPROM_START);  //  the operator of the last attach, for a fast reattach
 }
 
 /*
@@ -56,6 +56,11 @@ void setup(){
 void loop(){
   updateBatteryLevel();
 
+  if( BL_changed == true )  //  the batch size depends on the battery level, so start over with an empty batch
+  {
+    flushDataSet();
+  }
+
   switch( battery )
   {
     case BL_HIGH:
@@ -136,6 +141,9 @@ the index in the command table and switches the function based on the value. The
 "*TIME!" - dweet the current time of day
 "*SIGNAL!" - dweet the RSSI (signal strength)
 "*BATTERY!"  - dweet the battery percentage
+"*HISTORY!"  - dweet the last few hours of samples, averaged down to a few points per channel
+"*SDHEALTH!"  - dweet the SD latency histograms and error counts
+"*NETWORK!"   - dweet the cached operator and the attach and modem session statistics
 "*RESET!"  - reboot the device
 "*SET TIME!HH:MM:SS" - change the RTC's time of day to the specified time
 
@@ -175,21 +183,75 @@ uint8_t runCommand(int8_t cmd)
     //  all command indices are defined in my4G.h, which is included directly.
     
     case SMS_CMD_DATA:  //  commands are defined in my4G.h
-    
+    {
       //  the user requested to view the current sensor data (to verify every sensor is working probably)
 
+      //  the sample is formatted one channel at a time while it is sent, see sampleField() in sample.h
+      kvSource current = {NULL, &currSample, sampleField, NUM_KEYVALS};
+
       //  turn on 4G, send a dweet of the current data, and then turn it off and return to the main program.
-      comms.ON();
+      comms.acquire();
       comms.sendDweet( DWEET_PORT,  //  80 for http without encription
                       name,         //  device name
                       sizeof(name), //  length of device name
-                      currData,     //  user requested current data, which we already have a kv array for
-                      NUM_KEYVALS); //  number of different measurements in kv array, defined in header
-      comms.OFF();
+                      &current);    //  the current sample
+      comms.release();
       
       return 0;
       break;
+    }
     
+    case SMS_CMD_HISTORY:
+    {
+      //  the user requested the recent history, which is kept in the EEPROM so it doesn't need the SD.
+      historyWindow window;
+      makeHistoryWindow(&window);
+      kvSource history = {NULL, &window, historyField, historyFields(&window)};
+
+      //  turn on 4G, send the averaged history in a single post, and turn it off again.
+      comms.acquire();
+      comms.sendDweet( DWEET_PORT,
+                      name,
+                      sizeof(name),
+                      &history);
+      comms.release();
+
+      return 0;
+      break;
+    }
+
+    case SMS_CMD_SDHEALTH:
+    {
+      //  the user requested the SD statistics, to spot a card that is getting slow.
+      kvSource health = {NULL, NULL, healthField, SD_HEALTH_FIELDS};
+
+      comms.acquire();
+      comms.sendDweet( DWEET_PORT,
+                      name,
+                      sizeof(name),
+                      &health);
+      comms.release();
+
+      return 0;
+      break;
+    }
+
+    case SMS_CMD_NETWORK:
+    {
+      //  the user requested the attach statistics, to check what the cached operator saves.
+      kvSource network = {NULL, &comms, networkField, NETWORK_FIELDS};
+
+      comms.acquire();
+      comms.sendDweet( DWEET_PORT,
+                      name,
+                      sizeof(name),
+                      &network);
+      comms.release();
+
+      return 0;
+      break;
+    }
+
     case SMS_CMD_TIME:
       //  the user requested to view the RTC's current time of day.
 
@@ -204,7 +266,7 @@ uint8_t runCommand(int8_t cmd)
 
 
       //  turn on 4G, send the dweet of a single keyvalue, turn it off and return to the main program.
-      comms.ON();
+      comms.acquire();
 
       //  sendDweet expects a kv pointer but we only have one object, not an array, so we pass its
       //  address instead and pretend it's an array of length 1.
@@ -213,7 +275,7 @@ uint8_t runCommand(int8_t cmd)
                       sizeof(name),
                       &kv_buff,     //  pass by reference
                       1);           //  it's just a single object, so length = 1
-      comms.OFF();
+      comms.release();
       
       return 0;
       break;
@@ -225,8 +287,8 @@ uint8_t runCommand(int8_t cmd)
       memset(kv_buff.key, 0, kv_buff.KEYVAL_STRING_SIZE);
       strcpy_P(kv_buff.key, SMS_CMD_KEYS[1]);
       memset(kv_buff.val, 0, kv_buff.KEYVAL_STRING_SIZE);
-      comms.ON();
-      comms.checkDataConnection(15000);
+      comms.acquire();
+      comms.attach(60);
       comms.getRSSI();
       sprintf(kv_buff.val, "%d", comms._rssi);
 
@@ -236,7 +298,7 @@ uint8_t runCommand(int8_t cmd)
                       sizeof(name),
                       &kv_buff,
                       1);     
-      comms.OFF();
+      comms.release();
       return 0;
       break;
 
@@ -251,13 +313,13 @@ uint8_t runCommand(int8_t cmd)
       snprintf(kv_buff.val,kv_buff.KEYVAL_STRING_SIZE, "%u", PWR.getBatteryLevel());
 
       //  turn 4G on, send the dweet, turn it off and return to the main program.
-      comms.ON();
+      comms.acquire();
       comms.sendDweet( DWEET_PORT,
                        name,
                        sizeof(name),
                        &kv_buff,
                        1);
-      comms.OFF();
+      comms.release();
       return 0;
       break;
       
@@ -266,6 +328,8 @@ uint8_t runCommand(int8_t cmd)
 
       //reboot. The return probably isn't necessary but it's included for consistency.
       runCommand(SMS_CMD_DATA);
+      flushDataSet();   //  RAM is lost on reboot, so write out the batched records first
+      comms.endSession();   //  and the modem is left on by the cycle's session, so turn it off
       PWR.reboot();
       return 0;
       break;
@@ -313,13 +377,13 @@ uint8_t runCommand(int8_t cmd)
       strcpy_P(kv_buff.key, SMS_CMD_KEY_FAILED);
       strcpy_P(kv_buff.val, SMS_CMD_VAL_FAILED);
 
-      comms.ON();
+      comms.acquire();
       comms.sendDweet( DWEET_PORT,
                       name,
                       sizeof(name),
                       &kv_buff,
                       1);     
-      comms.OFF();
+      comms.release();
       
       return 2; //  this is here in case, for some reason, the message gets corrupted and things are not in the expected order
       break;
@@ -334,26 +398,17 @@ void execute_BL_HIGH()
 {
   char dname [20] = {0};  //  device name buffer
   strncpy_P(dname, DEVICE_NAME, sizeof(dname));
-  //  if battery level changed:
-  if( BL_changed == true )
-  {
-    keyvalue batt = ("BATTERY");
-    strcpy(batt.val, "HIGH");
-    comms.sendDweet( 80, dname, strlen(dname), &batt, 1 );
-  }
-  //  check the unsent files list for files that need sending
-  uint8_t result = checkUnsentFiles();
-  if( result == 4 ) //  if the current date is not included, append it to the list
-  {
-    appendUnsentFile();
-  }
 
   //  prepare the timestamp and waketime offset
   char wtoStr [12] = {0};                 //  wake-time offset
-  bool newFile = updateTimes(currData[KV_SECONDS].val, wtoStr); //  get the seconds and update wake time offset
+  bool newFile = updateTimes(&currSample, wtoStr); //  get the seconds and update wake time offset
+  if( newFile )
+  {
+    writeHealthRecord();                  //  a new day, so save the SD statistics of the last one
+  }
 
   //  get sensor data
-  readAllSensors(currData);
+  readAllSensors(&currSample);
 
   //  set the file names based on the current date and/or time
   setFileNames( SD_filename,            //  update the name of the SD file based on current time
@@ -362,21 +417,43 @@ void execute_BL_HIGH()
                 sizeof(FTP_filename));  //  max length of the ftp server director
 
   //  write the data to the SD file
-  writeDataSet(currData, NUM_KEYVALS, SD_filename); //  write the data set to the SD file.
+  writeDataSet(&currSample, SD_filename); //  write the data set to the SD file.
+  recordHistory(&currSample);             //  and keep it in the EEPROM history, independent of the SD
 
-  //  prep to get dweet info
-  comms.ON();
-  
+  //  all network work of this cycle comes after the sample, so the modem is only on for it and the
+  //  whole block shares one power-up
+  comms.beginSession();
+
+  //  check the unsent files list for files that need sending. This goes first, as the files are packed
+  //  before the modem is powered (see prepareUploads)
+  uint8_t result = checkUnsentFiles();
+  if( result == 4 ) //  if the current date is not included, append it to the list
+  {
+    appendUnsentFile();
+  }
+
+  //  if battery level changed:
+  if( BL_changed == true )
+  {
+    keyvalue batt = ("BATTERY");
+    strcpy(batt.val, "HIGH");
+    comms.sendDweet( 80, dname, strlen(dname), &batt, 1 );
+  }
+
+  #if FTP_UPLOAD_RATE == FTP_UPLOAD_HOURLY
+    checkRecentUpload();                  //  append the new records to the server's copy of the file
+  #endif
 
   //  response from checking dweet server for user command
   int8_t ans = comms.receiveDweetCommand(dname);  //  index for command received, or error code
-  comms.OFF();
   ans = runCommand(ans);  //  execute the command
 
   #if GLACIERPROBE_DEBUG == 1
     USB.printf("Command Received: %d\n",ans);
   #endif
 
+  comms.endSession();                     //  the only power-down of the modem this cycle
+
   PWR.deepSleep(wtoStr, RTC_OFFSET, RTC_ALM1_MODE4);
 }
 
@@ -384,30 +461,17 @@ void execute_BL_MEDIUM()
 {
   char dname [20] = {0};  //  device name buffer
   strncpy_P(dname, DEVICE_NAME, sizeof(dname));
-  
-  if( BL_changed == true )
-  {
-    keyvalue batt = ("BATTERY");
-    strcpy(batt.val, "MEDIUM");
-    comms.sendDweet( 80, dname, strlen(dname), &batt, 1 );
-  }
-  //  ********************************************
-  //  AFTER THIS POINT THIS IS THE SAME AS BL_HIGH
-  //  ********************************************
-
-  //  check the unsent files list for files that need sending
-  uint8_t result = checkUnsentFiles();
-  if( result == 4 ) //  if the current date is not included, append it to the list
-  {
-    appendUnsentFile();
-  }
 
   //  prepare the timestamp and waketime offset
   char wtoStr [12] = {0};                 //  wake-time offset
-  bool newFile = updateTimes(currData[KV_SECONDS].val, wtoStr); //  get the seconds and update wake time offset
+  bool newFile = updateTimes(&currSample, wtoStr); //  get the seconds and update wake time offset
+  if( newFile )
+  {
+    writeHealthRecord();                  //  a new day, so save the SD statistics of the last one
+  }
 
   //  get sensor data
-  readAllSensors(currData);
+  readAllSensors(&currSample);
 
   //  set the file names based on the current date and/or time
   setFileNames( SD_filename,            //  update the name of the SD file based on current time
@@ -416,20 +480,39 @@ void execute_BL_MEDIUM()
                 sizeof(FTP_filename));  //  max length of the ftp server director
 
   //  write the data to the SD file
-  writeDataSet(currData, NUM_KEYVALS, SD_filename); //  write the data set to the SD file.
+  writeDataSet(&currSample, SD_filename); //  write the data set to the SD file.
+  recordHistory(&currSample);             //  and keep it in the EEPROM history, independent of the SD
+
+  //  all network work of this cycle comes after the sample, see execute_BL_HIGH
+  comms.beginSession();
 
-  //  prep to get dweet info
-  comms.ON();
+  //  check the unsent files list for files that need sending, before the modem is powered
+  uint8_t result = checkUnsentFiles();
+  if( result == 4 ) //  if the current date is not included, append it to the list
+  {
+    appendUnsentFile();
+  }
+
+  if( BL_changed == true )
+  {
+    keyvalue batt = ("BATTERY");
+    strcpy(batt.val, "MEDIUM");
+    comms.sendDweet( 80, dname, strlen(dname), &batt, 1 );
+  }
+  //  ********************************************
+  //  AFTER THIS POINT THIS IS THE SAME AS BL_HIGH
+  //  ********************************************
 
   //  response from checking dweet server for user command
   int8_t ans = comms.receiveDweetCommand(dname);  //  index for command received, or error code
-  comms.OFF();
   ans = runCommand(ans);  //  execute the command
 
   #if GLACIERPROBE_DEBUG == 1
     USB.printf("Command Received: %d\n",ans);
   #endif
 
+  comms.endSession();                     //  the only power-down of the modem this cycle
+
   PWR.deepSleep(wtoStr, RTC_OFFSET, RTC_ALM1_MODE4);
   
 }
@@ -456,10 +539,14 @@ void execute_BL_LOW()
 
   //  prepare the timestamp and waketime offset
   char wtoStr [12] = {0};                 //  wake-time offset
-  bool newFile = updateTimes(currData[KV_SECONDS].val, wtoStr); //  get the seconds and update wake time offset
+  bool newFile = updateTimes(&currSample, wtoStr); //  get the seconds and update wake time offset
+  if( newFile )
+  {
+    writeHealthRecord();                  //  a new day, so save the SD statistics of the last one
+  }
 
   //  get sensor data
-  readAllSensors(currData);
+  readAllSensors(&currSample);
 
   //  set the file names based on the current date and/or time
   setFileNames( SD_filename,            //  update the name of the SD file based on current time
@@ -468,7 +555,8 @@ void execute_BL_LOW()
                 sizeof(FTP_filename));  //  max length of the ftp server director
 
   //  write the data to the SD file
-  writeDataSet(currData, NUM_KEYVALS, SD_filename); //  write the data set to the SD file.
+  writeDataSet(&currSample, SD_filename); //  write the data set to the SD file.
+  recordHistory(&currSample);             //  and keep it in the EEPROM history, independent of the SD
 
   //  DON'T communicate over 4G.
 
@@ -496,10 +584,14 @@ void execute_BL_CRITICAL()
 
   //  prepare the timestamp and waketime offset
   char wtoStr [12] = {0};                                       //  wake-time offset
-  bool newFile = updateTimes(currData[KV_SECONDS].val, wtoStr); //  get the seconds and update wake time offset
+  bool newFile = updateTimes(&currSample, wtoStr); //  get the seconds and update wake time offset
+  if( newFile )
+  {
+    writeHealthRecord();                  //  a new day, so save the SD statistics of the last one
+  }
 
   //  get sensor data
-  readAllSensors(currData);
+  readAllSensors(&currSample);
 
   //  set the file names based on the current date and/or time
   setFileNames( SD_filename,            //  update the name of the SD file based on current time
@@ -508,7 +600,8 @@ void execute_BL_CRITICAL()
                 sizeof(FTP_filename));  //  max length of the ftp server director
 
   //  write the data to the SD file
-  writeDataSet(currData, NUM_KEYVALS, SD_filename); //  write the data set to the SD file.
+  writeDataSet(&currSample, SD_filename); //  write the data set to the SD file.
+  recordHistory(&currSample);             //  and keep it in the EEPROM history, independent of the SD
 
   //  DON'T communicate over 4G.
 
@@ -7,8 +7,11 @@
 //libraries
 #include <WaspSensorAgrXtr.h>
 //user headers
+#include <strbuf.h>				    //	fixed-capacity strings that track their own length
 #include <my4G.h>				    //	Custom 4G class that inherits from Wasp4G but adds a few specific functions
 #include <DS2.h>
+#include <tscodec.h>				//	delta codec for packing data files before they are uploaded
+#include <lzss.h>				    //	byte compressor for packing data files before they are uploaded
 
 #define GLACIERPROBE_DEBUG           1            //  1 - print out debugging information
                                                   //  0 - off
@@ -21,25 +24,88 @@ static const uint16_t DWEET_PORT = 80;
 #define _SOLAR    0         //  set to 1 if SOLAR sensor is attached
 #define _DS2      0         //  set to 1 if DS-2 sensor is attached
 
-//Array that stores keyvalue objects representing the current key and value of each measurement
-extern keyvalue currData [];
-
-//  define the indices in currData where each of these is stored.
-#define KV_TEMPERATURE    0
-#define KV_HUMIDITY       1
-#define KV_PRESSURE       2
-#define KV_SONIC          3
-#define KV_WETNESS        4
-#define KV_SOLAR          5
-#define KV_UBAR           6
-#define KV_VBAR           7
-#define KV_GUST           8
-#define KV_WINDSPEED      9
-#define KV_WINDDIRECTION  10
-#define KV_DS2TEMPERATURE 11
-#define KV_SECONDS        12
-
-#define NUM_KEYVALS       13
+//  sensor registry. Every attached sensor lists its channels as CH(name, key, unit, decimals), where the
+//  channel is stored in the sample record at index KV_<name>, as key in text output and scaled by
+//  10^decimals. It also registers its read function with SENSOR(read, minBattery, warmup): the sensor is
+//  only read while the battery level is above minBattery, and gets warmup milliseconds after it is powered
+//  before it is measured. The channel indices, CHANNEL_INFO and readAllSensors() are all generated from
+//  these lists, so sensors that are set to 0 above take no RAM, flash, SD space or airtime.
+#if _BME == 1
+  #define BME_CHANNELS(CH)      CH(TEMPERATURE,     "temperature", "C",   3) \
+                                CH(HUMIDITY,        "humidity",    "%RH", 3) \
+                                CH(PRESSURE,        "pressure",    "Pa",  3)
+  #define BME_SENSOR(SENSOR)    SENSOR(readBME,    BL_CRITICAL, 0)
+#else
+  #define BME_CHANNELS(CH)
+  #define BME_SENSOR(SENSOR)
+#endif
+
+#if _SONIC == 1
+  #define SONIC_CHANNELS(CH)    CH(SONIC,           "sonic",       "cm",  0)
+  #define SONIC_SENSOR(SENSOR)  SENSOR(readSonic,  BL_LOW,      0)
+#else
+  #define SONIC_CHANNELS(CH)
+  #define SONIC_SENSOR(SENSOR)
+#endif
+
+#if _PHYTOS == 1
+  #define PHYTOS_CHANNELS(CH)   CH(WETNESS,         "wetness",     "%",   3)
+  #define PHYTOS_SENSOR(SENSOR) SENSOR(readPhytos, BL_CRITICAL, 0)
+#else
+  #define PHYTOS_CHANNELS(CH)
+  #define PHYTOS_SENSOR(SENSOR)
+#endif
+
+#if _SOLAR == 1
+  #define SOLAR_CHANNELS(CH)    CH(SOLAR,           "solar",       "V",   3)
+  #define SOLAR_SENSOR(SENSOR)  SENSOR(readSolar,  BL_CRITICAL, 0)
+#else
+  #define SOLAR_CHANNELS(CH)
+  #define SOLAR_SENSOR(SENSOR)
+#endif
+
+#if _DS2 == 1
+  #define DS2_CHANNELS(CH)      CH(UBAR,            "ubar",        "m/s", 2) \
+                                CH(VBAR,            "vbar",        "m/s", 2) \
+                                CH(GUST,            "gust",        "m/s", 2) \
+                                CH(WINDSPEED,       "wSpeed",      "m/s", 2) \
+                                CH(WINDDIRECTION,   "wDirect",     "deg", 0) \
+                                CH(DS2TEMPERATURE,  "ds2Temp",     "C",   1)
+  #define DS2_SENSOR(SENSOR)    SENSOR(readDS2,    BL_LOW,      2000)
+#else
+  #define DS2_CHANNELS(CH)
+  #define DS2_SENSOR(SENSOR)
+#endif
+
+#define SENSOR_CHANNELS(CH)   BME_CHANNELS(CH) SONIC_CHANNELS(CH) PHYTOS_CHANNELS(CH) \
+                              SOLAR_CHANNELS(CH) DS2_CHANNELS(CH)
+#define SENSORS(SENSOR)       BME_SENSOR(SENSOR) SONIC_SENSOR(SENSOR) PHYTOS_SENSOR(SENSOR) \
+                              SOLAR_SENSOR(SENSOR) DS2_SENSOR(SENSOR)
+
+//  the channel of the sample record where each measurement is stored. The second of the day always
+//  comes after the sensor channels.
+enum {
+  #define CHANNEL_INDEX(name, key, unit, decimals)  KV_##name,
+  SENSOR_CHANNELS(CHANNEL_INDEX)
+  #undef CHANNEL_INDEX
+  KV_SECONDS,
+  NUM_KEYVALS
+};
+
+//  the measurements of one cycle. Every channel is an integer scaled by 10^decimals of its CHANNEL_INFO
+//  entry, so 12.345 C with 3 decimals is stored as 12345. Channels are only formatted as text when they
+//  are written out, see sample.h.
+struct sampleRecord {
+  int32_t value [NUM_KEYVALS];                    //  indexed by the KV_* channels
+  uint16_t valid;                                 //  bit n is set if channel n was measured this cycle
+};
+
+#define SAMPLE_BIT(ch)    ( (uint16_t) 1 << (ch) )
+
+typedef char sampleValidFits [ NUM_KEYVALS <= 16 ? 1 : -1 ];   //  fails to compile if sampleRecord.valid
+                                                                //  has no bit left for every channel
+
+extern sampleRecord currSample;
 
 #define DATA_INTERVAL     60                     //  in seconds
 
@@ -52,35 +118,399 @@ extern keyvalue currData [];
 //  frequency to send file to FTP and start new file
 #define FTP_UPLOAD_NEVER             0                       //  never communicate with the FTP server
 #define FTP_UPLOAD_DAILY             1                       //  send data every day representing all measurements of that day
-#define FTP_UPLOAD_HOURLY            2                       //  send new datafile every hour
+#define FTP_UPLOAD_HOURLY            2                       //  also append the new records of the day's file every hour
 
 
 #define FTP_UPLOAD_RATE              FTP_UPLOAD_DAILY        // rate that the mote uploads data to the FTP server
 
-#if FTP_UPLOAD_RATE == FTP_UPLOAD_HOURLY
-  extern uint8_t lastUploadHour =    0;
-#endif
+//  with FTP_UPLOAD_HOURLY, append the new records every this many records instead of every hour, 0 for hourly
+#define FTP_RECENT_RECORDS           0
+
+//  work quota of one slice of the backlog, the FTP batch that uploads unsent files on a wake, per battery
+//  level. A slice stops once it has sent its bytes or used its time, if need be in the middle of a file,
+//  and the next wake resumes from there (see uploadHeader.cursor), so sampling stays on schedule while
+//  the backlog drains over several cycles. The time counts from the start of the cycle's modem session
+//  (see my4G::beginSession), so powering the modem, logging in, building a bundle and packing files all
+//  use it up too. The first file of a slice always gets a few seconds (FTP_BATCH_MIN_MILLIS), so a slow
+//  login can't hold up the backlog for good. A quota of 0 bytes means no uploads at that battery level.
+#define FTP_SLICE_BYTES_HIGH      131072L
+#define FTP_SLICE_MILLIS_HIGH     30000L
+#define FTP_SLICE_BYTES_MEDIUM    32768L
+#define FTP_SLICE_MILLIS_MEDIUM   10000L
 
 //  file format
 #define DAY_MONTH_YEAR    0                       //  filename = "DD-MM-YY"
 #define YEAR_MONTH_DAY    1                       //  filename = "YY-MM-DD"
-#define SINGLE_FILE       2                       //  just named after first day
+#define SINGLE_FILE       2                       //  numbered segments, "SEG00001"
 
 #define SD_FILEFORMAT     YEAR_MONTH_DAY          //  order of date for the file name
 
+//  SINGLE_FILE logs are split into numbered segments that are rotated once they hold LOG_SEGMENT_RECORDS
+//  records or LOG_SEGMENT_BYTES bytes, and after every reboot. The upload state is the manifest of the
+//  segments, so uploads and scans only ever touch one segment, however long the probe has been deployed.
+#define LOG_SEGMENT_PREFIX    "SEG"
+#define LOG_SEGMENT_RECORDS   ( 86400L / DATA_INTERVAL )
+#define LOG_SEGMENT_BYTES     32768L
+
+//  day files are kept in "YYYY/MM/" directories, both on the SD and below FTP_DIR, so no directory ever
+//  holds more than a month of files. The modem can't create directories on the FTP server, so the
+//  server has to create the month directories (or accept uploads into missing ones).
+#define SHARD_DIRS        1                       //  1 - "YYYY/MM/YY-MM-DD.bin"
+                                                  //  0 - every file in the root, named after FTP_DIR
+
+#define FILENAME_SIZE     24                      //  longest SD path of a data file, plus terminator
+#define FTP_NAME_SIZE     56                      //  longest FTP path of a data file, plus terminator
+
+//  retention: once the SD has less than SD_MIN_FREE bytes free, the oldest files that have already been
+//  uploaded are deleted until there is enough space again
+#define SD_MIN_FREE       ( 64ULL * 1024 * 1024 )
+
+//  data log format
+#define LOG_TEXT          0                       //  "key=value,...;" lines, stored as .csv
+#define LOG_BINARY        1                       //  schema header followed by fixed-width records, stored as .bin
+
+//  format of the data files written to the SD and uploaded to FTP. Deployments keep the text files the
+//  server has always received unless they switch to LOG_BINARY on purpose.
+#define SD_LOGFORMAT      LOG_TEXT
+
+#if SD_LOGFORMAT == LOG_BINARY
+  #define LOG_EXTENSION   ".bin"
+#else
+  #define LOG_EXTENSION   ".csv"
+#endif
+
+#define LOG_MAGIC         "GPBL"                  //  first 4 bytes of every binary log file
+#define LOG_VERSION       2                       //  bump whenever the binary layout changes
+#define LOG_HEADER_SIZE   12                      //  fixed part of the binary header, before the channels
+#define LOG_CHANNEL_SIZE  23                      //  size of each channel descriptor in the binary header
+#define LOG_MISSING       ((int32_t) 0x80000000)  //  stored in place of a value that wasn't measured
+#define LOG_LINE_SIZE     256                     //  longest line of a LOG_TEXT file, including its line break
+
+//  journal mode: every record carries a sequence number that increases across files and reboots, and a
+//  CRC-16 that lets recoverDataFile() find and cut off a record torn by a watchdog reset. The ingestion
+//  side can use the sequence number to drop records it already has.
+#define SD_JOURNAL        1                       //  1 - sequence number and CRC on every record
+                                                  //  0 - off
+
+#define LOG_FLAG_JOURNAL  0x01                    //  binary header flag: records are journaled
+#define LOG_FLAG_SECTORS  0x02                    //  binary header flag: records start at the second sector and
+                                                  //  never straddle a sector boundary
+#define LOG_FLAG_FINAL    0x04                    //  binary header flag: the preallocated tail has been trimmed off
+
+//  preallocated day files: when the date rolls over the new day's file is created as one contiguous
+//  extent, big enough for a day of records, and records are written into it at a tracked offset instead
+//  of growing the file. The unused tail is trimmed off when the next day starts. The offset is found again
+//  after a reset from the journal, so this needs binary journaled records.
+#define SD_PREALLOCATE    0                       //  1 - preallocate day files (LOG_BINARY only)
+                                                  //  0 - grow files with every append
+
+#define LOG_SECTOR_SIZE       512
+#define LOG_PREALLOC_RECORDS  ( 86400L / DATA_INTERVAL + 86400L / DATA_INTERVAL / 10 )  //  a day plus 10%
+
+#if SD_PREALLOCATE == 1 && ( SD_LOGFORMAT != LOG_BINARY || SD_JOURNAL != 1 || SD_FILEFORMAT == SINGLE_FILE )
+  #error "SD_PREALLOCATE needs journaled LOG_BINARY day files"
+#endif
+
+//  pre-upload packing: a finished data file is encoded into a smaller sibling file ("18-07-26.gpc" for
+//  "18-07-26.bin") just before it is uploaded, and the sibling is uploaded in its place, see packing.h.
+//  Files that can't be packed and files whose plain upload has already started are uploaded as they are.
+#define UPLOAD_PLAIN      0                       //  upload the data files as they are
+#define UPLOAD_TSCODEC    1                       //  delta coded records, see tscodec.h (LOG_BINARY only)
+#define UPLOAD_LZSS       2                       //  the file compressed byte by byte, see lzss.h (any format)
+
+#if SD_LOGFORMAT == LOG_BINARY
+  #define UPLOAD_CODEC    UPLOAD_TSCODEC          //  encoding of uploaded data files
+  #define PACK_MILLIS_PER_KB  50                  //  rough time to pack 1 KB on the Waspmote, see packMillis()
+#else
+  #define UPLOAD_CODEC    UPLOAD_LZSS
+  #define PACK_MILLIS_PER_KB  100
+#endif
+
+#define PACK_EXTENSION    ".gpc"
+#define PACK_MAGIC        "GPTC"                  //  first 4 bytes of every packed file
+#define PACK_VERSION      1
+#define PACK_HEADER_SIZE  8                       //  fixed part of the packed header, before the log header
+
+//  describes each channel of the sample record: its name in text output, and how it is stored. The stored
+//  value is the measurement multiplied by 10^decimals, so "12.345" with 3 decimals is stored as 12345.
+//  Generated from the sensor registry above.
+struct channelInfo {
+  char key [12];
+  char unit [6];
+  uint8_t decimals;
+  uint8_t binary;                                 //  1 if the channel is stored in binary records
+};
+
+extern const channelInfo CHANNEL_INFO [] PROGMEM;   //  indexed by the KV_* channels
+
+//  number of measurement cycles kept in RAM before they are written to the SD, per battery level. Larger
+//  batches power the SD up less often but lose more data if the mote resets before a flush, so they are
+//  only used as the battery runs down.
+#define LOG_BATCH_HIGH      1
+#define LOG_BATCH_MEDIUM    2
+#define LOG_BATCH_LOW       4
+#define LOG_BATCH_CRITICAL  10
+#define LOG_BATCH_MAX       LOG_BATCH_CRITICAL    //  the largest of the above
+
+#define LOG_BATCH_BYTES     768                   //  RAM reserved for batched records
+
+//  records waiting to be written to the SD. All records in a batch belong to the same file.
+struct sampleBatch {
+  char filename [FILENAME_SIZE];
+  uint8_t count;                                  //  number of records in data
+  uint16_t len;                                   //  number of bytes used in data
+  uint8_t data [LOG_BATCH_BYTES];
+};
+
 extern uint8_t lastDate;
-extern char SD_filename [16];                          //  the name of the file stored on the SD
-extern char FTP_filename [44];                         //  the name and directory of the file stored on the FTP server
-const char UNSENT_FILES_NAME [] PROGMEM = "fList.txt";
+extern uint32_t sampleEpoch;                           //  epoch time of the current measurement cycle
+extern uint32_t recordSeq;                             //  sequence number of the last journaled record
+extern uint32_t seqFloor;                              //  every record of the current data file has a higher one
+extern uint16_t logSegment;                            //  number of the current SINGLE_FILE segment, 0 if unknown
+extern uint16_t segmentRecords;                        //  records written to the current segment since it was opened
+extern uint32_t segmentBytes;                          //  bytes written to the current segment since it was opened
+extern uint32_t logOffset;                             //  next write position in a preallocated file, 0 if unknown
+extern sampleBatch batch;                              //  records not yet written to the SD
+extern char SD_filename [FILENAME_SIZE];               //  the name of the file stored on the SD
+extern char FTP_filename [FTP_NAME_SIZE];              //  the name and directory of the file stored on the FTP server
+const char UNSENT_FILES_NAME [] PROGMEM = "fList.txt";    //  legacy list of unsent files, imported once
+const char UPLOAD_STATE_NAME [] PROGMEM = "fState.bin";   //  table of files and their upload state
 extern my4G comms;
 
 
 uint8_t setFileNames(char*, uint8_t, char*, uint8_t);
-uint8_t writeDataSet(keyvalue*,uint8_t, char*);
-bool updateTimes(char*, char*);
+uint8_t ftpPath(const char*, char*, uint8_t);
+void nextLogSegment();
+uint16_t findLogSegment();
+bool makeParentDir(const char*);
+uint8_t writeDataSet(const sampleRecord*, char*);
+uint8_t flushDataSet();
+uint8_t writeBatch();
+uint8_t batchSize();
+uint8_t serializeRecord(const sampleRecord*, uint16_t*);
+void dropFailedBatch(uint8_t);
+uint8_t recoverDataFile();
+void saveSeqMark();
+uint8_t rollDataFile(char*, char*);
+void siblingName(const char*, const char*, char*);
+bool updateTimes(sampleRecord*, char*);
 uint8_t appendUnsentFile();
 uint8_t checkUnsentFiles();
-uint8_t markSentFile(char*);
+uint32_t sliceLeft(uint32_t, uint32_t);
+void beginWalk(struct uploadWalk*, uint16_t);
+bool findUnsentSlot(struct uploadWalk*);
+void prepareUploads(struct uploadWalk*, uint32_t);
+bool nextUnsentFile(void*, char*, uint8_t, char*, uint8_t, uint32_t*, uint32_t*);
+void uploadProgress(void*, uint32_t);
+void uploadDone(void*, uint8_t);
+uint8_t markSentFile(uint16_t);
+bool advanceHead();
+#if FTP_UPLOAD_RATE == FTP_UPLOAD_HOURLY
+uint8_t sendRecent();
+uint8_t checkRecentUpload();
+#endif
+
+//  upload state table, see uploadstate.h
+#define UPLOAD_MAGIC      "GPUS"
+#define UPLOAD_VERSION    2
+#define UPLOAD_SLOTS      128                     //  files tracked at once, the oldest is dropped when full
+#define UPLOAD_SENT       0x01                    //  slot flag: file is on the FTP server
+#define UPLOAD_PACKED     0x02                    //  slot flag: the packed sibling is uploaded instead
+
+struct uploadHeader {
+  char magic [4];
+  uint8_t version;
+  uint8_t check;                                  //  see uploadCheck()
+  uint16_t slots;                                 //  UPLOAD_SLOTS when the file was built
+  uint16_t head;                                  //  oldest slot that may still be unsent
+  uint16_t tail;                                  //  next free slot
+  uint16_t oldest;                                //  oldest slot whose file may still be on the SD
+  uint16_t cursor;                                //  slot the next slice of the backlog starts at
+};
+
+//  walk through the upload state by checkUnsentFiles(), the context of the FTP batch callbacks
+#define UPLOAD_WALK_OPEN      0                   //  there may be more unsent files
+#define UPLOAD_WALK_END       1                   //  reached the current day's file or the end of the list
+#define UPLOAD_WALK_CORRUPT   2                   //  a slot couldn't be read or repaired, see repairSlot()
+#define UPLOAD_WALK_SD        3                   //  the SD or upload state couldn't be opened
+#define UPLOAD_WALK_BUNDLE    0xFFFF              //  current while the catch-up bundle is uploaded
+
+struct uploadWalk {
+  uint16_t idx;                                   //  next slot to look at
+  uint16_t current;                               //  slot of the file being uploaded, or UPLOAD_WALK_BUNDLE
+  uint8_t status;                                 //  UPLOAD_WALK_*
+  uint8_t bundle;                                 //  1 while the bundle still has to be handed out
+  uint16_t start;                                 //  slot the walk started at
+  uint8_t wrapped;                                //  1 once the walk went on from the head, up to start
+  uint16_t cursor;                                //  slot the next walk should start at
+  uint8_t ready;                                  //  files prepared for the FTP batch, see prepareUploads()
+  uint32_t started;                               //  millis() the slice's time counts from, see sliceLeft()
+  uint32_t maxMillis;                             //  time quota of the slice
+};
+
+struct uploadSlot {
+  char name [FILENAME_SIZE];                      //  SD path of the data file
+  uint8_t flags;
+  uint8_t check;
+  uint32_t sentBytes;                             //  offset a broken off upload reached, to resume from
+  uint8_t reserved [2];
+};
+
+//  catch-up bundles: once BUNDLE_THRESHOLD files or more wait for an upload, such as after an outage, the
+//  oldest of them are packed into a single bundle file with a table of contents, which is uploaded as one
+//  object and marks all its files as sent at once, see bundle.h. A bundle file is:
+//
+//    bundleHeader, BUNDLE_MAX_FILES bundleEntry, then the contents of every file in the order of the entries
+//
+//  tools/unbundle.cpp restores the files on the server.
+#define BUNDLE_THRESHOLD  4                       //  unsent files that start bundling, 0 - never bundle
+#define BUNDLE_MAX_FILES  16                      //  files per bundle
+#define BUNDLE_MAX_BYTES  524288L                 //  no file is added once a bundle has grown this large
+#define BUNDLE_EXTENSION  ".gpb"                  //  the bundle is named after its first file
+#define BUNDLE_MAGIC      "GPBN"
+#define BUNDLE_VERSION    1
+
+struct bundleHeader {
+  char magic [4];                                 //  BUNDLE_MAGIC
+  uint8_t version;                                //  BUNDLE_VERSION
+  uint8_t count;                                  //  entries in use
+  uint8_t reserved [2];
+};
+
+struct bundleEntry {
+  char name [FILENAME_SIZE];                      //  SD path of the file, a packed sibling if codec is set
+  uint32_t size;                                  //  bytes of the file in the bundle
+  uint8_t codec;                                  //  UPLOAD_CODEC it was packed with, UPLOAD_PLAIN if not
+  uint8_t reserved [3];
+};
+
+//  the bundle waiting for an upload, kept in BUNDLE_STATE_NAME so it survives a reset
+#define BUNDLE_NONE       0                       //  no bundle
+#define BUNDLE_BUILT      1                       //  the bundle file is complete and waits for its upload
+#define BUNDLE_SENT       2                       //  uploaded, its files still have to be marked as sent
+
+const char BUNDLE_STATE_NAME [] PROGMEM = "fBundle.bin";
+
+struct bundleState {
+  char magic [4];                                 //  BUNDLE_MAGIC
+  uint8_t status;                                 //  BUNDLE_*
+  uint8_t count;                                  //  files in the bundle
+  uint8_t check;                                  //  see uploadCheck()
+  uint8_t reserved;
+  uint16_t first;                                 //  slot of the first file in the bundle
+  uint16_t end;                                   //  slot after the last one, every unsent slot between is bundled
+  uint32_t sentBytes;                             //  offset a broken off upload of the bundle reached
+  char name [FILENAME_SIZE];                      //  SD path of the first file
+};
+
+//  recent history ring in EEPROM, see history.h
+#define HISTORY_EEPROM_START  EEPROM_START          //  the EEPROM below this is reserved by the Waspmote API
+#define HISTORY_EEPROM_SIZE   2048                  //  bytes of EEPROM used for the ring
+#define HISTORY_EVERY         5                     //  every HISTORY_EVERY-th cycle is kept
+#define HISTORY_POINTS        8                     //  points per channel in the HISTORY dweet
+#define HISTORY_NONE          0xFFFF                //  historyHead while the ring is empty
+
+//  the modem's cached operator follows the ring, MY4G_CACHE_SIZE bytes, see my4G::useNetworkCache()
+#define MODEM_EEPROM_START    ( HISTORY_EEPROM_START + HISTORY_EEPROM_SIZE )
+
+//  then the journal's sequence number at the last change of data file, a seqMark, see saveSeqMark()
+#define SEQ_EEPROM_START      ( MODEM_EEPROM_START + MY4G_CACHE_SIZE )
+
+struct seqMark {
+  uint32_t seq;                                   //  recordSeq when the current data file was started
+  uint16_t day;                                   //  that file's day, days since 1970
+  uint16_t crc;                                   //  CRC-16 of seq and day
+};
+
+struct historySlot {
+  uint16_t seq;                                   //  increases by one for every slot written
+  uint32_t epoch;                                 //  time of the sample
+  uint16_t valid;                                 //  sampleRecord.valid
+  int32_t value [NUM_KEYVALS - 1];                //  every channel but KV_SECONDS, which is always last
+  uint16_t crc;                                   //  CRC-16 of everything before it
+};
+
+#define HISTORY_SLOTS     ( HISTORY_EEPROM_SIZE / sizeof(historySlot) )
+#define HISTORY_CRC_SIZE  ( sizeof(historySlot) - sizeof(uint16_t) )  //  bytes covered by the CRC
+
+//  the window of the ring a HISTORY dweet covers, the context of historyField()
+struct historyWindow {
+  uint16_t first;                                 //  oldest slot of the window
+  uint16_t count;                                 //  slots in the window
+  uint16_t seq;                                   //  sequence number the oldest slot should carry
+  uint16_t bucket;                                //  slots averaged into each point
+  uint8_t points;                                 //  points per channel, at most HISTORY_POINTS
+};
+
+typedef char historyFieldsFit [ 1 + NUM_KEYVALS * HISTORY_POINTS <= 255 ? 1 : -1 ];  //  see historyFields()
+
+void openHistory();
+void recordHistory(const sampleRecord*);
+void makeHistoryWindow(historyWindow*);
+uint8_t historyFields(const historyWindow*);
+void historyField(const void*, uint8_t, strbuf*, strbuf*);
+
+//  SD latency statistics, see sdhealth.h
+#define SD_OP_ON              0
+#define SD_OP_OPEN            1
+#define SD_OP_APPEND          2
+#define SD_OP_CLOSE           3
+#define SD_OP_CATLN           4
+#define SD_OPS                5
+#define SD_OP_NONE            0xFF
+#define SD_LATENCY_BUCKETS    10                    //  the last bucket holds everything from 512 ms
+#define SD_HEALTH_MAGIC       0x53444831UL          //  "SDH1"
+#define SD_HEALTH_FIELDS      ( SD_OPS * ( SD_LATENCY_BUCKETS + 1 ) + 4 )
+
+const char SD_HEALTH_NAME [] PROGMEM = "health.txt";     //  one line of SD statistics per day
+
+const char SD_OP_NAME_ON [] PROGMEM = "on";
+const char SD_OP_NAME_OPEN [] PROGMEM = "open";
+const char SD_OP_NAME_APPEND [] PROGMEM = "append";
+const char SD_OP_NAME_CLOSE [] PROGMEM = "close";
+const char SD_OP_NAME_CATLN [] PROGMEM = "catln";
+
+const char* const SD_OP_NAMES [] PROGMEM =
+{
+  SD_OP_NAME_ON,
+  SD_OP_NAME_OPEN,
+  SD_OP_NAME_APPEND,
+  SD_OP_NAME_CLOSE,
+  SD_OP_NAME_CATLN
+};
+
+struct sdHealth {
+  uint32_t magic;                                 //  SD_HEALTH_MAGIC once initialized
+  uint32_t since;                                 //  epoch time the statistics started
+  uint16_t histogram [SD_OPS][SD_LATENCY_BUCKETS];
+  uint16_t maxMs [SD_OPS];                        //  longest duration of each operation
+  uint16_t retries;                               //  SD power-ons that needed a second try
+  uint16_t failed;                                //  operations that returned an error
+  uint16_t aborted;                               //  operations cut off by a watchdog reset
+  uint8_t pending;                                //  operation in progress, SD_OP_NONE if none
+};
+
+void openSdHealth();
+bool sdOn();
+uint8_t sdOpen(const char*, SdFile*, uint8_t);
+uint8_t sdAppend(const char*, uint8_t*, uint16_t);
+uint8_t sdClose(SdFile*);
+char* sdCatln(const char*, uint32_t, uint32_t);
+void healthField(const void*, uint8_t, strbuf*, strbuf*);
+uint8_t writeHealthRecord();
+
+uint8_t packDataFile(const char*, const char*);
+uint8_t packForUpload(uint16_t, struct uploadSlot*, const char*, uint32_t);
+bool packedPath(const struct uploadSlot*, char*, uint8_t);
+void removePacked(const char*);
+uint32_t packMillis(uint32_t);
+
+bool prepareBundle(uint32_t, uint32_t);
+uint8_t buildBundle(uint32_t, uint32_t);
+bool nextBundle(char*, uint8_t, char*, uint8_t, uint32_t*, uint32_t*);
+void bundleProgress(uint32_t);
+void bundleDone(uint8_t);
+bool markBundleSent();
 
 void execute_BL_HIGH();
 void execute_BL_MEDIUM();
@@ -97,7 +527,7 @@ uint8_t runCommand(int8_t);
 
 //  levels:
 //  3: battery essentially full. All functions are performed.
-//  2: battery level is dropping. Stop sending data over 4G.
+//  2: battery level is dropping. Only small slices of the backlog are sent over 4G.
 //  1: battery level is low. Limit scans through SD card, don't use DS-2 or sonic sensors.
 //      also double the duration of sleep between cycles.
 //  0: battery critically low. Do not perform any functions.
@@ -109,7 +539,13 @@ uint8_t runCommand(int8_t);
 
 extern uint8_t battery;
                        
+#include "sample.h"				  //	the sample record of the current cycle
 #include "sensors.h"				  //	Custom sensor functions that can be enabled / disabled based on what is connected
+#include "history.h"				  //	the last few hours of samples in EEPROM
+#include "sdhealth.h"				  //	SD latency statistics
+#include "uploadstate.h"
+#include "packing.h"				  //	packs data files into a smaller file for the upload
+#include "bundle.h"				  //	uploads a backlog of files as one bundle
 #include "datalogging.h"
 
 
@@ -0,0 +1,244 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "header.h"
+/******************************************************************************************
+history.h
+
+Keeps the last few hours of samples in the Waspmote's EEPROM, so they can be checked remotely
+with the HISTORY command without uploading a whole data file, and so they survive a failed SD
+card. Every HISTORY_EVERY-th sample is stored in a ring of slots:
+
+  slot [0 .. HISTORY_SLOTS-1]             sizeof(historySlot) bytes each, from HISTORY_EEPROM_START
+
+There is no header that would be rewritten on every sample. Instead every slot carries a
+sequence number one higher than the slot before it, and the newest slot is found again on boot
+by scanning for the highest one, so every EEPROM cell is written equally often: once every
+HISTORY_SLOTS * HISTORY_EVERY cycles. Slots that fail their CRC, such as one torn by a reset, are
+skipped. The CRC starts from a hash of the channel list (historyLayout), so all slots written
+before the channels changed fail it too.
+
+The HISTORY dweet averages the ring down to HISTORY_POINTS points per channel, see
+historyField().
+******************************************************************************************/
+
+uint16_t historyHead = HISTORY_NONE;            //  newest slot, HISTORY_NONE if the ring is empty
+uint16_t historySeq = 0;                        //  sequence number of the newest slot
+uint16_t historyCount = 0;                      //  slots in use
+uint8_t historyCycles = 0;                      //  cycles since the last stored sample
+uint16_t historyLayout = 0xFFFF;                //  CRC-16 of CHANNEL_INFO, the start of every slot's CRC
+
+/*
+historyAddress()
+EEPROM address of a slot.
+ */
+
+uint16_t historyAddress(uint16_t slot)
+{
+  return HISTORY_EEPROM_START + slot * sizeof(historySlot);
+}
+
+/*
+readHistorySlot()
+Reads a slot from the EEPROM and checks its CRC.
+
+Returns:
+- true if the slot holds a sample
+- false if it is empty or corrupt
+ */
+
+bool readHistorySlot(uint16_t slot, historySlot* out)
+{
+  eeprom_read_block(out, (const void*) historyAddress(slot), sizeof(historySlot));
+  return crc16((const uint8_t*) out, HISTORY_CRC_SIZE, historyLayout) == out->crc;
+}
+
+/*
+openHistory()
+Finds the newest slot of the ring, the one with the highest sequence number. Sequence numbers are
+compared as a signed difference so they can wrap around.
+ */
+
+void openHistory()
+{
+  historyHead = HISTORY_NONE;
+  historyCount = 0;
+
+  historyLayout = 0xFFFF;                       //  the keys, units and scaling of every channel
+  for(uint16_t i = 0; i < NUM_KEYVALS * sizeof(channelInfo); i++)
+  {
+    uint8_t b = pgm_read_byte((const uint8_t*) CHANNEL_INFO + i);
+    historyLayout = crc16(&b, 1, historyLayout);
+  }
+
+  historySlot slot;
+  for(uint16_t i = 0; i < HISTORY_SLOTS; i++)
+  {
+    if( !readHistorySlot(i, &slot) )
+    {
+      continue;
+    }
+    historyCount++;
+    if( historyHead == HISTORY_NONE || (int16_t) ( slot.seq - historySeq ) > 0 )
+    {
+      historyHead = i;
+      historySeq = slot.seq;
+    }
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("History: %u of %u slots, newest %u\n", historyCount, (uint16_t) HISTORY_SLOTS, historyHead);
+  #endif
+}
+
+/*
+recordHistory()
+Stores every HISTORY_EVERY-th sample in the slot after the newest one, overwriting the oldest
+sample once the ring is full. eeprom_update_block() skips bytes that didn't change.
+ */
+
+void recordHistory(const sampleRecord* sample)
+{
+  if( ++historyCycles < HISTORY_EVERY )
+  {
+    return;
+  }
+  historyCycles = 0;
+
+  historySlot slot;
+  slot.seq = historySeq + 1;
+  slot.epoch = sampleEpoch;
+  slot.valid = sample->valid;
+  memcpy(slot.value, sample->value, sizeof(slot.value));
+  slot.crc = crc16((const uint8_t*) &slot, HISTORY_CRC_SIZE, historyLayout);
+
+  uint16_t next = ( historyHead == HISTORY_NONE ) ? 0 : ( historyHead + 1 ) % HISTORY_SLOTS;
+  eeprom_update_block(&slot, (void*) historyAddress(next), sizeof(slot));
+
+  historyHead = next;
+  historySeq = slot.seq;
+  if( historyCount < HISTORY_SLOTS )
+  {
+    historyCount++;
+  }
+}
+
+/*
+makeHistoryWindow()
+Sets up a window over the slots in use, split into buckets so there are at most HISTORY_POINTS
+points per channel. The window goes back from the newest slot for as long as the slots carry the
+sequence numbers before it, skipping a torn slot on the way, so a slot left over from an older
+pass of the ring is never taken for a recent one.
+ */
+
+void makeHistoryWindow(historyWindow* window)
+{
+  memset(window, 0, sizeof(historyWindow));
+  if( historyHead == HISTORY_NONE )
+  {
+    return;
+  }
+
+  historySlot slot;
+  for(uint16_t back = 0; back < HISTORY_SLOTS; back++)
+  {
+    uint16_t i = ( historyHead + HISTORY_SLOTS - back ) % HISTORY_SLOTS;
+    if( readHistorySlot(i, &slot) && slot.seq == (uint16_t) ( historySeq - back ) )
+    {
+      window->first = i;
+      window->count = back + 1;
+    }
+  }
+  if( window->count == 0 )
+  {
+    return;
+  }
+  window->seq = historySeq - ( window->count - 1 );
+  window->bucket = ( window->count + HISTORY_POINTS - 1 ) / HISTORY_POINTS;
+  window->points = ( window->count + window->bucket - 1 ) / window->bucket;
+}
+
+/*
+historyFields()
+Number of fields historyField() formats for a window.
+ */
+
+uint8_t historyFields(const historyWindow* window)
+{
+  return 1 + NUM_KEYVALS * window->points;
+}
+
+/*
+historyField()
+kvField callback for serializeFields() with a historyWindow as its context. The fields are:
+
+- "newest": epoch time of the newest sample
+- "age0", "age1", ...: for every point, the minutes between its last sample and the newest sample
+- "<key>0", "<key>1", ... for every sensor channel: the average of every point, or an empty value
+  where no sample of the point measured the channel
+
+Every value is a field of its own so it fits into a keyvalue string, so there are
+historyFields() fields, as KV_SECONDS isn't stored.
+ */
+
+void historyField(const void* context, uint8_t index, strbuf* key, strbuf* val)
+{
+  const historyWindow* window = (const historyWindow*) context;
+  historySlot slot;
+
+  if( index == 0 )
+  {
+    key->append_P(PSTR("newest"));
+    if( window->count > 0 && readHistorySlot(historyHead, &slot) )
+    {
+      val->appendf_P(PSTR("%lu"), (unsigned long) slot.epoch);
+    }
+    return;
+  }
+
+  uint8_t row = ( index - 1 ) / window->points; //  0 for the ages, then the channels
+  uint8_t point = ( index - 1 ) % window->points;
+  uint8_t ch = row - 1;
+  key->append_P(row == 0 ? PSTR("age") : CHANNEL_INFO[ch].key);
+  key->appendf_P(PSTR("%u"), point);
+
+  uint32_t newest = 0;
+  if( row == 0 )
+  {
+    readHistorySlot(historyHead, &slot);
+    newest = slot.epoch;
+  }
+
+  int64_t sum = 0;
+  uint16_t n = 0;
+  uint32_t last = 0;
+  uint16_t start = point * window->bucket;
+  for(uint16_t i = start; i < start + window->bucket && i < window->count; i++)
+  {
+    if( !readHistorySlot(( window->first + i ) % HISTORY_SLOTS, &slot) ||
+        slot.seq != (uint16_t) ( window->seq + i ) )
+    {
+      continue;
+    }
+    last = slot.epoch;
+    if( row > 0 && ( slot.valid & SAMPLE_BIT(ch) ) )
+    {
+      sum += slot.value[ch];
+      n++;
+    }
+  }
+
+  if( row == 0 )
+  {
+    if( last != 0 )
+    {
+      val->appendf_P(PSTR("%lu"), (unsigned long) ( newest - last ) / 60);
+    }
+  }
+  else if( n > 0 )
+  {
+    val->appendScaled(( sum + ( sum < 0 ? -(int64_t) n : n ) / 2 ) / n, channelDecimals(ch));   //  rounded
+  }
+}
+
+#endif
@@ -0,0 +1,388 @@
+#ifndef PACKING_H
+#define PACKING_H
+
+#include "header.h"
+/******************************************************************************************
+packing.h
+
+Packs a finished data file into a smaller sibling file before it is uploaded, so less
+airtime is spent on it. Files are packed before the modem is powered (see prepareUploads),
+so the modem doesn't wait for it. There are two codecs, chosen with UPLOAD_CODEC:
+
+- UPLOAD_TSCODEC delta codes the records of a binary file (see tscodec.h), which takes a
+  day of one-minute records down to a fraction of their size, as timestamps and
+  measurements barely change from one record to the next.
+- UPLOAD_LZSS compresses any file byte by byte (see lzss.h). Text files repeat the same
+  keys on every line, which it replaces with short references to the line before.
+
+A packed file starts with:
+
+  char    magic [4]       PACK_MAGIC
+  uint8   version         PACK_VERSION
+  uint8   codec           UPLOAD_CODEC
+  uint8   fields          UPLOAD_TSCODEC: int32 fields per row: [seq], epoch, one per channel
+  uint8   timeFields      UPLOAD_TSCODEC: 2 for journaled records (seq and epoch), 1 otherwise
+
+With UPLOAD_TSCODEC it goes on with the header and channel descriptors of the data file,
+unchanged (see writeLogHeader), and the coded rows. The CRCs of journaled records aren't
+packed, as the decoder can compute them again, and records that fail their CRC are left
+out. With UPLOAD_LZSS the whole data file follows, compressed.
+
+The encoding is deterministic, so a packed file that was lost can be built again and an
+upload of it resumed. tools/tsdecode.cpp turns a UPLOAD_TSCODEC file back into a CSV file,
+and tools/lzdecode.cpp restores the data file from a UPLOAD_LZSS file.
+******************************************************************************************/
+
+/*
+packWrite()
+tsWrite and lzWrite callback of the encoders, writes to an open SdFile.
+ */
+
+bool packWrite(void* context, const uint8_t* data, uint8_t len)
+{
+  return ( (SdFile*) context )->write(data, len) == len;
+}
+
+/*
+writePackHeader()
+Writes the fixed part of the packed header.
+ */
+
+bool writePackHeader(SdFile* out, uint8_t fields, uint8_t timeFields)
+{
+  uint8_t header [PACK_HEADER_SIZE] = {0};
+  memcpy(header, PACK_MAGIC, 4);
+  header[4] = PACK_VERSION;
+  header[5] = UPLOAD_CODEC;
+  header[6] = fields;
+  header[7] = timeFields;
+  return out->write(header, sizeof(header)) == sizeof(header);
+}
+
+#if UPLOAD_CODEC == UPLOAD_TSCODEC
+
+/*
+packRecords()
+Packs the records of an open binary data file with tscodec, see packDataFile().
+ */
+
+uint8_t packRecords(SdFile* in, SdFile* out)
+{
+  uint8_t header [LOG_HEADER_SIZE];
+  if( in->read(header, sizeof(header)) != sizeof(header) ||
+      memcmp(header, LOG_MAGIC, 4) != 0 ||
+      header[4] != LOG_VERSION )
+  {
+    return 2;
+  }
+
+  uint8_t channels = header[5];
+  uint16_t recordSize;
+  memcpy(&recordSize, header + 6, sizeof(recordSize));
+  bool journal = header[8] & LOG_FLAG_JOURNAL;
+  bool sectors = header[8] & LOG_FLAG_SECTORS;
+
+  uint8_t timeFields = journal ? 2 : 1;
+  uint8_t fields = timeFields + channels;
+  uint8_t record [sizeof(uint32_t) + sizeof(uint32_t) + NUM_KEYVALS * sizeof(int32_t) + sizeof(uint16_t)];
+  if( recordSize != fields * sizeof(int32_t) + ( journal ? sizeof(uint16_t) : 0 ) ||
+      recordSize > sizeof(record) )
+  {
+    return 2;
+  }
+
+  if( !writePackHeader(out, fields, timeFields) ||
+      out->write(header, sizeof(header)) != sizeof(header) )
+  {
+    return 3;
+  }
+
+  for(uint8_t ch = 0; ch < channels; ch++)      //  the channel descriptors go along unchanged
+  {
+    uint8_t descriptor [LOG_CHANNEL_SIZE];
+    if( in->read(descriptor, sizeof(descriptor)) != sizeof(descriptor) ||
+        out->write(descriptor, sizeof(descriptor)) != sizeof(descriptor) )
+    {
+      return 3;
+    }
+  }
+
+  tsEncoder encoder(packWrite, out);
+  encoder.begin(fields, timeFields);
+
+  uint32_t size = in->fileSize();
+  uint32_t offset = sectors ? LOG_SECTOR_SIZE : LOG_HEADER_SIZE + channels * LOG_CHANNEL_SIZE;
+  int32_t row [TS_MAX_FIELDS];
+  while( true )
+  {
+    if( sectors && offset % LOG_SECTOR_SIZE + recordSize > LOG_SECTOR_SIZE )
+    {
+      offset += LOG_SECTOR_SIZE - offset % LOG_SECTOR_SIZE;   //  records never straddle a sector
+    }
+    if( offset + recordSize > size )
+    {
+      break;
+    }
+    if( offset % LOG_SECTOR_SIZE < recordSize )
+    {
+RTC.setWatchdog(8);
+    }
+
+    if( !in->seekSet(offset) || in->read(record, recordSize) != recordSize )
+    {
+      return 1;
+    }
+    offset += recordSize;
+
+    if( journal )
+    {
+      uint16_t crc;
+      memcpy(&crc, record + recordSize - sizeof(crc), sizeof(crc));
+      if( crc16(record, recordSize - sizeof(crc), 0xFFFF) != crc )
+      {
+        if( sectors )                           //  the rest of a preallocated file was never written
+        {
+          break;
+        }
+        continue;                               //  a torn record, leave it out
+      }
+    }
+
+    memcpy(row, record, fields * sizeof(int32_t));
+    if( !encoder.add(row) )
+    {
+      return 3;
+    }
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Packed %lu records of %lu bytes\n", encoder.rows, size);
+  #endif
+  return encoder.finish() ? 0 : 3;
+}
+
+#elif UPLOAD_CODEC == UPLOAD_LZSS
+
+/*
+packBytes()
+Compresses an open data file with lzss, see packDataFile(). Matching is slow on the Waspmote, so the 8
+second watchdog is restarted for every sector. The encoder holds a LZ_WINDOW byte ring, which is too much
+for the stack while the batch and upload state are live, and too much to keep for the rest of the cycle,
+so it is taken from the heap only while the file is packed.
+
+Returns:
+- 0 if the file was packed
+- 1 if the data file couldn't be read
+- 3 if the packed file couldn't be written, or there is no memory for the encoder
+ */
+
+uint8_t packBytes(SdFile* in, SdFile* out)
+{
+  if( !writePackHeader(out, 0, 0) )
+  {
+    return 3;
+  }
+
+  lzEncoder* encoder = new lzEncoder(packWrite, out);
+  if( encoder == NULL )
+  {
+    return 3;
+  }
+
+  uint8_t result = 0;
+  uint8_t chunk [64];
+  int16_t n;
+  while( ( n = in->read(chunk, sizeof(chunk)) ) > 0 )
+  {
+    if( encoder->in % LOG_SECTOR_SIZE == 0 )
+    {
+RTC.setWatchdog(8);
+    }
+    if( !encoder->put(chunk, n) )
+    {
+      result = 3;
+      break;
+    }
+  }
+  if( result == 0 && n < 0 )
+  {
+    result = 1;
+  }
+  if( result == 0 && !encoder->finish() )
+  {
+    result = 3;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Packed %lu bytes\n", encoder->in);
+  #endif
+  delete encoder;
+  return result;
+}
+
+#endif
+
+/*
+packDataFile()
+Packs the data file fname into packed with UPLOAD_CODEC, replacing any file of that name. Takes a few
+seconds for a full day, so the 8 second watchdog is restarted as it goes. The SD must already be on.
+
+Returns:
+- 0 if the file was packed
+- 1 if the data file couldn't be opened or read
+- 2 if the codec can't pack it, such as a text file with UPLOAD_TSCODEC
+- 3 if the packed file couldn't be written
+ */
+
+uint8_t packDataFile(const char* fname, const char* packed)
+{
+#if UPLOAD_CODEC == UPLOAD_TSCODEC || UPLOAD_CODEC == UPLOAD_LZSS
+  SdFile in;
+  if( !sdOpen(fname, &in, O_READ) )
+  {
+    return 1;
+  }
+
+  SdFile out;
+  if( !sdOpen(packed, &out, O_WRITE | O_CREAT | O_TRUNC) )
+  {
+    sdClose(&in);
+    return 3;
+  }
+
+  #if UPLOAD_CODEC == UPLOAD_TSCODEC
+    uint8_t result = packRecords(&in, &out);
+  #else
+    uint8_t result = packBytes(&in, &out);
+  #endif
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Packed file: %lu bytes\n", out.fileSize());
+  #endif
+
+  sdClose(&out);
+  sdClose(&in);
+  return result;
+#else
+  return 2;
+#endif
+}
+
+/*
+packForUpload()
+Decides whether the file of a slot is uploaded packed, and packs it if so, before the FTP session of the
+slice starts (see prepareUploads). A file is packed if nothing of it was uploaded yet, or if it was already
+being uploaded packed (UPLOAD_PACKED); an existing packed file is reused, so its upload can resume, and a
+lost one is packed again, which gives the same bytes. Packing is only started if it fits into the time left
+of the slice (see packMillis). The decision is kept in the slot, which must be idx of the open upload state.
+If the file can't be packed it is uploaded as it is.
+
+Parameters:
+- uint16_t idx, uploadSlot* slot: the slot of the file
+- const char* fname: path of the data file
+- uint32_t left: ms left of the slice
+
+Returns:
+- 0 if the packed file is to be uploaded, see packedPath()
+- 1 if the data file itself is to be uploaded
+- 2 if there is no time left to pack it
+ */
+
+uint8_t packForUpload(uint16_t idx, uploadSlot* slot, const char* fname, uint32_t left)
+{
+#if UPLOAD_CODEC != UPLOAD_PLAIN
+  bool packed = slot->flags & UPLOAD_PACKED;
+  if( !packed && slot->sentBytes > 0 )          //  a plain upload is under way, such as hourly appends
+  {
+    return 1;
+  }
+
+  char name [FILENAME_SIZE] = {0};
+  siblingName(fname, PACK_EXTENSION, name);
+  if( packed && SD.isFile(name) == 1 )
+  {
+    return 0;
+  }
+  if( packMillis(SD.getFileSize(fname)) >= left )
+  {
+    return 2;
+  }
+
+  if( packDataFile(fname, name) != 0 )
+  {
+    SD.del(name);
+    if( packed )                                //  go back to a plain upload
+    {
+      slot->flags &= ~UPLOAD_PACKED;
+      slot->sentBytes = 0;
+      writeSlot(idx, slot);
+    }
+    return 1;
+  }
+
+  if( !packed )
+  {
+    slot->flags |= UPLOAD_PACKED;
+    writeSlot(idx, slot);
+  }
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+/*
+packedPath()
+Replaces sdPath, the path of the data file of slot, with that of its packed file if packForUpload() decided
+to upload that instead.
+
+Returns:
+- true if sdPath is now the packed file, or the file isn't uploaded packed
+- false if it should be but the packed file is gone, so the file has to be prepared again
+ */
+
+bool packedPath(const uploadSlot* slot, char* sdPath, uint8_t sdSize)
+{
+  if( !( slot->flags & UPLOAD_PACKED ) )
+  {
+    return true;
+  }
+
+  char name [FILENAME_SIZE] = {0};
+  siblingName(sdPath, PACK_EXTENSION, name);
+  if( strlen(name) >= sdSize || SD.isFile(name) != 1 )
+  {
+    return false;
+  }
+  strcpy(sdPath, name);
+  return true;
+}
+
+/*
+packMillis()
+Rough time packing a data file of size bytes takes on the Waspmote, so a slice of the backlog can leave a
+file for the next wake instead of packing it past its time (see PACK_MILLIS_PER_KB).
+ */
+
+uint32_t packMillis(uint32_t size)
+{
+#if UPLOAD_CODEC != UPLOAD_PLAIN
+  return ( size / 1024 + 1 ) * PACK_MILLIS_PER_KB;
+#else
+  return 0;
+#endif
+}
+
+/*
+removePacked()
+Deletes the packed sibling of a data file, if there is one. The SD must already be on.
+ */
+
+void removePacked(const char* fname)
+{
+  char name [FILENAME_SIZE] = {0};
+  siblingName(fname, PACK_EXTENSION, name);
+  SD.del(name);
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include "header.h"
+/******************************************************************************************
+Sample.h
+
+Helpers for the sample record of a measurement cycle (see sampleRecord in header.h). The
+sensors store their measurements as integers scaled by the decimals of the channel, and the
+channels are only turned into text by sampleField() as they are written to a log line or a
+dweet, so no strings have to be kept for them in between.
+
+setSampleFloat(&currSample, KV_TEMPERATURE, 12.3456);   //  stored as 12346
+sampleField() then formats it as "temperature" and "12.346"
+
+******************************************************************************************/
+
+/*
+channelDecimals()
+Number of decimal places channel ch is stored with, from CHANNEL_INFO.
+*/
+
+uint8_t channelDecimals(uint8_t ch)
+{
+  return pgm_read_byte(&CHANNEL_INFO[ch].decimals);
+}
+
+/*
+setSample()
+Stores an already scaled value for channel ch and marks the channel as measured.
+*/
+
+void setSample(sampleRecord* sample, uint8_t ch, int32_t value)
+{
+  sample->value[ch] = value;
+  sample->valid |= SAMPLE_BIT(ch);
+}
+
+/*
+setSampleFloat()
+Scales a float measurement by the decimals of channel ch, rounding to the nearest step, and stores it.
+A NaN reading or one too large for an int32 leaves the channel unmeasured.
+
+Returns:
+- true if the value was stored
+- false if it was dropped
+*/
+
+bool setSampleFloat(sampleRecord* sample, uint8_t ch, float value)
+{
+  uint8_t decimals = channelDecimals(ch);
+  for(uint8_t i = 0; i < decimals; i++)
+  {
+    value *= 10;
+  }
+
+  if( value != value || value > 2147483000.0 || value < -2147483000.0 )   //  NaN never equals itself
+  {
+    return false;
+  }
+
+  setSample(sample, ch, (int32_t) ( value < 0 ? value - 0.5 : value + 0.5 ));
+  return true;
+}
+
+/*
+sampleField()
+kvField callback for serializeFields() with a sampleRecord as its context: formats the key of channel
+index and its value with the channel's decimals. Channels that weren't measured get an empty value.
+*/
+
+void sampleField(const void* context, uint8_t index, strbuf* key, strbuf* val)
+{
+  const sampleRecord* sample = (const sampleRecord*) context;
+
+  key->append_P(CHANNEL_INFO[index].key);
+  if( sample->valid & SAMPLE_BIT(index) )
+  {
+    val->appendScaled(sample->value[index], channelDecimals(index));
+  }
+}
+
+#endif
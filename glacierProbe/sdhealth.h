@@ -0,0 +1,257 @@
+#ifndef SDHEALTH_H
+#define SDHEALTH_H
+
+#include "header.h"
+/******************************************************************************************
+sdhealth.h
+
+Times the SD card operations the data logging relies on, so a card that slows down in the
+cold shows up before it starts running into the watchdogs. Power-on, open, append, close and
+catln go through the wrappers below instead of the SD object, and each one adds its duration
+to a latency histogram:
+
+  bucket 0              under 2 ms
+  bucket b              2^b to 2^(b+1) - 1 ms
+  bucket last           2^(SD_LATENCY_BUCKETS-1) ms and more
+
+Next to the histogram sdStats counts power-on retries and failed operations. It lives in
+.noinit RAM, which keeps its contents through the reset a watchdog causes, and remembers which
+operation is in progress. An operation that is still in progress on boot was cut off by a
+watchdog and is counted as aborted.
+
+The statistics are dweeted by the SDHEALTH command and appended to SD_HEALTH_NAME once a day
+by writeHealthRecord(), which starts a new day of statistics.
+******************************************************************************************/
+
+sdHealth sdStats __attribute__ ((section (".noinit")));
+
+/*
+resetSdHealth()
+Starts the statistics over from now.
+ */
+
+void resetSdHealth()
+{
+  memset(&sdStats, 0, sizeof(sdStats));
+  sdStats.magic = SD_HEALTH_MAGIC;
+  sdStats.pending = SD_OP_NONE;
+  sdStats.since = RTC.getEpochTime();
+}
+
+/*
+openSdHealth()
+Checks the statistics that survived the reset. After a power loss the .noinit RAM holds garbage,
+so the statistics start over when the magic doesn't match.
+ */
+
+void openSdHealth()
+{
+  if( sdStats.magic != SD_HEALTH_MAGIC )
+  {
+    resetSdHealth();
+    return;
+  }
+
+  if( sdStats.pending != SD_OP_NONE )           //  the reset hit in the middle of an operation
+  {
+    sdStats.aborted++;
+    sdStats.pending = SD_OP_NONE;
+  }
+}
+
+/*
+sdBegin()
+Marks an operation as in progress and returns its start time.
+ */
+
+uint32_t sdBegin(uint8_t op)
+{
+  sdStats.pending = op;
+  return millis();
+}
+
+/*
+sdDone()
+Adds the duration of an operation to its histogram and counts it as failed if ok is false.
+Returns ok, so it can wrap the result of the operation.
+ */
+
+bool sdDone(uint8_t op, uint32_t start, bool ok)
+{
+  uint32_t ms = millis() - start;
+  sdStats.pending = SD_OP_NONE;
+
+  uint8_t bucket = 0;
+  while( bucket < SD_LATENCY_BUCKETS - 1 && ( ms >> ( bucket + 1 ) ) != 0 )
+  {
+    bucket++;
+  }
+  if( sdStats.histogram[op][bucket] != 0xFFFF )
+  {
+    sdStats.histogram[op][bucket]++;
+  }
+  if( ms > sdStats.maxMs[op] )
+  {
+    sdStats.maxMs[op] = ( ms > 0xFFFF ) ? 0xFFFF : ms;
+  }
+  if( !ok )
+  {
+    sdStats.failed++;
+  }
+  return ok;
+}
+
+/*
+sdOn()
+SD.ON() that tries once more after a failure, since a cold card sometimes misses the first
+initialization.
+
+Returns:
+- true if the SD is on
+- false if it failed twice
+ */
+
+bool sdOn()
+{
+  uint32_t start = sdBegin(SD_OP_ON);
+  bool ok = SD.ON();
+  if( !ok )
+  {
+    sdStats.retries++;
+    SD.OFF();
+    ok = SD.ON();
+  }
+  return sdDone(SD_OP_ON, start, ok);
+}
+
+uint8_t sdOpen(const char* name, SdFile* file, uint8_t mode)
+{
+  uint32_t start = sdBegin(SD_OP_OPEN);
+  return sdDone(SD_OP_OPEN, start, SD.openFile(name, file, mode));
+}
+
+uint8_t sdAppend(const char* name, uint8_t* data, uint16_t len)
+{
+  uint32_t start = sdBegin(SD_OP_APPEND);
+  return sdDone(SD_OP_APPEND, start, SD.append(name, data, len));
+}
+
+uint8_t sdClose(SdFile* file)
+{
+  uint32_t start = sdBegin(SD_OP_CLOSE);
+  return sdDone(SD_OP_CLOSE, start, file->close());
+}
+
+char* sdCatln(const char* name, uint32_t offset, uint32_t lines)
+{
+  uint32_t start = sdBegin(SD_OP_CATLN);
+  char* result = SD.catln(name, offset, lines);
+  sdDone(SD_OP_CATLN, start, result != NULL);
+  return result;
+}
+
+/*
+healthField()
+kvField callback for serializeFields(), the context is unused. The fields are "since", the epoch
+time the statistics started, then for every operation the count of every bucket of its histogram
+("open0" to "open9") and its longest duration in ms ("openMax"), and the retry, failure and abort
+counts. Every value is a field of its own so it fits into a keyvalue string, so there are
+SD_HEALTH_FIELDS fields.
+ */
+
+void healthField(const void* context, uint8_t index, strbuf* key, strbuf* val)
+{
+  if( index == 0 )
+  {
+    key->append_P(PSTR("since"));
+    val->appendf_P(PSTR("%lu"), (unsigned long) sdStats.since);
+    return;
+  }
+
+  uint8_t field = index - 1;
+  if( field < SD_OPS * ( SD_LATENCY_BUCKETS + 1 ) )
+  {
+    uint8_t op = field / ( SD_LATENCY_BUCKETS + 1 );
+    uint8_t b = field % ( SD_LATENCY_BUCKETS + 1 );    //  the buckets, then the longest duration
+    key->append_P((const char*) pgm_read_word(&SD_OP_NAMES[op]));
+    if( b < SD_LATENCY_BUCKETS )
+    {
+      key->appendf_P(PSTR("%u"), b);
+      val->appendf_P(PSTR("%u"), sdStats.histogram[op][b]);
+    }
+    else
+    {
+      key->append_P(PSTR("Max"));
+      val->appendf_P(PSTR("%u"), sdStats.maxMs[op]);
+    }
+    return;
+  }
+
+  switch( field - SD_OPS * ( SD_LATENCY_BUCKETS + 1 ) )
+  {
+    case 0:
+      key->append_P(PSTR("retries"));
+      val->appendf_P(PSTR("%u"), sdStats.retries);
+      break;
+
+    case 1:
+      key->append_P(PSTR("failed"));
+      val->appendf_P(PSTR("%u"), sdStats.failed);
+      break;
+
+    default:
+      key->append_P(PSTR("aborted"));
+      val->appendf_P(PSTR("%u"), sdStats.aborted);
+      break;
+  }
+}
+
+/*
+writeHealthRecord()
+Appends the statistics as one "key=val,...;" line to SD_HEALTH_NAME and starts a new day of
+statistics. The counts since the last record are lost if the SD fails, as they would only keep
+growing otherwise.
+
+Returns:
+- 0 if the record was written
+- 1 if the SD failed to turn on
+- 2 if the file couldn't be opened or written
+ */
+
+uint8_t writeHealthRecord()
+{
+RTC.setWatchdog(2);
+//********** START 2 SECOND WATCHDOG ***************
+
+  if( !sdOn() )
+  {
+RTC.unSetWatchdog();
+    return 1;
+  }
+
+  char fname [16] = {0};
+  strcpy_P(fname, SD_HEALTH_NAME);
+
+  uint8_t result = 2;
+  SdFile file;
+  if( sdOpen(fname, &file, O_WRITE | O_CREAT | O_APPEND) )
+  {
+    fileSink sink(&file);
+    if( serializeFields(&sink, NULL, healthField, SD_HEALTH_FIELDS, KV_CSV) == 0 && sink.print("\r\n") )
+    {
+      result = 0;
+    }
+    sdClose(&file);
+  }
+
+  SD.OFF();
+
+//********** END 2 SECOND WATCHDOG *****************
+RTC.unSetWatchdog();
+
+  resetSdHealth();                              //  the next record covers the next day
+
+  return result;
+}
+
+#endif
@@ -8,44 +8,40 @@ Author:	Mitch Nelke
 Date:	Thursday July 26, 2018
 
 This file contains code for the sensors our glacier probe will be using. The functions
-do not return the measurements, but instead convert them to character arrays and store them
-in a user-passed character array. This simplifies the process of storing them in keyvalue
-objects like so:
+do not return the measurements, but instead store them in their channels of a sample record,
+scaled by the decimals of each channel (see sample.h), like so:
 
-keyvalue temperature;
-temperature.key = "temp";
-readBME(temperature.val);
+readBME(&currSample, 0);
+currSample.value[KV_TEMPERATURE]    //  12345 for 12.345 C
+
+Every read function takes the warm-up time its sensor was registered with in header.h, in
+milliseconds between powering the sensor and measuring it. readAllSensors() calls them through
+the SENSORS registry.
 
 ******************************************************************************************/
 
-void readAllSensors( keyvalue*);
-void cleanString(char*, uint8_t);
+void readAllSensors( sampleRecord*);
 
 /*
 readBME()
 
-Reads the BME280 temperature, humidity, and pressure sensor's measurements. Stores them as
-character arrays 10 bytes long, so they will have a few 0's in front of the actual value.
+Reads the BME280 temperature, humidity, and pressure sensor's measurements and stores them in
+the KV_TEMPERATURE, KV_HUMIDITY and KV_PRESSURE channels of the sample.
 */
 
 #if _BME == 1
 bme bme280(AGR_XTR_SOCKET_A);			//	initialize a bme object
 
 
-void readBME( char* value1,				//	character arrays the function stores the measurements in
-			        char* value2, 				//	val1 is t, val2 is h, val3 is p
-			        char* value3,
-			        uint8_t size)		
+void readBME( sampleRecord* sample,		//	the sample the function stores the measurements in
+              uint16_t warmup)
 {
-	memset( value1, 0, size);	//	clears the array before storing data
-	memset( value2, 0, size);
-	memset( value3, 0, size);
-
   RTC.setWatchdog(2);
   //********** START 2 SECOND WATCHDOG ***************
   
 //	start up the sensor, wait a bit, and then grab the t, h, and p readings as floats.
 	bme280.ON();
+	delay(warmup);
 	float t = bme280.getTemperature();
 	float h = bme280.getHumidity();
 	float p = bme280.getPressure();
@@ -54,11 +50,10 @@ void readBME( char* value1,				//	character arrays the function stores the measu
   //********** END 2 SECOND WATCHDOG *****************
   RTC.unSetWatchdog();
 
-//	convert the floats to 10-byte-wide, 3-decimal-place character arrays and store them in
-//	the designated character arrays.
-	dtostrf(t, 10, 3, value1);
-	dtostrf(h, 10, 3, value2);
-	dtostrf(p, 10, 3, value3);
+//	scale the floats to the decimals of their channels and store them in the sample
+	setSampleFloat(sample, KV_TEMPERATURE, t);
+	setSampleFloat(sample, KV_HUMIDITY, h);
+	setSampleFloat(sample, KV_PRESSURE, p);
 }
 #endif
 
@@ -66,30 +61,28 @@ void readBME( char* value1,				//	character arrays the function stores the measu
 /*
 readSonic()
 
-Reads the ultrasonic sensor's distance measurement. Stores the measurement as a character array
-10 bytes long, so it will have a few 0's in front of the actual value. The "value" parameter is
-a character array that the distance value will be stored in.
+Reads the ultrasonic sensor's distance measurement and stores it in the KV_SONIC channel of
+the sample.
 */
 
 #if _SONIC == 1
 ultrasound sonic(AGR_XTR_SOCKET_D);		          //	initialize an ultrasound object
 
-void readSonic( char* value, uint8_t size)			//	value is the char array that will store the distance
+void readSonic( sampleRecord* sample, uint16_t warmup)	//	sample is the record that will store the distance
 {			
-	memset( value, 0, size);	                    //	clears the array before storing data
-
   RTC.setWatchdog(2);
 //********** START 2 SECOND WATCHDOG ***************
 
 	sonic.ON();
+	delay(warmup);
 	uint16_t d = sonic.getDistance();
 	sonic.OFF();
   
 //********** END 2 SECOND WATCHDOG *****************
   RTC.unSetWatchdog();
 
-//	convert the unsigned integer to a character array and store it in value
-	snprintf(value, 10, "%u", d);
+//	the distance is already a whole number of cm, which is how the channel is stored
+	setSample(sample, KV_SONIC, d);
 }
 #endif
 
@@ -97,25 +90,23 @@ void readSonic( char* value, uint8_t size)			//	value is the char array that wil
 /*
 readPhytos()
 
-Reads the leaf wetness sensor's wetness measurement. Stores the wetness as a character array 10
-bytes long, so it will have a few 0's in front of the actual value. The "value" parameter is a
-character array that the wetness value will be stored in.
+Reads the leaf wetness sensor's wetness measurement and stores it in the KV_WETNESS channel of
+the sample.
 */
 
 #if _PHYTOS == 1
 leafWetness phytos;						//	initialize a leafWetness object
 
 
-void readPhytos( char* value, uint8_t size)			//	value is the char array that will store the wetness
+void readPhytos( sampleRecord* sample, uint16_t warmup)	//	sample is the record that will store the wetness
 {
-	memset( value, 0, size);	//	clears the array before storing data
-
   RTC.setWatchdog(2);
 //********** START 2 SECOND WATCHDOG ***************
 
 //	start up the sensor, wait a bit, then take a measurement. The wetness is stored as a member of
 //	the object, rather than being returned.
 	phytos.ON();
+	delay(warmup);
 	phytos.read();
 	phytos.OFF();
  
@@ -123,7 +114,7 @@ void readPhytos( char* value, uint8_t size)			//	value is the char array that wi
   RTC.unSetWatchdog();
 
 	float w = phytos.wetness;			//	grab the wetness from the member variable of the object
-	dtostrf(w, 10, 3, value);			//	convert the float to a character array and store it in value
+	setSampleFloat(sample, KV_WETNESS, w);	//	scale the float and store it in the sample
 }
 #endif
 
@@ -131,25 +122,23 @@ void readPhytos( char* value, uint8_t size)			//	value is the char array that wi
 /*
 readSolar()
 
-Reads the solar radiation sensor's intensity measurement. Stores the radiation as a character array
-10 bytes long, so it will have a few 0's in front of the actual value. The "value" parameter is a
-character array that the radation value will be stored in.
+Reads the solar radiation sensor's intensity measurement and stores it in the KV_SOLAR channel
+of the sample.
 */
 
 #if _SOLAR == 1
 Apogee_SQ110 solar = Apogee_SQ110(AGR_XTR_SOCKET_F);	//	initialize an Apogee_SQ110 object
 
 
-void readSolar( char* value, uint8_t size)			//	value is the char array that will store the radation
+void readSolar( sampleRecord* sample, uint16_t warmup)	//	sample is the record that will store the radation
 {
-	memset( value, 0, size);	//	clears the array before storing data
-
   RTC.setWatchdog(2);
   //********** START 2 SECOND WATCHDOG ***************
 
 //	start up the sensor, wait a bit, then take a measurement. The radiation is stored as a member of
 //	the object, rather than being returned.
 	solar.ON();
+	delay(warmup);
 	solar.read();
 	solar.OFF();
 
@@ -157,119 +146,74 @@ void readSolar( char* value, uint8_t size)			//	value is the char array that wil
   RTC.unSetWatchdog();
 
 	float r = solar.radiationVoltage;			//	grab the radiation from the member variable of the object
-	dtostrf(r, 10, 3, value);			//	convert the float to a character array aand store it in value
+	setSampleFloat(sample, KV_SOLAR, r);		//	scale the float and store it in the sample
 }
 #endif
 
-#if _DS2 == 1
-DS2 ds2(AGR_XTR_SOCKET_C);
-#endif
-
+/*
+readDS2()
 
-void readAllSensors( keyvalue* dataArray){
+Reads the DS-2 sonic anemometer's wind and temperature measurements and stores them in the
+KV_UBAR through KV_DS2TEMPERATURE channels of the sample. A failed read leaves all of them
+unmeasured.
+*/
 
-  
-	#if _BME
-  if ( battery > BL_CRITICAL )
-  {
-	readBME(dataArray[KV_TEMPERATURE].val, 
-			    dataArray[KV_HUMIDITY].val, 
-			    dataArray[KV_PRESSURE].val,
-			    dataArray[KV_TEMPERATURE].KEYVAL_STRING_SIZE);
-  }
-	#endif
+#if _DS2 == 1
+DS2 ds2(AGR_XTR_SOCKET_C);
 
-	#if _SONIC
-  if ( battery > BL_LOW )
-  {
-	readSonic(  dataArray[KV_SONIC].val,
-	            dataArray[KV_SONIC].KEYVAL_STRING_SIZE);
-  }
-	#endif
 
-	#if _PHYTOS
-  if (battery > BL_CRITICAL )
+void readDS2( sampleRecord* sample, uint16_t warmup)		//	sample is the record that will store the wind
+{
+  RTC.setWatchdog(8);
+  //********** START 8 SECOND WATCHDOG ***************
+    
+  ds2.ON();
+  delay(warmup);
+  if( ds2.read() == 0 )
   {
-	readPhytos( dataArray[KV_WETNESS].val,
-	            dataArray[KV_WETNESS].KEYVAL_STRING_SIZE);
-  }
-	#endif
+    int32_t value;
+    if( ds2.get_ubar( &value, channelDecimals(KV_UBAR)) )
+      setSample(sample, KV_UBAR, value);
+                
+    if( ds2.get_vbar( &value, channelDecimals(KV_VBAR)) )
+      setSample(sample, KV_VBAR, value);
 
-	#if _SOLAR
-  if (battery > BL_CRITICAL )
-	readSolar(  dataArray[KV_SOLAR].val,
-	            dataArray[KV_SOLAR].KEYVAL_STRING_SIZE);
-	#endif
+    if( ds2.getGust(  &value, channelDecimals(KV_GUST)) )
+      setSample(sample, KV_GUST, value);
 
-  #if _DS2
-  if( battery > BL_LOW )
-  {
-    RTC.setWatchdog(8);
-    //********** START 8 SECOND WATCHDOG ***************
-    
-    ds2.ON();
-    delay(2000);
-    ds2.read();
-  
-    uint8_t size = dataArray[KV_UBAR].KEYVAL_STRING_SIZE;
-    
-    ds2.get_ubar( dataArray[KV_UBAR].val, size);
-                  
-    ds2.get_vbar( dataArray[KV_VBAR].val, size);
-  
-    ds2.getGust(  dataArray[KV_GUST].val, size);
-  
-    ds2.getWindSpeed(     dataArray[KV_WINDSPEED].val, size);
-  
-    ds2.getWindDirection( dataArray[KV_WINDDIRECTION].val, size);
-  
-    ds2.getTemperature(   dataArray[KV_DS2TEMPERATURE].val, size);
-    ds2.OFF();
+    if( ds2.getWindSpeed(     &value, channelDecimals(KV_WINDSPEED)) )
+      setSample(sample, KV_WINDSPEED, value);
 
-    //********** END 8 SECOND WATCHDOG ***************
-    
-    RTC.unSetWatchdog();
-  }
-  #endif
+    if( ds2.getWindDirection( &value, channelDecimals(KV_WINDDIRECTION)) )
+      setSample(sample, KV_WINDDIRECTION, value);
 
-  for(int i = 0; i<NUM_KEYVALS; i++)
-  {
-    cleanString(dataArray[i].val, sizeof(dataArray[i].val));
+    if( ds2.getTemperature(   &value, channelDecimals(KV_DS2TEMPERATURE)) )
+      setSample(sample, KV_DS2TEMPERATURE, value);
   }
+  ds2.OFF();
 
+  //********** END 8 SECOND WATCHDOG ***************
+  RTC.unSetWatchdog();
 }
+#endif
+
 
 /*
-cleanString()
+readAllSensors()
 
-Takes a character array and its size and replaces it with a version that doesn't include any spaces in front of it.
+Reads every sensor in the registry (see SENSORS in header.h) that the battery allows into the
+sample. Channels that aren't read this cycle are marked as not measured, so they are logged as
+missing instead of repeating an old value.
 */
 
-void cleanString(char* str, uint8_t size)
-{
-  char newStr [size] = {};
-  
-  uint8_t index = 0;
-  bool started = false;
-  
-  for(int i = 0; i<size; i++)
-  {
-    if(started == false){
-      if(str[i] != ' ' && str[i] != '\t' && str[i] != '\n'){
-        started = true;
-        newStr[index] = str[i];
-        index++;
-      }
-    }
-    else
-    {
-      newStr[index] = str[i];
-      index++;
-    }
-  }
-  memcpy(str,0,size);
-  
-  strcpy(str,newStr);
+void readAllSensors( sampleRecord* sample){
+
+  sample->valid &= SAMPLE_BIT(KV_SECONDS);          //  only the timestamp carries over from updateTimes()
+
+  #define READ_SENSOR(read, minBattery, warmup)   if( battery > minBattery ) { read(sample, warmup); }
+  SENSORS(READ_SENSOR)
+  #undef READ_SENSOR
+
 }
 
 #endif
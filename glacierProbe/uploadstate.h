@@ -0,0 +1,642 @@
+#ifndef UPLOADSTATE_H
+#define UPLOADSTATE_H
+
+#include "header.h"
+/******************************************************************************************
+uploadstate.h
+
+Keeps track of which data files still have to be uploaded to the FTP server. This replaces
+the old "fList.txt" list, which had to be read line by line on every wake and searched
+again to mark a file as sent.
+
+The state is a fixed-size binary file on the SD, used as a circular queue of slots:
+
+  header                                  16 bytes, see uploadHeader
+  slot [0 .. UPLOAD_SLOTS-1]              32 bytes each, see uploadSlot
+
+Files are added at the tail and the head always points at the oldest file that may still
+be unsent, so looking up the next file, adding today's file and marking a file as sent
+each cost a single small read or write no matter how long the probe has been deployed.
+Behind the head, oldest points at the oldest file that is still on the SD; sent files
+between oldest and head are deleted by collectSentFiles() once the SD runs low on space.
+Ahead of the head, cursor points at the file the next slice of the backlog starts with,
+see checkUnsentFiles(). If the header fails its check byte the table is rebuilt, first from a legacy
+fList.txt if there is one, otherwise from the data files on the SD. A slot that fails it is repaired on its
+own, see repairSlot(), so the files the other slots mark as sent aren't queued again.
+
+All functions expect the SD to be on.
+******************************************************************************************/
+
+uploadHeader uploadState;                       //  copy of the header of the open state file
+SdFile uploadFile;                              //  the open state file
+
+/*
+uploadCheck()
+XOR of a block of bytes, stored next to the header and every slot to detect corruption.
+ */
+
+uint8_t uploadCheck(const uint8_t* data, uint8_t len)
+{
+  uint8_t check = 0x5A;                         //  nonzero seed so an all-zero block is invalid
+  for(uint8_t i = 0; i < len; i++)
+  {
+    check ^= data[i];
+  }
+  return check;
+}
+
+uint16_t nextSlot(uint16_t idx)
+{
+  return ( idx + 1 ) % UPLOAD_SLOTS;
+}
+
+uint16_t prevSlot(uint16_t idx)
+{
+  return ( idx + UPLOAD_SLOTS - 1 ) % UPLOAD_SLOTS;
+}
+
+/*
+writeUploadHeader()
+Writes uploadState to the start of the state file.
+
+Returns:
+- true if the header was written
+- false if the SD failed to write it
+ */
+
+bool writeUploadHeader()
+{
+  uploadState.check = 0;
+  uploadState.check = uploadCheck((uint8_t*) &uploadState, sizeof(uploadState));
+
+  if( !uploadFile.seekSet(0) ||
+      uploadFile.write(&uploadState, sizeof(uploadState)) != sizeof(uploadState) )
+  {
+    return false;
+  }
+  return uploadFile.sync();
+}
+
+/*
+readSlot() / writeSlot()
+Read or write the slot at index idx of the state file.
+
+Returns:
+- true on success
+- false if the SD failed, or a read slot failed its check byte
+ */
+
+bool readSlot(uint16_t idx, uploadSlot* slot)
+{
+  if( !uploadFile.seekSet(sizeof(uploadHeader) + (uint32_t) idx * sizeof(uploadSlot)) ||
+      uploadFile.read(slot, sizeof(uploadSlot)) != sizeof(uploadSlot) )
+  {
+    return false;
+  }
+
+  uint8_t check = slot->check;
+  slot->check = 0;
+  return uploadCheck((uint8_t*) slot, sizeof(uploadSlot)) == check;
+}
+
+bool writeSlot(uint16_t idx, uploadSlot* slot)
+{
+  slot->check = 0;
+  slot->check = uploadCheck((uint8_t*) slot, sizeof(uploadSlot));
+
+  if( !uploadFile.seekSet(sizeof(uploadHeader) + (uint32_t) idx * sizeof(uploadSlot)) ||
+      uploadFile.write(slot, sizeof(uploadSlot)) != sizeof(uploadSlot) )
+  {
+    return false;
+  }
+  return uploadFile.sync();
+}
+
+/*
+repairSlot()
+Rewrites a slot that failed its check byte, so a walk can go on past it. If its name still names a file on
+the SD, that file is queued again from the start, as re-uploading one file is cheaper than losing it;
+otherwise the slot is left empty and marked as sent, and nothing is uploaded for it.
+
+Returns:
+- true if the slot was rewritten, with its new contents in slot
+- false if the SD failed to read or write it
+ */
+
+bool repairSlot(uint16_t idx, uploadSlot* slot)
+{
+  if( !uploadFile.seekSet(sizeof(uploadHeader) + (uint32_t) idx * sizeof(uploadSlot)) ||
+      uploadFile.read(slot, sizeof(uploadSlot)) != sizeof(uploadSlot) )
+  {
+    return false;
+  }
+
+  char fname [FILENAME_SIZE + 1] = {0};
+  strncpy(fname, slot->name, sizeof(slot->name));
+  bool known = fname[0] != 0 && SD.isFile(fname) == 1;
+
+  memset(slot, 0, sizeof(uploadSlot));
+  if( known )
+  {
+    strncpy(slot->name, fname, sizeof(slot->name));
+  }
+  else
+  {
+    slot->flags = UPLOAD_SENT;
+  }
+
+  #if GLACIERPROBE_DEBUG == 1
+    USB.printf("Repaired upload slot %u: ", idx);
+    USB.println(known ? fname : "empty");
+  #endif
+  return writeSlot(idx, slot);
+}
+
+/*
+slotIs()
+Compares the name of a slot with a filename. Names are stored without a terminator when
+they take up all FILENAME_SIZE characters. FAT names don't depend on case, so neither does
+the comparison.
+ */
+
+bool slotIs(uploadSlot* slot, const char* fname)
+{
+  return strncasecmp(slot->name, fname, sizeof(slot->name)) == 0;
+}
+
+/*
+addSlot()
+Adds a file to the tail of the queue. If the queue is full the oldest file is dropped
+to make room, since a file that hasn't been sent in UPLOAD_SLOTS days won't be.
+
+Returns:
+- true if the file was added
+- false if the SD failed to write the slot or header
+ */
+
+bool addSlot(const char* fname, uint8_t flags)
+{
+  uploadSlot slot;
+  memset(&slot, 0, sizeof(slot));
+  strncpy(slot.name, fname, sizeof(slot.name));
+  slot.flags = flags;
+
+  if( !writeSlot(uploadState.tail, &slot) )
+  {
+    return false;
+  }
+
+  uploadState.tail = nextSlot(uploadState.tail);
+  if( uploadState.tail == uploadState.oldest )  //  the slot was reused, so its file is forgotten
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("Upload state full, dropping oldest file"));
+    #endif
+    if( uploadState.head == uploadState.oldest )
+    {
+      uploadState.head = nextSlot(uploadState.head);
+    }
+    uploadState.oldest = nextSlot(uploadState.oldest);
+  }
+
+  return writeUploadHeader();
+}
+
+/*
+isDataFile()
+Checks whether a directory entry is a data file written by writeDataSet(), either a day
+file or a SINGLE_FILE segment, in either the current or the legacy text format. FAT stores 8.3 names as "YY-MM-DDEXT", which is turned
+back into "YY-MM-DD.ext" as used everywhere else: the extension is lower case, the name keeps its case, so
+a segment stays "SEG00001.bin".
+
+Returns:
+- true if the entry is a data file, with its name appended to fname (13 more bytes)
+- false otherwise
+ */
+
+bool isDataFile(dir_t* entry, char* fname)
+{
+  bool day = entry->name[2] == '-' && entry->name[5] == '-';
+  bool segment = strncmp((char*) entry->name, LOG_SEGMENT_PREFIX, sizeof(LOG_SEGMENT_PREFIX) - 1) == 0;
+  if( !day && !segment )
+  {
+    return false;
+  }
+  if( strncmp((char*) entry->name + 8, "BIN", 3) != 0 &&
+      strncmp((char*) entry->name + 8, "CSV", 3) != 0 )
+  {
+    return false;
+  }
+
+  uint8_t len = strlen(fname);
+  for(uint8_t i = 0; i < 11; i++)
+  {
+    if( i == 8 )
+    {
+      fname[len++] = '.';
+    }
+    char c = entry->name[i];
+    if( i >= 8 && c >= 'A' && c <= 'Z' )
+    {
+      c += 'a' - 'A';
+    }
+    fname[len++] = c;
+  }
+  fname[len] = 0;
+  return true;
+}
+
+/*
+isNumberDir()
+Checks whether a directory entry is a subdirectory named with digits only, like the "YYYY"
+and "MM" directories that day files are sharded into.
+ */
+
+bool isNumberDir(dir_t* entry, uint8_t digits)
+{
+  if( !DIR_IS_SUBDIR(entry) )
+  {
+    return false;
+  }
+  for(uint8_t i = 0; i < 11; i++)
+  {
+    bool digit = entry->name[i] >= '0' && entry->name[i] <= '9';
+    if( digit != ( i < digits ) )               //  digits, then space padding
+    {
+      if( digit || entry->name[i] != ' ' )
+      {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+queueDataFiles()
+Adds every data file in the directory path ("" for the root) to the queue as unsent.
+
+Returns:
+- true if all files were added
+- false if the directory couldn't be entered or the SD failed to write a slot
+ */
+
+bool queueDataFiles(const char* path)
+{
+  if( path[0] != 0 && !SD.cd(path) )
+  {
+    SD.goRoot();
+    return false;
+  }
+
+  uint8_t pathLen = strlen(path);
+  char fname [FILENAME_SIZE] = {0};
+  dir_t entry;
+  bool added = true;
+
+  SD.currentDir.rewind();
+  while( added && SD.currentDir.readDir(&entry) > 0 )
+  {
+RTC.setWatchdog(8);
+
+    strcpy(fname, path);
+    if( pathLen != 0 )
+    {
+      fname[pathLen] = '/';
+      fname[pathLen + 1] = 0;
+    }
+    if( isDataFile(&entry, fname) )
+    {
+      added = addSlot(fname, 0);
+    }
+  }
+
+  SD.goRoot();
+  return added;
+}
+
+/*
+keepNewest()
+Inserts name into names, which is sorted oldest first, keeping only the max newest names.
+The "YYYY" and "MM" directories sort by date when sorted by name.
+
+Returns the number of names now in names.
+ */
+
+uint8_t keepNewest(char names[][5], uint8_t count, uint8_t max, const char* name)
+{
+  uint8_t i = count;
+  while( i > 0 && strcmp(names[i - 1], name) > 0 )
+  {
+    i--;
+  }
+
+  if( count == max )                            //  full, so the oldest name goes
+  {
+    if( i == 0 )
+    {
+      return count;
+    }
+    memmove(names[0], names[1], ( i - 1 ) * sizeof(names[0]));
+    strcpy(names[i - 1], name);
+    return count;
+  }
+
+  memmove(names[i + 1], names[i], ( count - i ) * sizeof(names[0]));
+  strcpy(names[i], name);
+  return count + 1;
+}
+
+/*
+findShardDirs()
+Lists the newest "YYYY/MM" directories on the SD, at most max, oldest first. They are sorted
+by name, as FAT keeps directories in the order they were created, which isn't the order of the
+dates after files were copied onto a card. readDir() can't be used while the SD changes
+directory, so the names are collected first.
+
+Returns the number of directories stored in dirs (at most max, each 8 bytes).
+ */
+
+uint8_t findShardDirs(char dirs[][8], uint8_t max)
+{
+  char years [8][5];
+  char months [12][5];
+  char name [5] = {0};
+  uint8_t numYears = 0;
+  uint8_t numDirs = 0;
+  dir_t entry;
+
+  SD.goRoot();
+  SD.currentDir.rewind();
+  while( SD.currentDir.readDir(&entry) > 0 )
+  {
+    if( isNumberDir(&entry, 4) )
+    {
+      memcpy(name, entry.name, 4);
+      numYears = keepNewest(years, numYears, 8, name);
+    }
+  }
+
+  for(uint8_t y = numYears; y > 0 && numDirs < max; y--)    //  newest first, so max keeps the newest
+  {
+    if( !SD.cd(years[y - 1]) )
+    {
+      continue;
+    }
+    uint8_t numMonths = 0;
+    memset(name, 0, sizeof(name));
+    SD.currentDir.rewind();
+    while( SD.currentDir.readDir(&entry) > 0 )
+    {
+      if( isNumberDir(&entry, 2) )
+      {
+        memcpy(name, entry.name, 2);
+        numMonths = keepNewest(months, numMonths, 12, name);
+      }
+    }
+    SD.goRoot();
+
+    for(uint8_t m = numMonths; m > 0 && numDirs < max; m--)
+    {
+      snprintf_P(dirs[numDirs++], 8, PSTR("%s/%s"), years[y - 1], months[m - 1]);
+    }
+  }
+
+  for(uint8_t i = 0; i < numDirs / 2; i++)     //  oldest first
+  {
+    char dir [8];
+    memcpy(dir, dirs[i], sizeof(dir));
+    memcpy(dirs[i], dirs[numDirs - 1 - i], sizeof(dir));
+    memcpy(dirs[numDirs - 1 - i], dir, sizeof(dir));
+  }
+
+  return numDirs;
+}
+
+/*
+rebuildUploadState()
+Recreates the state file from scratch. If the legacy fList.txt exists its entries are
+imported along with whether they were marked as sent, and the list is deleted. Otherwise
+every data file in the root and the newest 24 "YYYY/MM" directories is queued as unsent, as
+re-uploading a file is cheaper than losing it.
+
+Returns:
+- true if the state was rebuilt
+- false if the SD failed
+ */
+
+bool rebuildUploadState()
+{
+  #if GLACIERPROBE_DEBUG == 1
+    USB.println(F("Rebuilding upload state..."));
+  #endif
+
+  memset(&uploadState, 0, sizeof(uploadState));
+  memcpy(uploadState.magic, UPLOAD_MAGIC, sizeof(uploadState.magic));
+  uploadState.version = UPLOAD_VERSION;
+  uploadState.slots = UPLOAD_SLOTS;
+
+  if( !uploadFile.truncate(0) || !writeUploadHeader() )
+  {
+    return false;
+  }
+
+  char fList [20] = {0};
+  strcpy_P(fList, UNSENT_FILES_NAME );
+
+  if( SD.isFile(fList) == 1 )                   //  migrate the old file list
+  {
+    uint16_t i = 0;
+    sdCatln(fList, i, 1);
+    while( strlen(SD.buffer) != 0 )
+    {
+RTC.setWatchdog(8);                             //  the list can be long, keep the watchdog from firing
+
+      char fname [FILENAME_SIZE] = {0};
+      bool sent = SD.buffer[0] == '*';
+      strncpy(fname, SD.buffer + sent, 12);
+      for(uint8_t j = 0; j < sizeof(fname); j++) //  strip the line ending
+      {
+        if( fname[j] == '\r' || fname[j] == '\n' )
+        {
+          fname[j] = 0;
+        }
+      }
+
+      if( !addSlot(fname, sent ? UPLOAD_SENT : 0) )
+      {
+        return false;
+      }
+
+      i++;
+      sdCatln(fList, i, 1);
+    }
+
+    SD.del(fList);                              //  imported, so a later rebuild uses the directory instead
+  }
+  else                                          //  otherwise queue every data file on the SD
+  {
+    if( !queueDataFiles("") )                   //  unsharded files first, they are the oldest
+    {
+      return false;
+    }
+
+    #if SHARD_DIRS == 1
+      char dirs [24][8];
+      uint8_t numDirs = findShardDirs(dirs, 24);
+      for(uint8_t i = 0; i < numDirs; i++)
+      {
+        if( !queueDataFiles(dirs[i]) )
+        {
+          return false;
+        }
+      }
+    #endif
+  }
+
+  //  skip past the files that were already sent
+  uploadSlot slot;
+  while( uploadState.head != uploadState.tail &&
+         readSlot(uploadState.head, &slot) &&
+         ( slot.flags & UPLOAD_SENT ) )
+  {
+    uploadState.head = nextSlot(uploadState.head);
+  }
+
+  return writeUploadHeader();
+}
+
+/*
+openUploadState()
+Opens the state file, creating it if it doesn't exist, and loads its header into
+uploadState. A missing or corrupt file is rebuilt.
+
+Returns:
+- 0 if the state is open and valid
+- 1 if the file couldn't be opened
+- 2 if it couldn't be rebuilt
+ */
+
+uint8_t openUploadState()
+{
+  char fname [20] = {0};
+  strcpy_P(fname, UPLOAD_STATE_NAME);
+
+  if( SD.isFile(fname) == -1 )
+  {
+    SD.create(fname);
+  }
+
+  if( !sdOpen(fname, &uploadFile, O_RDWR) )
+  {
+    #if GLACIERPROBE_DEBUG == 1
+      USB.println(F("Failed to open upload state"));
+    #endif
+    return 1;
+  }
+
+  uint8_t check = 0;
+  bool valid = uploadFile.read(&uploadState, sizeof(uploadState)) == sizeof(uploadState);
+  if( valid )
+  {
+    check = uploadState.check;
+    uploadState.check = 0;
+  }
+
+  if( !valid ||
+      uploadCheck((uint8_t*) &uploadState, sizeof(uploadState)) != check ||
+      memcmp(uploadState.magic, UPLOAD_MAGIC, sizeof(uploadState.magic)) != 0 ||
+      uploadState.version != UPLOAD_VERSION ||
+      uploadState.slots != UPLOAD_SLOTS ||
+      uploadState.head >= UPLOAD_SLOTS ||
+      uploadState.tail >= UPLOAD_SLOTS ||
+      uploadState.oldest >= UPLOAD_SLOTS )
+  {
+    if( !rebuildUploadState() )
+    {
+      sdClose(&uploadFile);
+      return 2;
+    }
+  }
+
+  return 0;
+}
+
+void closeUploadState()
+{
+  sdClose(&uploadFile);
+}
+
+/*
+collectSentFiles()
+Deletes the oldest files that were already uploaded until the SD has SD_MIN_FREE bytes
+free again. Unsent files are never deleted, so a long outage can still fill the SD. Counting
+the free space walks the whole FAT, so it is counted once and the size of every deleted file
+is added to it.
+
+Returns the number of files deleted.
+ */
+
+uint8_t collectSentFiles()
+{
+  uint8_t deleted = 0;
+  uint16_t start = uploadState.oldest;
+  uploadSlot slot;
+
+  uint64_t diskFree = SD.getDiskFree();
+  while( uploadState.oldest != uploadState.head && diskFree < SD_MIN_FREE )
+  {
+RTC.setWatchdog(8);
+
+    if( readSlot(uploadState.oldest, &slot) && ( slot.flags & UPLOAD_SENT ) && slot.name[0] != 0 )
+    {
+      char fname [FILENAME_SIZE + 1] = {0};
+      strncpy(fname, slot.name, sizeof(slot.name));
+      int32_t size = SD.getFileSize(fname);
+      if( SD.del(fname) )
+      {
+        deleted++;
+        diskFree += ( size > 0 ) ? size : 0;
+      }
+      removePacked(fname);                      //  a packed copy a reset left behind goes with it
+      #if GLACIERPROBE_DEBUG == 1
+        USB.print(F("Deleted sent file "));
+        USB.println(fname);
+      #endif
+    }
+    uploadState.oldest = nextSlot(uploadState.oldest);
+  }
+
+  if( uploadState.oldest != start )
+  {
+    writeUploadHeader();
+  }
+  return deleted;
+}
+
+/*
+sliceStart()
+The slot the next slice of the backlog starts at: the cursor while it still lies between the head and
+the tail, otherwise the head.
+ */
+
+uint16_t sliceStart()
+{
+  uint16_t ahead = ( uploadState.cursor + UPLOAD_SLOTS - uploadState.head ) % UPLOAD_SLOTS;
+  uint16_t queued = ( uploadState.tail + UPLOAD_SLOTS - uploadState.head ) % UPLOAD_SLOTS;
+  return ( ahead < queued ) ? uploadState.cursor : uploadState.head;
+}
+
+/*
+lastSlotIs()
+Checks whether the most recently added file is fname, without looking at any other slot.
+ */
+
+bool lastSlotIs(const char* fname)
+{
+  uploadSlot slot;
+  return readSlot(prevSlot(uploadState.tail), &slot) &&  //  an unused slot fails its check
+         slotIs(&slot, fname);
+}
+
+#endif
@@ -0,0 +1,282 @@
+/******************************************************************************************
+
+LZSS.CPP
+
+See lzss.h for a description of the stream.
+
+******************************************************************************************/
+
+#include "lzss.h"
+
+#define LZ_MASK		( LZ_WINDOW - 1 )
+
+
+/*****************************************************************************************
+lzEncoder
+*****************************************************************************************/
+
+lzEncoder::lzEncoder(lzWrite write, void* context)
+{
+	begin(write, context);
+}
+
+void lzEncoder::begin(lzWrite write, void* context)
+{
+	_write = write;
+	_context = context;
+	_head = 0;
+	_ahead = 0;
+	_history = 0;
+	memset(_buffer, 0, sizeof(_buffer));
+	_pos = 0;
+	_bit = 7;
+	in = 0;
+	bytes = 0;
+	failed = false;
+}
+
+bool lzEncoder::flush()
+{
+	if( _pos > 0 && !failed )
+	{
+		if( _write(_context, _buffer, _pos) )
+		{
+			bytes += _pos;
+		}
+		else
+		{
+			failed = true;
+		}
+	}
+	memset(_buffer, 0, sizeof(_buffer));
+	_pos = 0;
+	return !failed;
+}
+
+/*
+putBits()
+Appends the low count bits of value, most significant first.
+*/
+void lzEncoder::putBits(uint16_t value, uint8_t count)
+{
+	while( count-- )
+	{
+		if( ( value >> count ) & 1 )
+		{
+			_buffer[_pos] |= 1 << _bit;
+		}
+
+		if( _bit == 0 )
+		{
+			_bit = 7;
+			if( ++_pos == sizeof(_buffer) )
+			{
+				flush();
+			}
+		}
+		else
+		{
+			_bit--;
+		}
+	}
+}
+
+/*
+encodeToken()
+Encodes the bytes at _head as the longest match in the window, or as a literal if there is no match of
+at least LZ_MIN_MATCH bytes.
+*/
+void lzEncoder::encodeToken()
+{
+	uint8_t best = 0;
+	uint16_t bestDistance = 0;
+	uint16_t maxDistance = ( _history < LZ_MAX_DISTANCE ) ? _history : LZ_MAX_DISTANCE;
+	uint8_t first = _ring[_head];
+
+	for(uint16_t d = 1; d <= maxDistance && best < _ahead; d++)
+	{
+		uint16_t from = ( _head - d ) & LZ_MASK;
+		if( _ring[from] != first )
+		{
+			continue;
+		}
+
+		uint8_t k = 1;
+		while( k < _ahead && _ring[( from + k ) & LZ_MASK] == _ring[( _head + k ) & LZ_MASK] )
+		{
+			k++;
+		}
+		if( k > best )
+		{
+			best = k;
+			bestDistance = d;
+		}
+	}
+
+	uint8_t used;
+	if( best >= LZ_MIN_MATCH )
+	{
+		putBits(0, 1);
+		putBits(bestDistance, LZ_DISTANCE_BITS);
+		putBits(best - LZ_MIN_MATCH, LZ_LENGTH_BITS);
+		used = best;
+	}
+	else
+	{
+		putBits(1, 1);
+		putBits(first, 8);
+		used = 1;
+	}
+
+	_head = ( _head + used ) & LZ_MASK;
+	_ahead -= used;
+	_history = ( _history + used < LZ_MAX_DISTANCE ) ? _history + used : LZ_MAX_DISTANCE;
+}
+
+bool lzEncoder::put(uint8_t byte)
+{
+	if( failed )
+	{
+		return false;
+	}
+	if( _ahead == LZ_MAX_MATCH )
+	{
+		encodeToken();
+	}
+	_ring[( _head + _ahead ) & LZ_MASK] = byte;
+	_ahead++;
+	in++;
+	return !failed;
+}
+
+bool lzEncoder::put(const uint8_t* data, uint16_t len)
+{
+	for(uint16_t i = 0; i < len; i++)
+	{
+		if( !put(data[i]) )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool lzEncoder::finish()
+{
+	while( _ahead > 0 )
+	{
+		encodeToken();
+	}
+
+	putBits(0, 1);
+	putBits(0, LZ_DISTANCE_BITS);					//	distance 0 ends the stream
+	putBits(in >> 16, 16);
+	putBits(in & 0xFFFF, 16);
+	if( _bit != 7 )									//	pad the last byte
+	{
+		_pos++;
+		_bit = 7;
+	}
+	return flush();
+}
+
+
+/*****************************************************************************************
+lzDecoder
+*****************************************************************************************/
+
+lzDecoder::lzDecoder(lzRead read, void* context)
+{
+	_read = read;
+	_context = context;
+	memset(_ring, 0, sizeof(_ring));
+	_head = 0;
+	_pos = 0;
+	_len = 0;
+	_bit = 7;
+	out = 0;
+}
+
+bool lzDecoder::getBits(uint8_t count, uint32_t* value)
+{
+	*value = 0;
+	while( count-- )
+	{
+		if( _pos == _len )
+		{
+			_len = _read(_context, _buffer, sizeof(_buffer));
+			_pos = 0;
+			if( _len == 0 )
+			{
+				return false;
+			}
+		}
+
+		*value = ( *value << 1 ) | ( ( _buffer[_pos] >> _bit ) & 1 );
+		if( _bit == 0 )
+		{
+			_bit = 7;
+			_pos++;
+		}
+		else
+		{
+			_bit--;
+		}
+	}
+	return true;
+}
+
+uint8_t lzDecoder::next(uint8_t* data, uint8_t* len)
+{
+	*len = 0;
+	uint32_t literal;
+	if( !getBits(1, &literal) )
+	{
+		return LZ_ERROR;
+	}
+
+	if( literal )
+	{
+		uint32_t byte;
+		if( !getBits(8, &byte) )
+		{
+			return LZ_ERROR;
+		}
+		data[0] = byte;
+		_ring[_head] = byte;
+		_head = ( _head + 1 ) & LZ_MASK;
+		*len = 1;
+		out++;
+		return LZ_DATA;
+	}
+
+	uint32_t distance;
+	if( !getBits(LZ_DISTANCE_BITS, &distance) )
+	{
+		return LZ_ERROR;
+	}
+
+	if( distance == 0 )
+	{
+		uint32_t count;
+		return ( getBits(32, &count) && count == out ) ? LZ_END : LZ_ERROR;
+	}
+
+	uint32_t length;
+	if( !getBits(LZ_LENGTH_BITS, &length) || distance > out || distance > LZ_MAX_DISTANCE )
+	{
+		return LZ_ERROR;
+	}
+
+	length += LZ_MIN_MATCH;
+	for(uint8_t k = 0; k < length; k++)
+	{
+		uint8_t byte = _ring[( _head - distance ) & LZ_MASK];
+		data[k] = byte;
+		_ring[_head] = byte;
+		_head = ( _head + 1 ) & LZ_MASK;
+	}
+	*len = length;
+	out += length;
+	return LZ_DATA;
+}
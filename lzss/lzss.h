@@ -0,0 +1,116 @@
+#ifndef LZSS_H
+#define LZSS_H
+
+/******************************************************************************************
+
+LZSS.H
+
+A streaming LZSS compressor with a small window, for files that repeat themselves a lot,
+such as text data logs where every line carries the same keys. Bytes are fed in one at a
+time and every run that already occurred in the last LZ_WINDOW bytes is replaced by a
+reference to it, so RAM use is a single LZ_WINDOW byte ring no matter how large the file
+is, in the spirit of heatshrink. The stream is a sequence of tokens, most significant bit
+first:
+
+  1 + 8 bits                        a literal byte
+  0 + 9 bits distance + 4 bits      copy length - LZ_MIN_MATCH bytes from distance bytes back,
+                                    which may overlap the bytes being copied
+
+A distance of 0 ends the stream. It is followed by the number of uncompressed bytes as 32
+bits and zero bits up to the next byte.
+
+Finding a match compares against every position in the window. On a text log that is about
+90 comparisons per input byte, 9 million per 100 KB, which at 15 to 20 cycles each comes to
+roughly ten seconds per 100 KB on the Waspmote's 14.7 MHz AVR (counted on the host, not
+timed on the mote). Build with LZSS_HOST defined to use it off the Waspmote, such as in the
+decompressor in tools/.
+
+******************************************************************************************/
+
+#ifdef LZSS_HOST
+#include <stdint.h>
+#include <string.h>
+#else
+#ifndef __WPROGRAM_H__
+#include "WaspClasses.h"
+#endif
+#endif
+
+#define LZ_WINDOW			512			//	ring of recent bytes, a power of 2
+#define LZ_DISTANCE_BITS	9
+#define LZ_LENGTH_BITS		4
+#define LZ_MIN_MATCH		2			//	shorter runs are cheaper as literals
+#define LZ_MAX_MATCH		( LZ_MIN_MATCH + ( 1 << LZ_LENGTH_BITS ) - 1 )
+#define LZ_MAX_DISTANCE		( LZ_WINDOW - LZ_MAX_MATCH )	//	the rest of the ring holds the bytes to match
+#define LZ_BUFFER_SIZE		32			//	bytes buffered between calls to lzWrite or lzRead
+
+//	results of lzDecoder::next()
+#define LZ_DATA				0			//	bytes were decoded
+#define LZ_END				1			//	the end of the stream, and the byte count matched
+#define LZ_ERROR			2			//	the stream ended early or the byte count didn't match
+
+//	writes len bytes somewhere, returns false if it couldn't
+typedef bool (*lzWrite)(void* context, const uint8_t* data, uint8_t len);
+
+//	reads up to len bytes into data, returns the number of bytes read, 0 at the end
+typedef uint8_t (*lzRead)(void* context, uint8_t* data, uint8_t len);
+
+
+class lzEncoder
+{
+public:
+	lzEncoder(lzWrite write, void* context);
+
+	void begin(lzWrite write, void* context);	//	starts a new stream, so one encoder can be reused
+	bool put(uint8_t byte);
+	bool put(const uint8_t* data, uint16_t len);
+	bool finish();						//	encodes what is left, ends the stream and flushes the buffer
+
+	uint32_t in;						//	bytes put so far
+	uint32_t bytes;						//	bytes handed to write so far
+	bool failed;						//	set once write fails, later calls do nothing
+
+private:
+	void encodeToken();
+	void putBits(uint16_t value, uint8_t count);
+	bool flush();
+
+	lzWrite _write;
+	void* _context;
+
+	uint8_t _ring [LZ_WINDOW];
+	uint16_t _head;						//	position in _ring of the first byte not yet encoded
+	uint8_t _ahead;						//	bytes not yet encoded, from _head on
+	uint16_t _history;					//	encoded bytes before _head that can be matched
+
+	uint8_t _buffer [LZ_BUFFER_SIZE];
+	uint8_t _pos;
+	uint8_t _bit;
+};
+
+
+class lzDecoder
+{
+public:
+	lzDecoder(lzRead read, void* context);
+
+	uint8_t next(uint8_t* data, uint8_t* len);	//	decodes the next token into data, which holds LZ_MAX_MATCH bytes
+
+	uint32_t out;						//	bytes decoded so far
+
+private:
+	bool getBits(uint8_t count, uint32_t* value);
+
+	lzRead _read;
+	void* _context;
+
+	uint8_t _ring [LZ_WINDOW];
+	uint16_t _head;
+
+	uint8_t _buffer [LZ_BUFFER_SIZE];
+	uint8_t _pos;
+	uint8_t _len;
+	uint8_t _bit;
+};
+
+#endif
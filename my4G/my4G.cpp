@@ -18,6 +18,9 @@ const char SMS_CMD_2 [] PROGMEM = "SIGNAL!";
 const char SMS_CMD_3 [] PROGMEM = "RESET!";
 const char SMS_CMD_4 [] PROGMEM = "SETTIME!";
 const char SMS_CMD_5 [] PROGMEM = "BATTERY!";
+const char SMS_CMD_6 [] PROGMEM = "HISTORY!";
+const char SMS_CMD_7 [] PROGMEM = "SDHEALTH!";
+const char SMS_CMD_8 [] PROGMEM = "NETWORK!";
 
 const char* const SMS_CMD_TBL [] PROGMEM = 
 {
@@ -26,11 +29,26 @@ const char* const SMS_CMD_TBL [] PROGMEM =
 	SMS_CMD_2,
 	SMS_CMD_3,
 	SMS_CMD_4,
-	SMS_CMD_5
+	SMS_CMD_5,
+	SMS_CMD_6,
+	SMS_CMD_7,
+	SMS_CMD_8
 };
 
 const char DWEET_GET_BASE [] PROGMEM = "/get/latest/dweet/for/%s";
-const char DWEET_RCV [] PROGMEM =      "AT#HTTPRCV=0\r";
+const char DWEET_POST_BASE [] PROGMEM = "/dweet/for/";
+const char DWEET_CFG [] PROGMEM =      "#HTTPCFG=0,\"dweet.io\",80";   //  steps for atRun(), without "AT"
+const char DWEET_QRY [] PROGMEM =      "#HTTPQRY=0,0,\"%s\"";
+const char DWEET_RCV [] PROGMEM =      "#HTTPRCV=0";
+const char HTTP_CFG [] PROGMEM =       "AT#HTTPCFG=0,\"%s\",%u\r";
+const char HTTP_SND [] PROGMEM =       "AT#HTTPSND=0,0,\"%s\",%lu,0\r";
+const char FTP_OPEN [] PROGMEM =       "AT#FTP%s=\"%s\",1\r";          //  PUT or APP, in command mode
+const char FTP_APPEXT [] PROGMEM =     "AT#FTPAPPEXT=%u,%u\r";
+const char NET_SELECT [] PROGMEM =     "AT+COPS=4,2,\"%s\",%u\r";    //  manual, automatic if that fails
+const char NET_AUTO [] PROGMEM =       "AT+COPS=0\r";
+const char NET_FORMAT [] PROGMEM =     "AT+COPS=3,2\r";                //  numeric operator in AT+COPS?
+const char NET_QUERY [] PROGMEM =      "AT+COPS?\r";
+const char NET_RFSTS [] PROGMEM =      "AT#RFSTS\r";
 
 
 
@@ -38,10 +56,368 @@ const char DWEET_RCV [] PROGMEM =      "AT#HTTPRCV=0\r";
 my4G::my4G(char* apn, char* login, char* password) 
 {
   this->set_APN(apn, login, password);
+  memset(&session, 0, sizeof(session));
+  memset(&sessionTotals, 0, sizeof(sessionTotals));
+  memset(&network, 0, sizeof(network));
+  memset(&attachTotals, 0, sizeof(attachTotals));
+  sessionBegan = 0;
+  _users = 0;
+  _powered = false;
+  _attached = false;
+  _cacheAddress = 0;
 }; //nothing is different from the Wasp4G initialization.
 
 
 
+/**************************************************************************************************************
+acquire()
+Registers a user of the modem and powers it up if it isn't on yet, starting a new session. If the power-up
+fails the user is still counted, so every acquire() is matched by a release(), and the next acquire() tries
+again.
+
+Returns:
+- 0 if the modem is on
+- the error code of Wasp4G::ON() otherwise
+***************************************************************************************************************/
+
+uint8_t my4G::acquire()
+{
+  _users++;
+  if( _powered )
+  {
+    session.users++;
+    return 0;
+  }
+
+  uint32_t start = millis();
+  uint8_t error = Wasp4G::ON();
+  if( error != 0 )
+  {
+    Wasp4G::OFF();
+    #if DEBUG_MY4G
+      USB.printf("4G power-up failed: %u\n", error);
+    #endif
+    return error;
+  }
+
+  _powered = true;
+  _attached = false;
+  memset(&session, 0, sizeof(session));
+  session.started = start;
+  session.users = 1;
+  return 0;
+}
+
+/**************************************************************************************************************
+release()
+Unregisters a user of the modem. The last one turns the modem off and ends the session, adding its timing
+to sessionTotals.
+***************************************************************************************************************/
+
+void my4G::release()
+{
+  if( _users > 0 )
+  {
+    _users--;
+  }
+  if( _users > 0 || !_powered )
+  {
+    return;
+  }
+
+  Wasp4G::OFF();
+  _powered = false;
+  _attached = false;
+
+  session.onMillis = millis() - session.started;
+  sessionTotals.sessions++;
+  sessionTotals.users += session.users;
+  sessionTotals.onMillis += session.onMillis;
+  sessionTotals.attachMillis += session.attachMillis;
+
+  #if DEBUG_MY4G
+    USB.printf("4G session: %u users, attach %lu ms, on %lu ms\n",
+               session.users, session.attachMillis, session.onMillis);
+    USB.printf("4G sessions: %u for %u users, on %lu s\n",
+               sessionTotals.sessions, sessionTotals.users, sessionTotals.onMillis / 1000);
+  #endif
+}
+
+/**************************************************************************************************************
+beginSession() / endSession()
+Reserve the modem for the network work of a wake cycle, see acquire(). beginSession() doesn't power the
+modem, so a cycle without network work costs nothing. It keeps the time in sessionBegan, so the work of the
+cycle can be held to a budget from its start.
+***************************************************************************************************************/
+
+void my4G::beginSession()
+{
+  _users++;
+  sessionBegan = millis();
+}
+
+void my4G::endSession()
+{
+  sessionBegan = 0;
+  this->release();
+}
+
+/**************************************************************************************************************
+attach()
+Waits for the data connection, once per session: later users of the same session find it up already,
+until dropConnection() is called after a failure. If an operator is cached, the modem is sent straight to
+it and gets MY4G_FAST_ATTACH seconds to attach; if that fails the cache is dropped and the modem searches
+every network with checkDataConnection(). After an attach the operator is cached again, and the time it
+took goes into attachTotals. The modem must be on.
+
+Parameters:
+- uint8_t seconds: how long to wait for the network
+
+Returns:
+- 0 if the data connection is up
+- the error code of checkDataConnection() otherwise
+***************************************************************************************************************/
+
+uint8_t my4G::attach(uint8_t seconds)
+{
+  if( _attached )
+  {
+    return 0;
+  }
+
+  uint32_t start = millis();
+
+  char command_buffer [40] = { 0 };
+  bool fast = network.plmn[0] != 0;
+  uint8_t error = 1;
+  if( fast )
+  {
+    //  AT+COPS=4,2,<plmn>,<AcT>
+    snprintf_P(command_buffer, sizeof(command_buffer), NET_SELECT, network.plmn, network.act);
+    if( this->sendCommand(command_buffer, "OK", "ERROR", MY4G_FAST_ATTACH * 1000UL) == 1 )
+    {
+      error = this->checkDataConnection(min(seconds, (uint8_t) MY4G_FAST_ATTACH));
+    }
+
+    if( error != 0 )                            //  gone or out of reach, search everything
+    {
+      #if DEBUG_MY4G
+        USB.printf("4G cached operator %s failed\n", network.plmn);
+      #endif
+      fast = false;
+      memset(network.plmn, 0, sizeof(network.plmn));
+      this->saveNetwork();
+      strcpy_P(command_buffer, NET_AUTO);
+      this->sendCommand(command_buffer, "OK", "ERROR", 5000);
+    }
+  }
+
+  if( error != 0 )
+  {
+    error = this->checkDataConnection(seconds);
+  }
+
+  uint32_t elapsed = millis() - start;
+  session.attachMillis += elapsed;
+
+  #if DEBUG_MY4G
+    USB.printf("4G attach: %u in %lu ms, %s\n", error, elapsed, fast ? "cached" : "full search");
+  #endif
+
+  if( error != 0 )
+  {
+    attachTotals.failed++;
+    return error;
+  }
+
+  _attached = true;
+  session.attaches++;
+  if( fast )
+  {
+    attachTotals.fast++;
+    attachTotals.fastMillis += elapsed;
+  }
+  else
+  {
+    attachTotals.full++;
+    attachTotals.fullMillis += elapsed;
+  }
+  attachTotals.maxMillis = max(attachTotals.maxMillis, elapsed);
+
+  this->rememberNetwork();
+  return 0;
+}
+
+/*
+rememberNetwork()
+Reads the operator and radio access technology of the current registration with AT+COPS?, and on LTE the
+band of the serving cell from the last field of AT#RFSTS, and caches them.
+*/
+void my4G::rememberNetwork()
+{
+  char command_buffer [16] = { 0 };
+  strcpy_P(command_buffer, NET_FORMAT);
+  this->sendCommand(command_buffer, "OK", "ERROR", 2000);
+
+  //  +COPS: <mode>,2,"<plmn>",<AcT>
+  strcpy_P(command_buffer, NET_QUERY);
+  if( this->sendCommand(command_buffer, "OK", "ERROR", 5000) != 1 )
+  {
+    return;
+  }
+  char* plmn = strchr((char*) _buffer, '"');
+  char* end = ( plmn != NULL ) ? strchr(plmn + 1, '"') : NULL;
+  if( end == NULL || end - plmn - 1 >= (int) sizeof(network.plmn) || end[1] != ',' )
+  {
+    return;
+  }
+
+  networkCache found;
+  memset(&found, 0, sizeof(found));
+  memcpy(found.plmn, plmn + 1, end - plmn - 1);
+  found.act = atoi(end + 2);
+
+  //  #RFSTS: <PLMN>,<EARFCN>,...,<ABND> on LTE
+  strcpy_P(command_buffer, NET_RFSTS);
+  if( found.act == MY4G_ACT_LTE && this->sendCommand(command_buffer, "OK", "ERROR", 5000) == 1 )
+  {
+    char* line = strstr((char*) _buffer, "#RFSTS:");
+    char* eol = ( line != NULL ) ? strchr(line, '\r') : NULL;
+    if( eol != NULL )
+    {
+      *eol = '\0';
+      char* last = strrchr(line, ',');
+      found.band = ( last != NULL ) ? atoi(last + 1) : 0;
+    }
+  }
+
+  #if DEBUG_MY4G
+    USB.printf("4G network %s, AcT %u, band %u\n", found.plmn, found.act, found.band);
+  #endif
+
+  if( strcmp(found.plmn, network.plmn) != 0 || found.act != network.act || found.band != network.band )
+  {
+    memcpy(network.plmn, found.plmn, sizeof(network.plmn));
+    network.act = found.act;
+    network.band = found.band;
+    this->saveNetwork();
+  }
+}
+
+/*
+saveNetwork()
+Writes network to the EEPROM, if it is kept there. Unchanged bytes aren't written again.
+*/
+void my4G::saveNetwork()
+{
+  network.magic = MY4G_CACHE_MAGIC;
+  network.check = 0;
+  uint8_t check = 0;
+  for(uint8_t i = 0; i < sizeof(network); i++)
+  {
+    check ^= ( (uint8_t*) &network )[i];
+  }
+  network.check = check;
+
+  if( _cacheAddress != 0 )
+  {
+    eeprom_update_block(&network, (void*) _cacheAddress, sizeof(network));
+  }
+}
+
+/**************************************************************************************************************
+useNetworkCache()
+Loads the cached operator from the EEPROM, see networkCache. A cache that fails its check is dropped.
+
+Parameters:
+- uint16_t eepromAddress: where the cache is kept, MY4G_CACHE_SIZE bytes that nothing else uses
+***************************************************************************************************************/
+
+void my4G::useNetworkCache(uint16_t eepromAddress)
+{
+  _cacheAddress = eepromAddress;
+  eeprom_read_block(&network, (const void*) eepromAddress, sizeof(network));
+
+  uint8_t check = 0;
+  for(uint8_t i = 0; i < sizeof(network); i++)
+  {
+    check ^= ( (uint8_t*) &network )[i];
+  }
+  if( network.magic != MY4G_CACHE_MAGIC || check != 0 ||
+      memchr(network.plmn, 0, sizeof(network.plmn)) == NULL )
+  {
+    memset(&network, 0, sizeof(network));
+  }
+
+  #if DEBUG_MY4G
+    USB.printf("4G cached network: %s\n", network.plmn[0] != 0 ? network.plmn : "none");
+  #endif
+}
+
+/*
+networkField()
+kvField callback of a NETWORK dweet, see my4G.h.
+*/
+void networkField(const void* context, uint8_t index, strbuf* key, strbuf* val)
+{
+  const my4G* modem = (const my4G*) context;
+  const attachStats* stats = &modem->attachTotals;
+  switch( index )
+  {
+    case 0:
+      key->append_P(PSTR("operator"));
+      val->append(modem->network.plmn);
+      break;
+    case 1:
+      key->append_P(PSTR("band"));
+      val->appendf_P(PSTR("%u"), modem->network.band);
+      break;
+    case 2:
+      key->append_P(PSTR("fast"));                //  attaches to the cached operator
+      val->appendf_P(PSTR("%u"), stats->fast);
+      break;
+    case 3:
+      key->append_P(PSTR("fastMs"));              //  and their average time
+      val->appendf_P(PSTR("%lu"), stats->fast ? stats->fastMillis / stats->fast : 0UL);
+      break;
+    case 4:
+      key->append_P(PSTR("full"));
+      val->appendf_P(PSTR("%u"), stats->full);
+      break;
+    case 5:
+      key->append_P(PSTR("fullMs"));
+      val->appendf_P(PSTR("%lu"), stats->full ? stats->fullMillis / stats->full : 0UL);
+      break;
+    case 6:
+      key->append_P(PSTR("failed"));
+      val->appendf_P(PSTR("%u"), stats->failed);
+      break;
+    case 7:
+      key->append_P(PSTR("maxMs"));
+      val->appendf_P(PSTR("%lu"), stats->maxMillis);
+      break;
+    case 8:
+      key->append_P(PSTR("sessions"));            //  modem sessions and the users they served
+      val->appendf_P(PSTR("%u,%u"), modem->sessionTotals.sessions, modem->sessionTotals.users);
+      break;
+    default:
+      key->append_P(PSTR("onS"));                 //  seconds the modem was powered
+      val->appendf_P(PSTR("%lu"), modem->sessionTotals.onMillis / 1000);
+      break;
+  }
+}
+
+/*
+dropConnection()
+Makes the next attach() check the data connection again, after a network operation failed.
+*/
+void my4G::dropConnection()
+{
+  _attached = false;
+}
+
+
+
 /**************************************************************************************************************
 SendMyCommand()
 Takes an AT command string and up to two desired answers and sends it to the SIM.
@@ -56,24 +432,24 @@ Returns:
 - 3 if SIM doesn't respond at all
 ***************************************************************************************************************/
 
-uint8_t my4G::sendMyCommand(char* command)
+uint8_t my4G::sendMyCommand(const char* command)
 {
-  this->sendMyCommand(command,	// character array representing the AT command
-                      NULL,		  // no desired answer1
-                      NULL);		// no desired answer2
+  return this->sendMyCommand(command,	// character array representing the AT command
+                             NULL,		  // no desired answer1
+                             NULL);		// no desired answer2
 }
 
-uint8_t my4G::sendMyCommand(char* command,
-                            char* ans1)
+uint8_t my4G::sendMyCommand(const char* command,
+                            const char* ans1)
 {
-  this->sendMyCommand(command,	//character array representing the AT command
-                      ans1,		  //desired answer1
-                      NULL);		//no desired answer2
+  return this->sendMyCommand(command,	//character array representing the AT command
+                             ans1,		  //desired answer1
+                             NULL);		//no desired answer2
 }
 
-uint8_t my4G::sendMyCommand(char* command,
-                            char* ans1,
-                            char* ans2)
+uint8_t my4G::sendMyCommand(const char* command,
+                            const char* ans1,
+                            const char* ans2)
 {
   uint8_t answer;
 
@@ -83,7 +459,7 @@ uint8_t my4G::sendMyCommand(char* command,
 
 
   USB.print(F("Response:\t"));
-  for (int i = 0; i < 512; i++) 
+  for (uint16_t i = 0; i < _length && i < sizeof(_buffer); i++)  //  only what the SIM actually sent
   {
     USB.print((char)_buffer[i]); //print out SIM response
   }
@@ -98,6 +474,102 @@ uint8_t my4G::sendMyCommand(char* command,
 
 }
 
+/**************************************************************************************************************
+atRun()
+Runs a chain of AT commands. Consecutive steps that wait for "OK" and no URC are sent as one command line,
+"AT<text>;<text>;...\r", which the modem answers with one final result, so the whole group costs a single
+round trip over the UART. A line waits for the final result of its last step, ERROR or +CME ERROR, for the
+sum of the timeouts of its steps, and returns as soon as either arrives instead of waiting out a fixed
+delay. If the last step waits for an URC, that is awaited next, up to its own deadline, and the rest of its
+line is kept in atUrc so its parameters can be read.
+
+Parameters:
+- const atCommand* chain: the steps, see my4G.h
+- uint8_t count: number of steps
+
+Returns:
+- AT_OK if every step succeeded
+- AT_ERROR, AT_TIMEOUT, AT_NO_URC or AT_TOO_LONG otherwise, with the index of the step in atFailed
+***************************************************************************************************************/
+
+uint8_t my4G::atRun(const atCommand* chain, uint8_t count)
+{
+  char line [AT_LINE_SIZE];
+  uint8_t i = 0;
+  memset(atUrc, 0, sizeof(atUrc));
+  atFailed = 0;
+
+  while( i < count )
+  {
+    strbuf text(line, sizeof(line));
+    text.append("AT");
+    uint32_t timeout = 0;
+    const atCommand* step;
+    while( true )                               //  join steps until one needs its own answer
+    {
+      step = &chain[i];
+      if( ( text.length() > 2 && !text.append(';') ) || !text.append(step->text) ||
+          text.length() + 1 >= sizeof(line) )
+      {
+        atFailed = i;
+        return AT_TOO_LONG;
+      }
+      timeout += step->timeout;
+      if( step->ok != NULL || step->urc != NULL || i + 1 == count )
+      {
+        break;
+      }
+
+      //  only join the next step if it still fits, so a long chain is split into several lines
+      if( text.length() + 1 + strlen(chain[i + 1].text) + 1 >= sizeof(line) )
+      {
+        break;
+      }
+      i++;
+    }
+    text.append('\r');
+
+    #if DEBUG_MY4G
+      USB.printf("AT> %s\n", line);
+    #endif
+
+    uint8_t answer = this->sendCommand(line, step->ok != NULL ? step->ok : "OK", "ERROR", timeout);
+    if( answer != 1 )
+    {
+      #if DEBUG_MY4G
+        USB.printf("AT< %s after %u\n", answer == 2 ? "ERROR" : "timeout", i);
+      #endif
+      atFailed = i;
+      return ( answer == 2 ) ? AT_ERROR : AT_TIMEOUT;
+    }
+
+    if( step->urc != NULL )
+    {
+      if( this->waitFor(step->urc, "ERROR", step->urcTimeout) != 1 )
+      {
+        atFailed = i;
+        return AT_NO_URC;
+      }
+
+      //  the URC's parameters follow on the same line
+      memset(atUrc, 0, sizeof(atUrc));
+      if( this->waitFor("\r", 1000) == 1 )
+      {
+        for(uint8_t k = 0; k < sizeof(atUrc) - 1 && _buffer[k] != '\r' && _buffer[k] != 0; k++)
+        {
+          atUrc[k] = _buffer[k];
+        }
+      }
+
+      #if DEBUG_MY4G
+        USB.printf("AT< %s%s\n", step->urc, atUrc);
+      #endif
+    }
+    i++;
+  }
+  return AT_OK;
+}
+
 
 
 
@@ -114,7 +586,9 @@ Parameters:
   data keyvalue array. You can't easily use sizeof to get this value, you should just keep track of it somehow.
 
 Returns:
-- 
+- 0 if the dweet was posted
+- 1-5 if it failed, see httpPostKeyvalues()
+- 128 if the name is too long
 ***************************************************************************************************************/
 uint8_t my4G::sendDweet(	uint16_t port,
                           	char* name,
@@ -122,23 +596,23 @@ uint8_t my4G::sendDweet(	uint16_t port,
                           	keyvalue* data,
                           	uint8_t numPairs)
 {
-  char resource [64];                                    // init a blank character array to store the url
-  memset(resource, 0, sizeof(resource));
-  char dweetString [] = "/dweet/for/";                   // init the constant section of the resource
-  memcpy(resource, dweetString, sizeof(dweetString)-1);  // copy the constant section to resource
-  if (sizeof(dweetString) + size < 63)                   // make sure it won't overflow if the name is added
-  {
-
-    // copy over the name. Resource is an array, so its name represents the register address. +sizeof shifts
-    // the address over by the number of characters in dweetString. -1 cuts off the null terminator since we
-    // used a string literal to initialize dweetString.
-
-    memcpy(resource+sizeof(dweetString)-1,name,size);    // name is the name of the device, size is the length.   
-    resource[sizeof(dweetString)+size-2] = '?';          // two null terminators now so -2.
-                                                         // '?' transitions from the name to the data
-  }
+  kvSource source = { data, NULL, NULL, numPairs };
+  return this->sendDweet(port, name, size, &source);
+}
 
-  else {                                                 // If the name was too long, say so and don't continue
+/*
+The same for data formatted field by field, such as a sample record that isn't stored as keyvalues.
+*/
+uint8_t my4G::sendDweet(	uint16_t port,
+                          	char* name,
+                          	uint8_t size,
+                          	const kvSource* data)
+{
+  fixedStr<64> resource;                                 // the url, "/dweet/for/<name>?"
+  if( !resource.append_P(DWEET_POST_BASE) ||             // make sure it won't overflow if the name is added
+      !resource.append(name, size) ||                    // name is the name of the device, size is the length.
+      !resource.append('?') )                            // '?' transitions from the name to the data
+  {                                                      // If the name was too long, say so and don't continue
     #if DEBUG_MY4G
       USB.println(F("Device name is too long."));
     #endif
@@ -146,95 +620,109 @@ uint8_t my4G::sendDweet(	uint16_t port,
   }
 
   /*
-    We need to create the character array for the data. Since we've stored the current
-    data measurements in an array of keyvalue object pointers, theres some manipulation involved.
+    The data is streamed to the modem as a URL query string straight from its source, so there is no
+    intermediate copy and no limit on its length.
   */
-  uint8_t DATALENGTH = 255;
-  char dataString [DATALENGTH] = {0};	           //	clear dataString.
-  uint8_t len = 0; 							                         //	used length of data string
-  uint8_t pair = 0;							                       //	current keyvalue pair in array
+  #if DEBUG_MY4G
+    USB.println(F("POSTING"));
+    USB.printf("Resource: %s\n", resource.c_str());
+  #endif
 
-  while (pair < numPairs &&                              // while this is not the last pair
-         len < DATALENGTH)                                      // and the length of the datastring is not too long
-  {
+  this->acquire();                          //  Turn 4G on, unless the session has it on already
 
-    //Insert the key string into dataString
+  uint8_t postError = this->httpPostKeyvalues("dweet.io", port, resource.c_str(), data);
 
-    uint8_t charIndex = 0;					            //	current character index in the key
-    char* k = data[pair].key;				          //	pointer to first character in key
-    uint8_t strSize = sizeof(data[pair].key);
-    while ( 	k[charIndex] != '\0' &&			      //	while the current char is not a null terminator
-              charIndex <= strSize &&		        //	and charIndex is not larger than the length of the string
-              charIndex < DATALENGTH)				          //	and charIndex is not equal to the max size of dataString
-    {
-      dataString[len] = k[charIndex];
-      len++;
-      charIndex++;
-    }
+  this->release();
+  #if DEBUG_MY4G
+    USB.printf("Post Error: %u\n",postError);
+  #endif
+  return postError;                         //  0 means OK.
+}
 
-    dataString[len] = '=';					         //	insert separator between key and value.
-    len++;
+/**************************************************************************************************************
+httpPostKeyvalues()
+Posts an array of keyvalue objects, or fields formatted by a callback, as a form-encoded HTTP body written
+straight from the source into the modem's UART once it prompts for the data. AT#HTTPSND needs the length of the body up front, so it is
+serialized into a countSink first to measure it. The modem must already be on.
 
-    //Then insert the val string into dataString
+Parameters:
+- host: the server, such as "dweet.io"
+- port: usually 80
+- resource: the path on the server
+- data: the keyvalues or field callback to post
+Returns:
+- 0 if the server answered
+- 1 if the data couldn't be serialized
+- 2 if there is no data connection
+- 3 if the modem rejected the HTTP configuration
+- 4 if the modem didn't prompt for the data
+- 5 if the server didn't answer
+***************************************************************************************************************/
+uint8_t my4G::httpPostKeyvalues(	const char* host,
+									uint16_t port,
+									const char* resource,
+									const kvSource* data)
+{
+  countSink counter;
+  if( serializeSource(&counter, data, KV_QUERY) != 0 )
+  {
+    return 1;
+  }
 
-    charIndex = 0;
-    char* v = (data[pair].val);
-    strSize = sizeof(data[pair].val);
-    while (	v[charIndex] != '\0' &&
-            charIndex <= strSize &&
-            charIndex < DATALENGTH)
-    {
-      dataString[len] = v[charIndex];
-      len++;
-      charIndex++;
-    }
+  if( this->attach(60) != 0 )
+  {
+    return 2;
+  }
 
-    pair++;								                 //	next keyvalue pair
+  char command_buffer [100] = { 0 };
 
-    if (pair <= numPairs) {					       //	if there is another keyvalue pair
-      dataString[len] = '&';				         //	insert separator between keyvalue pairs.
-      len++;
-    }
-  }
-  if(len>254){
-    USB.println(F("Data too long."));
-    return 129;
+  //  AT#HTTPCFG=0,<url>,<port>
+  snprintf_P( command_buffer,
+              sizeof(command_buffer),
+              HTTP_CFG,
+              host,
+              port);
+  if( this->sendCommand(command_buffer, "OK", "ERROR", 2000) != 1 )
+  {
+    return 3;
   }
 
-  /*
-    Now we can Dweet the data by calling Wasp4G's function for posting http urls.
-  */
-  USB.println(F("POSTING"));
-  USB.printf("Length of DSTRING: %u\n", (unsigned) strlen(dataString));
-  USB.printf("Resource: %s,\tdataString: ",resource);
-  for(uint8_t i = 0; i<strlen(dataString); i++)
+  //  AT#HTTPSND=0,<command=POST>,<resource>,<length>,<type=form>
+  snprintf_P( command_buffer,
+              sizeof(command_buffer),
+              HTTP_SND,
+              resource,
+              (unsigned long) counter.len);
+  if( this->sendCommand(command_buffer, ">>>", "ERROR", 5000) != 1 )
   {
-    USB.print(dataString[i]);
+    return 4;
   }
-  USB.println();
-  char host [] = "dweet.io";
-  uint8_t postError;
-
-  this->ON();                               //  Turn 4G on
-
-  postError = this->http(HTTP_POST,		      //	method
-                        host,				        //	host url
-                        port,				        //	port
-                        resource,			      //	resource
-                        dataString);		    //	data
 
-  this->OFF();
-  USB.printf("Post Error: %u\n",postError);
-  return postError;							            //	between 0 and 27. 0 means OK.
-  
+  uartSink uart(this);
+  serializeSource(&uart, data, KV_QUERY);
 
+  if( this->waitFor("#HTTPRING", "ERROR", 30000) != 1 )
+  {
+    this->dropConnection();
+    return 5;
+  }
+  return 0;
 }
 
 /**************************************************************************************************************
 Post to FTP
+Uploads an SD file in a session of its own. If the server already has a file of the same size, from an
+upload whose result got lost, nothing is sent. The result of the upload decides, not that of closing the
+session.
+
 Parameters:
+- char* ftp_server, uint8_t ftp_port, char* ftp_user, char* ftp_pass: the FTP server to log in to
+- char* SD_file: path of the file on the SD
+- char* serverFile: path of the file on the server
 
 Returns:
+- 1 if the file is on the server
+- 0 if the session couldn't be opened or the upload failed
 ***************************************************************************************************************/
 
 uint8_t my4G::postFTP(char* ftp_server,
@@ -244,7 +732,7 @@ uint8_t my4G::postFTP(char* ftp_server,
               char* SD_file,
               char* serverFile)
 {
-  this->ON();
+  this->acquire();
   uint8_t error = this->ftpOpenSession(ftp_server,
                                       ftp_port,
                                       ftp_user,
@@ -255,7 +743,18 @@ uint8_t my4G::postFTP(char* ftp_server,
     USB.println(F("FTP open session OK"));
     uint32_t previous = millis();
 
-    error = this->ftpUpload(serverFile, SD_file);
+    uint32_t remoteSize = 0;
+    int32_t localSize = SD.ON() ? SD.getFileSize(SD_file) : -1;
+    if( localSize >= 0 && this->ftpRemoteState(serverFile, localSize, &remoteSize) == FTP_REMOTE_COMPLETE )
+    {
+      USB.println(F("2.2. File already on the FTP server, skipping the upload"));
+      error = 0;
+    }
+    else
+    {
+      error = this->ftpUpload(serverFile, SD_file);
+    }
+    uint8_t uploaded = ( error == 0 );
     if(error == 0)
     {
       USB.print(F("2.2. Uploading SD file to FTP server done! "));
@@ -270,12 +769,11 @@ uint8_t my4G::postFTP(char* ftp_server,
     }
 
     error = this->ftpCloseSession();
-    this->OFF();
+    this->release();
 
     if (error == 0)
     {
       USB.println(F("2.3. FTP close session OK"));
-      return 1;
     }
     else
     {
@@ -283,17 +781,385 @@ uint8_t my4G::postFTP(char* ftp_server,
       USB.println(error, DEC);
       USB.print(F("CMEE error: "));
       USB.println(_4G._errorCode, DEC);
-      return 0;
     }
+    return uploaded;                                          //  the file is there even if closing failed
   }
   else
   {
     USB.print(F( "2.1. FTP connection error: "));
     USB.println(error, DEC);
+    this->dropConnection();
+    this->release();
     return 0;
   }
 }
 
+/**************************************************************************************************************
+ftpRemoteState()
+Asks the server for the size of a file with AT#FTPFSIZE and compares it with the size of the local file.
+
+Parameters:
+- char* serverPath: path of the file on the server
+- uint32_t localSize: bytes of the local file
+- uint32_t* remoteSize: set to the size on the server, 0 if there is none
+
+Returns:
+- FTP_REMOTE_MISSING, FTP_REMOTE_PARTIAL, FTP_REMOTE_COMPLETE or FTP_REMOTE_MISMATCH, see my4G.h
+***************************************************************************************************************/
+
+uint8_t my4G::ftpRemoteState(char* serverPath, uint32_t localSize, uint32_t* remoteSize)
+{
+  *remoteSize = 0;
+  if( this->ftpFileSize(serverPath) != 0 )
+  {
+    return FTP_REMOTE_MISSING;
+  }
+  *remoteSize = this->_filesize;
+
+  #if DEBUG_MY4G
+    USB.printf("FTP remote size %lu, local %lu\n", *remoteSize, localSize);
+  #endif
+
+  if( *remoteSize == localSize )
+  {
+    return FTP_REMOTE_COMPLETE;
+  }
+  return ( *remoteSize < localSize ) ? FTP_REMOTE_PARTIAL : FTP_REMOTE_MISMATCH;
+}
+
+/**************************************************************************************************************
+ftpUploadResume()
+Uploads an SD file to the open FTP session so the upload can be picked up again where it broke off. The size
+of the file on the server decides where the upload continues, as that is what actually arrived (see
+ftpRemoteState): nothing is sent if the server has the whole file, the rest is appended with AT#FTPAPP if it
+has part of it, and a larger file is overwritten. A new file that fits into maxBytes goes out in one
+transfer with ftpUpload(), which is much faster than chunks; if it breaks off, the next call appends the rest
+from what the server got. Anything else is sent in FTP_CHUNK_SIZE chunks with AT#FTPAPPEXT, which can pause
+at a limit. If a previous attempt sent an offset but the server can't report the size, or it refuses to
+append, the whole file is uploaded again with ftpUpload().
+
+Parameters:
+- char* serverPath: path of the file on the server
+- char* sdPath: path of the file on the SD
+- uint32_t offset: bytes a previous attempt got to, 0 if there was none
+- ftpFileProgress progress: called with the offset after every chunk, may be NULL
+- void* context: passed to progress
+- uint32_t length: bytes of the file to upload, 0 for the whole file
+- uint32_t maxBytes, maxMillis: stop after the chunk that sends this many bytes or passes this many ms,
+  0 for no limit. The offset reached is reported to progress, so the upload can be resumed from it. A
+  transfer with ftpUpload() can't pause, so maxMillis doesn't bound it.
+
+Returns:
+- 0 if the whole file is on the server
+- 1 if the SD file couldn't be opened
+- 2 if the server refused to open the file for writing
+- 3 if the connection failed during the upload, the next call resumes from what the server got
+- 4 if the full re-upload after a failed resume failed, or with a length, if the resume failed
+- 5 if the upload stopped at maxBytes or maxMillis
+***************************************************************************************************************/
+
+uint8_t my4G::ftpUploadResume(  char* serverPath,
+                                char* sdPath,
+                                uint32_t offset,
+                                ftpFileProgress progress,
+                                void* context,
+                                uint32_t length,
+                                uint32_t maxBytes,
+                                uint32_t maxMillis)
+{
+  uint32_t start = millis();
+  SdFile file;
+  if( !SD.ON() || !SD.openFile(sdPath, &file, O_READ) )
+  {
+    return 1;
+  }
+  uint32_t fileSize = file.fileSize();
+  if( length > 0 && length < fileSize )                       //  the rest isn't written yet
+  {
+    fileSize = length;
+  }
+
+  uint32_t remoteSize = 0;                                    //  ask the server what actually arrived
+  switch( this->ftpRemoteState(serverPath, fileSize, &remoteSize) )
+  {
+    case FTP_REMOTE_COMPLETE:                                 //  uploaded before, only the marking failed
+      #if DEBUG_MY4G
+        USB.println(F("FTP file already on the server"));
+      #endif
+      file.close();
+      if( progress != NULL )
+      {
+        progress(context, fileSize);
+      }
+      return 0;
+
+    case FTP_REMOTE_PARTIAL:
+      offset = remoteSize;
+      break;
+
+    case FTP_REMOTE_MISMATCH:                                 //  overwrite it
+      offset = 0;
+      break;
+
+    default:
+      if( offset > 0 )
+      {
+        offset = fileSize + 1;                                //  can't resume, see below
+      }
+      break;
+  }
+
+  if( offset == 0 && length == 0 && ( maxBytes == 0 || fileSize <= maxBytes ) )
+  {
+    file.close();
+    #if DEBUG_MY4G
+      USB.printf("FTP upload of %lu bytes in one transfer\n", fileSize);
+    #endif
+    if( this->ftpUpload(serverPath, sdPath) != 0 )
+    {
+      return 3;
+    }
+    if( progress != NULL )
+    {
+      progress(context, fileSize);
+    }
+    return 0;
+  }
+
+  if( offset == fileSize )                                    //  nothing left to append
+  {
+    file.close();
+    if( progress != NULL )
+    {
+      progress(context, fileSize);
+    }
+    return 0;
+  }
+
+  char command_buffer [FTP_BATCH_SERVER_SIZE + 20] = { 0 };
+  uint8_t answer = 0;
+  if( offset < fileSize )
+  {
+    //  AT#FTPPUT=<path>,1 for a new file, AT#FTPAPP=<path>,1 to continue one
+    snprintf_P( command_buffer,
+                sizeof(command_buffer),
+                FTP_OPEN,
+                offset == 0 ? "PUT" : "APP",
+                serverPath);
+    answer = this->sendCommand(command_buffer, "OK", "ERROR", 30000);
+  }
+
+  if( answer != 1 )
+  {
+    file.close();
+    if( offset == 0 )
+    {
+      return 2;
+    }
+
+    #if DEBUG_MY4G
+      USB.println(F("FTP resume not supported, uploading the whole file"));
+    #endif
+    if( progress != NULL )
+    {
+      progress(context, 0);
+    }
+    if( length > 0 )                                          //  the next call starts over with AT#FTPPUT
+    {
+      return 4;
+    }
+    return ( this->ftpUpload(serverPath, sdPath) == 0 ) ? 0 : 4;
+  }
+
+  #if DEBUG_MY4G
+    USB.printf("FTP upload from %lu of %lu bytes\n", offset, fileSize);
+  #endif
+
+  uint8_t chunk [FTP_CHUNK_SIZE];
+  uint8_t result = 0;
+  uint32_t first = offset;
+  file.seekSet(offset);
+  while( offset < fileSize )
+  {
+    uint16_t n = min( (uint32_t) sizeof(chunk), fileSize - offset );
+    if( file.read(chunk, n) != (int16_t) n )
+    {
+      result = 1;
+      break;
+    }
+    bool eof = ( offset + n == fileSize );
+    bool pause = !eof && ( ( maxBytes > 0 && offset + n - first >= maxBytes ) ||
+                           ( maxMillis > 0 && millis() - start > maxMillis ) );
+
+    //  AT#FTPAPPEXT=<bytes>,<eof>, then the data after the prompt. A pause closes the data connection
+    //  like the end of the file does, so the server keeps what was sent.
+    snprintf_P(command_buffer, sizeof(command_buffer), FTP_APPEXT, n, ( eof || pause ) ? 1 : 0);
+    if( this->sendCommand(command_buffer, ">", "ERROR", 10000) != 1 )
+    {
+      result = 3;
+      break;
+    }
+    for(uint16_t i = 0; i < n; i++)
+    {
+      this->printByte(chunk[i], this->_uart);
+    }
+    if( this->waitFor("#FTPAPPEXT", "ERROR", 30000) != 1 )
+    {
+      result = 3;
+      break;
+    }
+
+    offset += n;
+    if( progress != NULL )                                    //  a drop now only loses the chunk in flight
+    {
+      progress(context, offset);
+    }
+
+    if( pause )
+    {
+      #if DEBUG_MY4G
+        USB.printf("FTP upload paused at %lu\n", offset);
+      #endif
+      result = 5;
+      break;
+    }
+  }
+
+  file.close();
+  return result;
+}
+
+/**************************************************************************************************************
+ftpUploadBatch()
+Turns the modem on, opens one FTP session and uploads the files handed out by batch->next until there are
+none left, resuming partial uploads (see ftpUploadResume) and reporting the result of each one to
+batch->done as soon as it completes. The batch is one slice of a longer backlog: once it has sent
+batch->maxBytes or taken batch->maxMillis it stops, if need be in the middle of a file, whose upload is
+paused without calling batch->done so the next batch resumes it from the offset reported to
+batch->progress. The time counts from batch->started, if set, so work before the batch such as powering
+the modem for an earlier user counts too; powering the modem, logging in and whatever batch->next does to
+prepare a file always count. The first file gets at least FTP_BATCH_MIN_MILLIS even if that time is used
+up already, so the backlog still moves on a slow network. The session is closed and the modem turned off at
+the end.
+
+Parameters:
+- char* ftp_server, uint16_t ftp_port, char* ftp_user, char* ftp_pass: the FTP server to log in to
+- ftpBatch* batch: callbacks and budgets of the batch. Its sent, failed and bytes counts are filled in.
+
+Returns:
+- 0 if every file was handled
+- 1 if the modem didn't start or the session couldn't be opened
+- 2 if the batch stopped at its byte or time budget
+- 3 if the batch stopped after FTP_BATCH_MAX_FAILS uploads in a row failed
+***************************************************************************************************************/
+
+uint8_t my4G::ftpUploadBatch( char* ftp_server,
+                              uint16_t ftp_port,
+                              char* ftp_user,
+                              char* ftp_pass,
+                              ftpBatch* batch)
+{
+  batch->sent = 0;
+  batch->failed = 0;
+  batch->bytes = 0;
+  uint32_t start = ( batch->started != 0 ) ? batch->started : millis();
+
+  if( this->acquire() != 0 )
+  {
+    this->release();
+    return 1;
+  }
+
+  uint8_t error = this->ftpOpenSession(ftp_server, ftp_port, ftp_user, ftp_pass);
+  if( error != 0 )
+  {
+    #if DEBUG_MY4G
+      USB.print(F("FTP connection error: "));
+      USB.println(error, DEC);
+    #endif
+    this->dropConnection();
+    this->release();
+    return 1;
+  }
+
+  char sdPath [FTP_BATCH_SD_SIZE];
+  char serverPath [FTP_BATCH_SERVER_SIZE];
+  uint32_t fileSize = 0;
+  uint32_t resumeFrom = 0;
+  uint8_t fails = 0;
+  uint8_t result = 0;
+
+  while( true )
+  {
+    //  checked before batch->next too, which may take a while to prepare the file
+    bool first = ( batch->sent == 0 && batch->failed == 0 );
+    uint32_t elapsed = millis() - start;
+    if( ( !first && elapsed >= batch->maxMillis ) || batch->bytes >= batch->maxBytes )
+    {
+      result = 2;
+      break;
+    }
+    if( !batch->next(batch->context, sdPath, sizeof(sdPath), serverPath, sizeof(serverPath), &fileSize, &resumeFrom) )
+    {
+      break;
+    }
+
+    elapsed = millis() - start;
+    uint32_t left = ( elapsed < batch->maxMillis ) ? batch->maxMillis - elapsed : 0;
+    if( first && left < FTP_BATCH_MIN_MILLIS )
+    {
+      left = FTP_BATCH_MIN_MILLIS;
+    }
+    if( left == 0 )
+    {
+      result = 2;                                             //  the file stays unsent for the next batch
+      break;
+    }
+
+    uint32_t remaining = fileSize > resumeFrom ? fileSize - resumeFrom : 0;
+    uint32_t budget = batch->maxBytes - batch->bytes;
+    error = this->ftpUploadResume(serverPath, sdPath, resumeFrom, batch->progress, batch->context,
+                                  0, budget, left);
+    if( error == 5 )                                          //  out of budget in the middle of the file
+    {
+      batch->bytes += min(remaining, budget);
+      result = 2;
+      break;
+    }
+    batch->done(batch->context, error);
+
+    #if DEBUG_MY4G
+      USB.printf("FTP %s: %u\n", sdPath, error);
+    #endif
+
+    if( error == 0 )
+    {
+      batch->sent++;
+      batch->bytes += remaining;
+      fails = 0;
+    }
+    else
+    {
+      batch->failed++;
+      if( ++fails >= FTP_BATCH_MAX_FAILS )                    //  the session is probably gone
+      {
+        result = 3;
+        break;
+      }
+    }
+  }
+
+  this->ftpCloseSession();
+  this->release();
+
+  #if DEBUG_MY4G
+    USB.printf("FTP batch: %u sent, %u failed, %lu bytes in %lu s\n",
+               batch->sent, batch->failed, batch->bytes, ( millis() - start ) / 1000);
+  #endif
+
+  return result;
+}
+
 /**************************************************************************************************************
 serialCommandMode()
 Waits for a serial command and then sends it to the SIM card, printing the response. The user can enter 'q'
@@ -431,50 +1297,114 @@ Returns: index of command if it is valid, otherwise returns -1.
 // }
 
 
-int8_t my4G::receiveDweetCommand(char* name)
-{
-  char command_buffer[60] = { 0 };
-  char rsc [50] = { 0 };
-
-  this->checkDataConnection(20000);
-  //  AT#HTTPCFG=0,<url>,<port>
-  snprintf_P( command_buffer,
-              sizeof(command_buffer),
-              table_HTTP[0],
-              "dweet.io",
-              80);
+/**************************************************************************************************************
+receiveDweetCommand()
+Fetches the latest dweet for the device and looks for a command in it, see parseDweetResponse(). The HTTP
+profile and the query go to the modem as one command line, then it waits for the #HTTPRING that reports the
+answer, so the modem stays on only as long as dweet.io takes to respond. AT#HTTPRCV answers with the "<<<"
+prompt and then the raw body, exactly the size #HTTPRING reported; as much of it as fits is kept in
+_buffer, the rest is read and dropped.
 
-  this->sendMyCommand(command_buffer);
+Returns:
+- the index of the command
+- -1 if there is none
+- -2 if there is no data connection or the modem didn't answer
+- -3 if dweet.io answered with an error or nothing
+***************************************************************************************************************/
 
+int8_t my4G::receiveDweetCommand(char* name)
+{
+  char cfg [32] = { 0 };
+  char qry [60] = { 0 };
+  char rcv [16] = { 0 };
+  fixedStr<50> rsc;
 
-  //  "/get/latest/dweet/for/<name>""
-  snprintf_P( rsc,
-              sizeof(rsc),
-              DWEET_GET_BASE,
-              name);
+  this->acquire();
+  if( this->attach(60) != 0 )           //  was checkDataConnection(20000), which takes seconds as a uint8_t
+  {
+    this->release();
+    return -2;
+  }
 
-  memset(command_buffer,0,sizeof(command_buffer));
+  //  AT#HTTPCFG=0,<url>,<port>;#HTTPQRY=0,<mode=0>,<resource>, answered by #HTTPRING: 0,<status>,<type>,<size>
+  rsc.appendf_P(DWEET_GET_BASE, name);
+  strcpy_P(cfg, DWEET_CFG);
+  snprintf_P(qry, sizeof(qry), DWEET_QRY, rsc.c_str());
+  strcpy_P(rcv, DWEET_RCV);
 
-  //  AT#HTTPQRY=0,<mode=0>,<resource>
-  snprintf_P( command_buffer,
-              sizeof(command_buffer),
-              table_HTTP[1],
-              0,
-              rsc);
-  this->sendMyCommand(command_buffer);
+  const atCommand query [] =
+  {
+    { cfg, NULL, 2000, NULL, 0 },
+    { qry, NULL, 5000, "#HTTPRING: ", 30000 }
+  };
+  if( this->atRun(query, 2) != AT_OK )
+  {
+    this->dropConnection();             //  the next attach() checks the connection instead of trusting it
+    this->release();
+    return -2;
+  }
 
+  char* comma = strchr(atUrc, ',');
+  char* last = strrchr(atUrc, ',');
+  if( comma == NULL || last == NULL || atoi(comma + 1) != 200 || atol(last + 1) <= 0 )
+  {
+    #if DEBUG_MY4G
+      USB.printf("Dweet answered %s\n", atUrc);
+    #endif
+    this->release();
+    return -3;
+  }
+  uint32_t size = atol(last + 1);
 
-  memset(command_buffer,0,sizeof(command_buffer));
+  //  AT#HTTPRCV=0, answered by "<<<" and <size> bytes of body
+  const atCommand receive [] = { { rcv, "<<<", 10000, NULL, 0 } };
+  bool received = this->atRun(receive, 1) == AT_OK && this->readBody(size, 10000);
+  this->release();
+  if( !received )
+  {
+    return -2;
+  }
 
-  //  AT#HTTPRCV=0
-  strcpy_P(command_buffer,DWEET_RCV);
+  return parseDweetResponse();
+}
 
-  this->sendMyCommand(command_buffer);
+/*
+readBody()
+Reads size bytes of raw data from the modem, such as the body after the "<<<" of AT#HTTPRCV, into _buffer.
+What doesn't fit in _buffer is read and dropped, so the next command doesn't take it for its answer. _buffer
+ends with a 0 either way.
 
-  int8_t response = parseDweetResponse();
+Returns:
+- true if all of it arrived
+- false if the modem went quiet for timeout ms first
+*/
+bool my4G::readBody(uint32_t size, uint32_t timeout)
+{
+  memset(_buffer, 0, sizeof(_buffer));
+  _length = 0;
 
-  return response;
+  uint32_t heard = millis();
+  while( size > 0 )
+  {
+    if( this->serialAvailable(this->_uart) <= 0 )
+    {
+      if( millis() - heard > timeout )
+      {
+        return false;
+      }
+      delay(1);
+      continue;
+    }
 
+    uint8_t c = this->serialRead(this->_uart);
+    if( _length < sizeof(_buffer) - 1 )
+    {
+      _buffer[_length++] = c;
+    }
+    size--;
+    heard = millis();
+  }
+  return true;
 }
 
 int8_t my4G::parseDweetResponse()
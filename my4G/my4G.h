@@ -3,6 +3,8 @@
  
  #include <Wasp4G.h>
  #include "structures.h"
+ #include "serializer.h"
+ #include <strbuf.h>
 /*
 Author: Mitch Nelke
 Date: Thursday, July 26, 2018
@@ -12,7 +14,6 @@ Date: Thursday, July 26, 2018
 TODO:
 - add sendPacket function that sends an array of keyvalues
 - add sendFile function that sends all the data in an entire file
-- add sendRecent function that sends data from file that is new since the last transfer
 
 
 
@@ -36,8 +37,136 @@ onboard SD card and extracted when it is time to send data over 4G.
 #define SMS_CMD_RESET		3
 #define SMS_CMD_SETTIME		4
 #define SMS_CMD_BATTERY		5
+#define SMS_CMD_HISTORY		6
+#define SMS_CMD_SDHEALTH	7
+#define SMS_CMD_NETWORK		8
 
-#define NUM_SMS_CMDS		6
+#define NUM_SMS_CMDS		9
+
+#define FTP_BATCH_SD_SIZE		32		//	longest SD path ftpUploadBatch() can upload, including the null
+#define FTP_BATCH_SERVER_SIZE	64		//	longest server path, including the null
+#define FTP_BATCH_MAX_FAILS		2		//	consecutive failed uploads that end a batch
+#define FTP_BATCH_MIN_MILLIS	5000	//	time the first file of a batch always gets, so a slow login can't starve it
+#define FTP_CHUNK_SIZE			256		//	bytes sent per AT#FTPAPPEXT
+
+//	what the server holds of a file, see ftpRemoteState(). The Telit FTP client can't checksum a remote
+//	file, so only the sizes are compared.
+#define FTP_REMOTE_MISSING		0		//	no such file on the server, or its size couldn't be read
+#define FTP_REMOTE_PARTIAL		1		//	smaller than the local file, an upload broke off
+#define FTP_REMOTE_COMPLETE		2		//	the same size as the local file
+#define FTP_REMOTE_MISMATCH		3		//	larger than the local file, so not a copy of it
+
+//	network registration, see attach(). The modem is powered off between wake cycles, so every session
+//	starts with a fresh attach; caching the operator keeps that attach short.
+#define MY4G_FAST_ATTACH		20			//	seconds to reattach to the cached operator before a full search
+#define MY4G_CACHE_MAGIC		0x4E
+#define MY4G_CACHE_SIZE			16			//	EEPROM bytes of networkCache, see useNetworkCache()
+#define MY4G_ACT_LTE			7			//	AcT of AT+COPS for LTE
+
+
+/*
+The operator, radio access technology and band of the last successful attach, kept in the EEPROM so
+the next attach can go straight to that operator instead of searching every band, see attach().
+*/
+struct networkCache
+{
+	uint8_t magic;			//	MY4G_CACHE_MAGIC
+	uint8_t check;			//	XOR of the other bytes
+	char plmn [7];			//	MCC and MNC of the operator, such as "22801"; empty if there is none
+	uint8_t act;			//	AcT of AT+COPS, MY4G_ACT_LTE for LTE
+	uint8_t band;			//	LTE band of the serving cell, 0 if unknown
+	uint8_t reserved [5];
+};
+
+//	attach statistics since the start of the program, to compare reattaches with full searches
+struct attachStats
+{
+	uint16_t fast;			//	attaches to the cached operator
+	uint16_t full;			//	attaches with a full network search
+	uint16_t failed;		//	attaches that found no network
+	uint32_t fastMillis;	//	total time of the fast attaches
+	uint32_t fullMillis;	//	total time of the full ones
+	uint32_t maxMillis;		//	longest attach
+};
+
+
+/*
+Callbacks of an FTP batch upload, see ftpUploadBatch().
+
+ftpNextFile fills in the SD path, server path and size in bytes of the next file to upload, and
+the offset a previous attempt got to (0 if none), and returns true, or returns false once there
+are no files left. ftpFileProgress reports the offset an upload has reached after every chunk, so
+it can be kept for resuming. ftpFileDone is called after every upload
+with the error code of ftpUploadResume(), 0 if the file is on the server.
+*/
+typedef bool (*ftpNextFile)(	void* context,
+								char* sdPath, uint8_t sdSize,
+								char* serverPath, uint8_t serverSize,
+								uint32_t* fileSize,
+								uint32_t* resumeFrom);
+typedef void (*ftpFileProgress)(void* context, uint32_t offset);
+typedef void (*ftpFileDone)(void* context, uint8_t error);
+
+/*
+A step of a command chain run by atRun(). Steps that only wait for "OK" are joined with ';' on one
+command line, so the modem answers them together with a single final result; a step that waits for
+another final result or an URC ends the line. Every step brings its own deadline, and a line waits
+for the sum of the deadlines of its steps.
+*/
+#define AT_LINE_SIZE	128		//	longest command line of a chain, including "AT", the ';'s and '\r'
+#define AT_URC_SIZE		48		//	longest parameter list of an URC kept in atUrc
+
+#define AT_OK			0		//	results of atRun()
+#define AT_ERROR		1		//	the modem answered ERROR or +CME ERROR
+#define AT_TIMEOUT		2		//	no final result before the deadline
+#define AT_NO_URC		3		//	the URC didn't arrive before its deadline
+#define AT_TOO_LONG		4		//	a step doesn't fit on a command line
+
+struct atCommand
+{
+	const char* text;		//	the command without "AT", such as "#HTTPRCV=0"
+	const char* ok;			//	final result that means success, NULL for "OK"
+	uint16_t timeout;		//	ms to wait for the final result
+	const char* urc;		//	URC to wait for after the final result, such as "#HTTPRING: ", or NULL
+	uint16_t urcTimeout;	//	ms to wait for the URC
+};
+
+/*
+Timing of a modem session, from the power-up of the modem to its power-down, see my4G::acquire().
+Every user of the modem in a session past the first is a power-up and network registration saved.
+*/
+struct modemSession
+{
+	uint32_t started;		//	millis() at the power-up
+	uint32_t onMillis;		//	time the modem was powered, set at the power-down
+	uint32_t attachMillis;	//	time spent waiting for the data connection
+	uint8_t users;			//	acquire() calls served by this power-up
+	uint8_t attaches;		//	data connections set up, 1 unless the connection was lost
+};
+
+//	totals of every session since the start of the program
+struct modemSessionTotals
+{
+	uint16_t sessions;
+	uint16_t users;
+	uint32_t onMillis;
+	uint32_t attachMillis;
+};
+
+
+struct ftpBatch
+{
+	ftpNextFile next;
+	ftpFileProgress progress;	//	may be NULL
+	ftpFileDone done;
+	void* context;			//	passed to all callbacks
+	uint32_t maxBytes;		//	the batch stops once it has sent this many bytes...
+	uint32_t maxMillis;		//	...or once this much time has passed, even in the middle of a file
+	uint32_t started;		//	millis() maxMillis counts from, 0 for the call of ftpUploadBatch()
+	uint16_t sent;			//	set by ftpUploadBatch(): files uploaded
+	uint16_t failed;		//	files that failed to upload
+	uint32_t bytes;			//	bytes uploaded
+};
 
 
 
@@ -55,21 +184,66 @@ public:
 			char* login,		//	apn login
 			char* password);	//	apn password
 
+/*
+Modem session
+Network work in a wake cycle shares one power-up of the modem and one data connection. Every user of
+the modem calls acquire() before and release() after its work; the modem is powered by the first
+acquire() and turned off once the last user released it. beginSession() reserves the modem for the
+rest of the cycle without powering it, so the users in between share the power-up, and endSession()
+tears it down. attach() sets up the data connection once per session.
+*/
+	uint8_t acquire();
+
+	void release();
+
+	void beginSession();
+
+	void endSession();
+
+	uint8_t attach(uint8_t seconds);
+
+	void dropConnection();
+
+/*
+Network cache
+Loads the cached operator from the EEPROM at eepromAddress, where attach() keeps it up to date. Without
+it every attach is a full search.
+*/
+	void useNetworkCache(uint16_t eepromAddress);
+
+	networkCache network;
+	attachStats attachTotals;
+
+	modemSession session;				//	the current or last session
+	modemSessionTotals sessionTotals;
+	uint32_t sessionBegan;				//	millis() at beginSession(), 0 outside of a session
+
 /*
 SendCommand()
 Takes a command character array/string literal and a couple desired answers and sends them to
 the SIM card. This only works with AT commands in the style of "AT+CREG?" or "AT+CREG=0". More
 information on how to use this function is available in the documentation.
 */
-	uint8_t sendMyCommand(	char*);
+	uint8_t sendMyCommand(	const char*);
+
+	uint8_t sendMyCommand(	const char*,
+							const char*);
 
-	uint8_t sendMyCommand(	char*,
-							char*);
+	uint8_t sendMyCommand(	const char*,	// AT command to send to SIM
+							const char*, 	// Desired answer 1, wi,ll return 1 if this is the response
+							const char*); 	// Desired answer 2, will return 2 if this is the response
 
-	uint8_t sendMyCommand(	char*,	// AT command to send to SIM
-							char*, 	// Desired answer 1, wi,ll return 1 if this is the response
-							char*); 	// Desired answer 2, will return 2 if this is the response
 
+/*
+AT engine
+Runs a chain of commands, see atCommand, and stops at the first one that fails. The parameters of the
+last URC waited for are kept in atUrc, and the index of the failed step in atFailed.
+*/
+	uint8_t atRun(	const atCommand* chain,
+					uint8_t count);
+
+	char atUrc [AT_URC_SIZE];
+	uint8_t atFailed;
 
 /*
 Takes a host url, a port, a resource string, and an array of keyvalue objects and "Dweets" them.
@@ -81,10 +255,24 @@ Not really useful for bulk data but nice as a demo and could be reused for other
 						keyvalue* data,        // array of keyvalue pointers.
 						uint8_t numPairs);	   // number of pairs in the data array
 
+	uint8_t sendDweet(  uint16_t port,
+						char* name,
+						uint8_t size,
+						const kvSource* data); // keyvalues or fields formatted by a callback
+
+/*
+Posts keyvalues or formatted fields as a form-encoded body, streamed straight into the modem's UART.
+*/
+	uint8_t httpPostKeyvalues(	const char* host,
+								uint16_t port,
+								const char* resource,
+								const kvSource* data);
+
 
 /*
 Post FTP
-Takes ftp settings, the filename stored on the SD card, and the server file to post to. Then sends it over.
+Takes ftp settings, the filename stored on the SD card, and the server file to post to. Then sends it over,
+unless the server already has a file of the same size.
 */
 
 	uint8_t postFTP(	char* ftp_server,
@@ -94,6 +282,46 @@ Takes ftp settings, the filename stored on the SD card, and the server file to p
 						char* SD_filename,
 						char* serverFile);
 
+/*
+FTP Remote State
+Compares the size of a file on the server with that of the local copy, so an upload that already
+succeeded isn't repeated and one that broke off can be resumed. Needs an open FTP session.
+*/
+
+	uint8_t ftpRemoteState(	char* serverPath,
+							uint32_t localSize,
+							uint32_t* remoteSize);
+
+/*
+FTP Upload Resume
+Uploads a file from the SD in chunks, continuing a partial upload on the server from the size the
+server reports, and skipping the upload if the server already has the whole file. Falls back to
+uploading the whole file if the server can't append. With a length, only that many bytes of the
+file are uploaded, for files that are still growing. With maxBytes or maxMillis the upload stops
+early once it has sent that much or taken that long, to be resumed later.
+*/
+
+	uint8_t ftpUploadResume(	char* serverPath,
+								char* sdPath,
+								uint32_t offset,
+								ftpFileProgress progress,
+								void* context,
+								uint32_t length = 0,
+								uint32_t maxBytes = 0,
+								uint32_t maxMillis = 0);
+
+/*
+FTP Upload Batch
+Uploads every file the batch's next callback hands out in a single FTP session, so the modem is
+powered, attached and logged in only once for the whole list.
+*/
+
+	uint8_t ftpUploadBatch(	char* ftp_server,
+							uint16_t ftp_port,
+							char* ftp_user,
+							char* ftp_pass,
+							ftpBatch* batch);
+
 	void serialCommandMode();
 
 	//int8_t readSMSCommand();
@@ -104,7 +332,28 @@ Takes ftp settings, the filename stored on the SD card, and the server file to p
 
 	int8_t parseDweetResponse();
 
+private:
+
+	uint8_t _users;			//	acquire() calls not released yet
+	bool _powered;			//	the modem is on
+	bool _attached;			//	the data connection is up in this session
+	uint16_t _cacheAddress;	//	EEPROM address of network, 0 if it isn't kept
+
+	bool readBody(uint32_t size, uint32_t timeout);
+
+	void rememberNetwork();
+
+	void saveNetwork();
+
 };
 
+/*
+kvField callback that formats the attach statistics and the cached network of the my4G object passed as
+context, for a NETWORK dweet. There are NETWORK_FIELDS fields.
+*/
+#define NETWORK_FIELDS	10
+
+void networkField(const void* context, uint8_t index, strbuf* key, strbuf* val);
+
 #endif
 
@@ -0,0 +1,302 @@
+/*
+serializer.cpp
+See serializer.h for a description of the encodings and sinks.
+*/
+
+#ifndef __WPROGRAM_H__
+#include "WaspClasses.h"
+#endif
+
+#include <Wasp4G.h>
+#include "serializer.h"
+
+
+uint16_t crc16(const uint8_t* data, uint16_t len, uint16_t crc)
+{
+  while( len-- )
+  {
+    crc ^= (uint16_t) *data++ << 8;
+    for(uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = ( crc & 0x8000 ) ? ( crc << 1 ) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+
+/**************************************************************************************************************
+kvSink
+Base of all sinks. write() keeps the byte count and CRC and hands the bytes to the sink's put().
+***************************************************************************************************************/
+
+kvSink::kvSink()
+{
+  reset();
+}
+
+void kvSink::reset()
+{
+  len = 0;
+  crc = 0xFFFF;
+  failed = false;
+}
+
+bool kvSink::write(const uint8_t* data, uint16_t size)
+{
+  if( failed || !put(data, size) )
+  {
+    failed = true;
+    return false;
+  }
+  len += size;
+  crc = crc16(data, size, crc);
+  return true;
+}
+
+bool kvSink::print(const char* str)
+{
+  return write((const uint8_t*) str, strlen(str));
+}
+
+bool kvSink::print(char c)
+{
+  return write((const uint8_t*) &c, 1);
+}
+
+bool kvSink::print(uint32_t number)
+{
+  char digits [11];
+  snprintf(digits, sizeof(digits), "%lu", (unsigned long) number);
+  return print(digits);
+}
+
+
+ramSink::ramSink(uint8_t* buffer, uint16_t size)
+{
+  this->buffer = buffer;
+  this->size = size;
+}
+
+bool ramSink::put(const uint8_t* data, uint16_t size)
+{
+  if( len + size > this->size )                           //  would overflow the buffer
+  {
+    return false;
+  }
+  memcpy(buffer + len, data, size);
+  return true;
+}
+
+
+fileSink::fileSink(SdFile* file)
+{
+  this->file = file;
+}
+
+bool fileSink::put(const uint8_t* data, uint16_t size)
+{
+  return file->write(data, size) == size;
+}
+
+
+uartSink::uartSink(Wasp4G* modem)
+{
+  this->modem = modem;
+}
+
+bool uartSink::put(const uint8_t* data, uint16_t size)
+{
+  for(uint16_t i = 0; i < size; i++)
+  {
+    modem->printByte(data[i], modem->_uart);
+  }
+  return true;
+}
+
+
+bool countSink::put(const uint8_t* /* data */, uint16_t /* size */)
+{
+  return true;
+}
+
+
+/**************************************************************************************************************
+writeEscaped()
+Writes a string in URL query encoding: letters, digits and "-_.~" as they are, spaces as '+', and everything
+else as "%XX".
+***************************************************************************************************************/
+
+static bool writeEscaped(kvSink* sink, const char* str, uint8_t size)
+{
+  for(uint8_t i = 0; i < size && str[i] != 0; i++)
+  {
+    char c = str[i];
+    if( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' ) ||
+        c == '-' || c == '_' || c == '.' || c == '~' )
+    {
+      sink->print(c);
+    }
+    else if( c == ' ' )
+    {
+      sink->print('+');
+    }
+    else
+    {
+      char escaped [4];
+      snprintf(escaped, sizeof(escaped), "%%%02X", (uint8_t) c);
+      sink->print(escaped);
+    }
+  }
+  return !sink->failed;
+}
+
+/*
+writeField()
+Writes a key or value string, which isn't terminated when it fills the whole array.
+*/
+static bool writeField(kvSink* sink, const char* str, uint8_t size)
+{
+  uint8_t len = 0;
+  while( len < size && str[len] != 0 )
+  {
+    len++;
+  }
+  return sink->write((const uint8_t*) str, len);
+}
+
+
+/*
+writePair()
+Writes one key and value in a text encoding, with the separator that goes in front of it.
+*/
+static bool writePair(	kvSink* sink,
+						const char* key, uint8_t keySize,
+						const char* val, uint8_t valSize,
+						uint8_t pair,
+						uint8_t encoding)
+{
+  switch(encoding)
+  {
+    case(KV_CSV):
+      if( pair > 0 )
+      {
+        sink->print(',');                                //  commas between pairs
+      }
+      writeField(sink, key, keySize);
+      sink->print('=');
+      writeField(sink, val, valSize);
+      break;
+
+    case(KV_QUERY):
+      if( pair > 0 )
+      {
+        sink->print('&');
+      }
+      writeEscaped(sink, key, keySize);
+      sink->print('=');
+      writeEscaped(sink, val, valSize);
+      break;
+
+    default:
+      return false;
+  }
+  return !sink->failed;
+}
+
+/*
+endPairs()
+Writes whatever the encoding puts after the last pair.
+*/
+static bool endPairs(kvSink* sink, uint8_t encoding)
+{
+  if( encoding == KV_CSV )
+  {
+    sink->print(';');                                    //  a semicolon ends the cycle
+  }
+  return !sink->failed;
+}
+
+
+uint8_t serializeKeyvalues(	kvSink* sink,
+							const keyvalue* data,
+							uint8_t numPairs,
+							uint8_t encoding,
+							kvPack pack)
+{
+  if( encoding == KV_BINARY )
+  {
+    if( pack == NULL )
+    {
+      return 2;
+    }
+    for(uint8_t pair = 0; pair < numPairs; pair++)
+    {
+      if( !pack(sink, data, pair) || sink->failed )
+      {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if( encoding != KV_CSV && encoding != KV_QUERY )
+  {
+    return 2;
+  }
+
+  for(uint8_t pair = 0; pair < numPairs; pair++)
+  {
+    if( !writePair( sink,
+                    data[pair].key, sizeof(data[pair].key),
+                    data[pair].val, sizeof(data[pair].val),
+                    pair,
+                    encoding) )
+    {
+      return 1;
+    }
+  }
+  return endPairs(sink, encoding) ? 0 : 1;
+}
+
+
+uint8_t serializeFields(	kvSink* sink,
+							const void* context,
+							kvField field,
+							uint8_t numFields,
+							uint8_t encoding)
+{
+  if( ( encoding != KV_CSV && encoding != KV_QUERY ) || field == NULL )
+  {
+    return 2;
+  }
+
+  fixedStr<keyvalue::KEYVAL_STRING_SIZE> key;
+  fixedStr<keyvalue::KEYVAL_STRING_SIZE> val;
+  for(uint8_t i = 0; i < numFields; i++)
+  {
+    key.clear();
+    val.clear();
+    field(context, i, &key, &val);
+
+    if( !writePair( sink,
+                    key.c_str(), key.length(),
+                    val.c_str(), val.length(),
+                    i,
+                    encoding) )
+    {
+      return 1;
+    }
+  }
+  return endPairs(sink, encoding) ? 0 : 1;
+}
+
+
+uint8_t serializeSource(kvSink* sink, const kvSource* source, uint8_t encoding)
+{
+  if( source->pairs != NULL )
+  {
+    return serializeKeyvalues(sink, source->pairs, source->count, encoding);
+  }
+  return serializeFields(sink, source->context, source->field, source->count, encoding);
+}
@@ -0,0 +1,151 @@
+#ifndef SERIALIZER_H
+#define SERIALIZER_H
+
+#ifndef __WPROGRAM_H__
+#include "WaspClasses.h"
+#endif
+#include "structures.h"
+#include <strbuf.h>
+/*
+serializer.h
+
+Streams an array of keyvalue objects, or fields formatted one at a time by a kvField callback,
+straight into a sink in one of a few encodings, so callers don't have to build the whole string in a
+stack buffer first. Every sink counts the bytes written to it and
+keeps a running CRC-16 of them, which the data log uses for its journal records.
+
+Encodings:
+- KV_CSV:		"key=val,key=val;" as in the text data log
+- KV_QUERY:		"key=val&key=val" with URL escaping, for HTTP posts
+- KV_BINARY:	values only, each written by a kvPack callback supplied by the caller
+
+Sinks:
+- ramSink:		a fixed RAM buffer, fails instead of overflowing
+- fileSink:		an open SdFile
+- uartSink:		the modem's UART, for data that follows an AT command prompt
+- countSink:	discards the data, used to measure a payload before sending it
+*/
+
+#define KV_CSV		0
+#define KV_QUERY	1
+#define KV_BINARY	2
+
+/*
+crc16()
+CRC-16/CCITT (polynomial 0x1021) of a block of bytes. Pass 0xFFFF as crc to start a new checksum, or the
+result of a previous call to continue one.
+*/
+uint16_t crc16(const uint8_t* data, uint16_t len, uint16_t crc);
+
+
+class kvSink
+{
+public:
+	uint32_t len;			//	bytes written since the last reset()
+	uint16_t crc;			//	CRC-16 of those bytes
+	bool failed;			//	set once a write fails, later writes are ignored
+
+	kvSink();
+
+	void reset();
+
+	bool write(const uint8_t* data, uint16_t size);
+	bool print(const char* str);
+	bool print(char c);
+	bool print(uint32_t number);
+
+protected:
+	~kvSink() {}			//	sinks are never deleted through a kvSink*, so no virtual destructor
+	virtual bool put(const uint8_t* data, uint16_t size) = 0;
+};
+
+
+class ramSink : public kvSink
+{
+public:
+	ramSink(uint8_t* buffer, uint16_t size);
+	uint8_t* buffer;
+	uint16_t size;
+
+protected:
+	bool put(const uint8_t* data, uint16_t size);
+};
+
+
+class fileSink : public kvSink
+{
+public:
+	fileSink(SdFile* file);
+	SdFile* file;
+
+protected:
+	bool put(const uint8_t* data, uint16_t size);
+};
+
+
+class Wasp4G;
+
+class uartSink : public kvSink
+{
+public:
+	uartSink(Wasp4G* modem);
+	Wasp4G* modem;
+
+protected:
+	bool put(const uint8_t* data, uint16_t size);
+};
+
+
+class countSink : public kvSink
+{
+protected:
+	bool put(const uint8_t* data, uint16_t size);
+};
+
+
+//	writes the value of data[index] in KV_BINARY encoding. Returning false stops the serializer.
+typedef bool (*kvPack)(kvSink* sink, const keyvalue* data, uint8_t index);
+
+/*
+serializeKeyvalues()
+Writes numPairs keyvalues to the sink in the given encoding. KV_BINARY needs a pack callback.
+
+Returns:
+- 0 if everything was written
+- 1 if the sink failed, such as a full ramSink
+- 2 if the encoding is unknown or KV_BINARY has no pack callback
+*/
+uint8_t serializeKeyvalues(	kvSink* sink,
+							const keyvalue* data,
+							uint8_t numPairs,
+							uint8_t encoding,
+							kvPack pack = NULL);
+
+//	formats field index of context into key and val, for data that isn't kept as keyvalue strings. Both
+//	hold up to keyvalue::KEYVAL_STRING_SIZE - 1 characters.
+typedef void (*kvField)(const void* context, uint8_t index, strbuf* key, strbuf* val);
+
+/*
+serializeFields()
+Like serializeKeyvalues, but every field is formatted by the field callback just before it is written,
+so only one key and value string exist at a time. Only KV_CSV and KV_QUERY are supported.
+*/
+uint8_t serializeFields(	kvSink* sink,
+							const void* context,
+							kvField field,
+							uint8_t numFields,
+							uint8_t encoding);
+
+
+//	either an array of keyvalues or a kvField callback with its context, for functions that take both
+struct kvSource
+{
+	const keyvalue* pairs;			//	NULL to use field
+	const void* context;
+	kvField field;
+	uint8_t count;
+};
+
+uint8_t serializeSource(kvSink* sink, const kvSource* source, uint8_t encoding);
+
+#endif
@@ -0,0 +1,261 @@
+/******************************************************************************************
+
+STRBUF.CPP
+
+See strbuf.h for a description of the buffer.
+
+******************************************************************************************/
+
+#include "strbuf.h"
+
+//	stands in for an array without room for the terminator, so every append fails instead of overflowing
+static char noRoom [1];
+
+strbuf::strbuf(char* buffer, uint8_t capacity)
+{
+	_buf = ( capacity > 0 ) ? buffer : noRoom;
+	_cap = ( capacity > 0 ) ? capacity : 1;
+	clear();
+}
+
+strbuf::strbuf(char* buffer, uint8_t capacity, bool keep)
+{
+	_buf = ( capacity > 0 ) ? buffer : noRoom;
+	_cap = ( capacity > 0 ) ? capacity : 1;
+	_len = 0;
+	if( !keep )
+	{
+		clear();
+		return;
+	}
+
+	while( _len < _cap - 1 && _buf[_len] != 0 )		//	the only time the string is measured
+	{
+		_len++;
+	}
+	_buf[_len] = 0;
+}
+
+void strbuf::clear()
+{
+	_len = 0;
+	_buf[0] = 0;
+}
+
+bool strbuf::append(char c)
+{
+	if( space() == 0 )
+	{
+		return false;
+	}
+	_buf[_len++] = c;
+	_buf[_len] = 0;
+	return true;
+}
+
+bool strbuf::append(const char* str)
+{
+	return append(str, 0xFF);
+}
+
+bool strbuf::append(const char* str, uint8_t n)
+{
+	uint8_t i = 0;
+	while( i < n && str[i] != 0 )
+	{
+		if( space() == 0 )
+		{
+			return false;
+		}
+		_buf[_len++] = str[i++];
+	}
+	_buf[_len] = 0;
+	return true;
+}
+
+bool strbuf::append_P(const char* str)
+{
+	char c = pgm_read_byte(str);
+	while( c != 0 )
+	{
+		if( !append(c) )
+		{
+			return false;
+		}
+		c = pgm_read_byte(++str);
+	}
+	return true;
+}
+
+bool strbuf::appendf(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(_buf + _len, _cap - _len, format, args);
+	va_end(args);
+
+	if( n < 0 )
+	{
+		_buf[_len] = 0;
+		return false;
+	}
+	if( n > space() )									//	vsnprintf stopped at the end of the array
+	{
+		_len = _cap - 1;
+		return false;
+	}
+	_len += n;
+	return true;
+}
+
+bool strbuf::appendf_P(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf_P(_buf + _len, _cap - _len, format, args);
+	va_end(args);
+
+	if( n < 0 )
+	{
+		_buf[_len] = 0;
+		return false;
+	}
+	if( n > space() )
+	{
+		_len = _cap - 1;
+		return false;
+	}
+	_len += n;
+	return true;
+}
+
+void strbuf::trimLeft()
+{
+	uint8_t start = 0;
+	while( start < _len && ( _buf[start] == ' ' || _buf[start] == '\t' || _buf[start] == '\n' ) )
+	{
+		start++;
+	}
+	if( start == 0 )
+	{
+		return;
+	}
+	_len -= start;
+	memmove(_buf, _buf + start, _len + 1);				//	moves the terminator too
+}
+
+void strbuf::truncate(uint8_t len)
+{
+	if( len < _len )
+	{
+		_len = len;
+		_buf[_len] = 0;
+	}
+}
+
+bool strbuf::copyTo(char* array, uint8_t size) const
+{
+	memset(array, 0, size);
+	if( size <= _len )
+	{
+		return false;
+	}
+	memcpy(array, _buf, _len);
+	return true;
+}
+
+bool strbuf::appendScaled(int32_t value, uint8_t decimals)
+{
+	char digits [12];									//	the digits of value, least significant first
+	uint8_t n = 0;
+	bool negative = value < 0;
+	uint32_t magnitude = negative ? -(uint32_t) value : value;
+
+	do
+	{
+		digits[n++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	}	while( ( magnitude != 0 || n <= decimals ) && n < sizeof(digits) );	//	at least one digit before the point
+
+	bool fits = !negative || append('-');
+	while( n > 0 )
+	{
+		if( n == decimals )
+		{
+			fits = fits && append('.');
+		}
+		fits = fits && append(digits[--n]);
+	}
+	return fits;
+}
+
+/******************************************************************************************
+
+PARSE SCALED
+
+Converts a decimal string such as " -12.345" into an integer scaled by 10^decimals, without going through a
+float. Leading whitespace is skipped and decimal places beyond the requested number are truncated.
+
+Parameters:
+- const char* str: the string to convert
+- uint8_t decimals: number of decimal places to keep
+- int32_t* out: where the scaled value is stored
+Returns:
+- true if the string held a number
+- false if the string was empty or didn't start with a number
+
+******************************************************************************************/
+
+bool parseScaled(const char* str, uint8_t decimals, int32_t* out)
+{
+	while( *str == ' ' || *str == '\t' )          //  skip the padding dtostrf puts in front
+	{
+		str++;
+	}
+
+	bool negative = false;
+	if( *str == '-' || *str == '+' )
+	{
+		negative = ( *str == '-' );
+		str++;
+	}
+
+	int32_t value = 0;
+	bool digits = false;
+	while( *str >= '0' && *str <= '9' )           //  integer part
+	{
+		value = value * 10 + ( *str - '0' );
+		digits = true;
+		str++;
+	}
+
+	uint8_t places = 0;
+	if( *str == '.' )                             //  fractional part, up to the requested number of places
+	{
+		str++;
+		while( *str >= '0' && *str <= '9' )
+		{
+			if( places < decimals )
+			{
+				value = value * 10 + ( *str - '0' );
+				places++;
+			}
+			digits = true;
+			str++;
+		}
+	}
+
+	if( !digits )
+	{
+		return false;
+	}
+
+	while( places < decimals )                    //  pad out missing decimal places
+	{
+		value *= 10;
+		places++;
+	}
+
+	*out = negative ? -value : value;
+	return true;
+}
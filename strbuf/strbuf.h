@@ -0,0 +1,81 @@
+#ifndef STRBUF_H
+#define STRBUF_H
+
+/******************************************************************************************
+
+STRBUF.H
+
+A character array that keeps track of its own length, so appending to it never has to
+scan for the null terminator again and can never overflow. strbuf works on an array that
+is owned by someone else, such as the val of a keyvalue, while fixedStr<N> brings its own
+N-byte array. The contents are always null terminated, so c_str() can be handed to any
+function that expects a plain string.
+
+Appends that don't fit copy as much as fits and return false, so a chain of appends can be
+checked once at the end. A capacity of 0 leaves no room even for the terminator, so such a
+buffer stays empty and every append fails. appendScaled() and parseScaled() convert between fixed-point
+integers and decimal strings without the float formatting functions.
+
+******************************************************************************************/
+
+#ifndef __WPROGRAM_H__
+#include "WaspClasses.h"
+#endif
+
+class strbuf
+{
+public:
+	strbuf(char* buffer, uint8_t capacity);				//	wraps buffer and empties it
+	strbuf(char* buffer, uint8_t capacity, bool keep);	//	keep = true keeps the string already in buffer
+
+	void clear();
+
+	uint8_t length() const			{ return _len; }
+	uint8_t capacity() const		{ return _cap; }		//	including the null terminator
+	uint8_t space() const			{ return _cap - 1 - _len; }
+	const char* c_str() const		{ return _buf; }
+	char operator[](uint8_t i) const	{ return i < _len ? _buf[i] : 0; }
+
+	bool append(char c);
+	bool append(const char* str);
+	bool append(const char* str, uint8_t n);		//	at most n characters of str
+	bool append_P(const char* str);					//	str in PROGMEM
+	bool appendf(const char* format, ...);
+	bool appendf_P(const char* format, ...);		//	format in PROGMEM
+	bool appendScaled(int32_t value, uint8_t decimals);	//	value / 10^decimals, such as "-12.345"
+
+	void trimLeft();								//	removes leading spaces, tabs and line breaks
+	void truncate(uint8_t len);
+
+	bool copyTo(char* array, uint8_t size) const;	//	copies the string into array if it fits
+
+protected:
+	char* _buf;
+	uint8_t _cap;
+	uint8_t _len;
+
+private:
+	strbuf(const strbuf&);							//	a copy would share the array
+	strbuf& operator=(const strbuf&);
+};
+
+
+/*
+parseScaled()
+The reverse of appendScaled: converts a decimal string such as " -12.345" into an integer scaled
+by 10^decimals, without going through a float.
+*/
+bool parseScaled(const char* str, uint8_t decimals, int32_t* out);
+
+
+template <uint8_t N>
+class fixedStr : public strbuf
+{
+public:
+	fixedStr() : strbuf(_data, N) {}
+
+private:
+	char _data [N];
+};
+
+#endif
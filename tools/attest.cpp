@@ -0,0 +1,215 @@
+/*
+attest.cpp
+Drives the AT engine of the my4G library (my4G::atRun) and the dweet command fetch built on it
+(my4G::receiveDweetCommand) against a modem stand-in, on the host instead of a Waspmote with a real modem:
+
+  g++ -Itools/hostwasp -Imy4G -Istrbuf -o attest tools/attest.cpp tools/hostwasp/hostwasp.cpp \
+      my4G/my4G.cpp my4G/serializer.cpp strbuf/strbuf.cpp
+  ./attest
+
+Every check prints one line. The exit code is 0 if all of them passed, 1 otherwise. Run with
+HOSTWASP_VERBOSE=1 to see the library's own debug output.
+*/
+
+#include <string>
+#include <vector>
+#include "hostwasp.h"
+#include "my4G.h"
+
+
+/*
+atModem
+Keeps every command line it gets and answers "OK", or "ERROR" to a line containing failOn. A line with
+#HTTPQRY is followed by the #HTTPRING of an answer of body, unless ring is off, and AT#HTTPRCV sends the
+"<<<" prompt, the body and the final "OK". The #HTTPRING reports size, the body's own length unless set.
+*/
+class atModem : public hostModem
+{
+public:
+  std::vector<std::string> lines;
+  std::string failOn;
+  std::string body;
+  long size;
+  bool ring;
+
+  atModem() : size(-1), ring(true) {}
+
+  virtual void command(const char* line)
+  {
+    lines.push_back(line);
+    if( !failOn.empty() && strstr(line, failOn.c_str()) != NULL )
+    {
+      this->reply("\r\nERROR\r\n");
+      return;
+    }
+
+    char text [64];
+    if( strstr(line, "#HTTPQRY") != NULL )
+    {
+      this->reply("\r\nOK\r\n");
+      if( ring )
+      {
+        snprintf(text, sizeof(text), "\r\n#HTTPRING: 0,200,\"text/plain\",%ld\r\n",
+                 size >= 0 ? size : (long) body.size());
+        this->reply(text);
+      }
+    }
+    else if( strcmp(line, "AT#HTTPRCV=0") == 0 )
+    {
+      this->reply("\r\n<<<");
+      this->reply((const uint8_t*) body.data(), body.size());
+      this->reply("\r\nOK\r\n");
+    }
+    else if( strcmp(line, "AT+COPS?") == 0 )
+    {
+      this->reply("\r\n+COPS: 0,2,\"23410\",7\r\n\r\nOK\r\n");
+    }
+    else
+    {
+      this->reply("\r\nOK\r\n");
+    }
+  }
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  failures += !ok;
+}
+
+//  the steps of a chain of count commands, text[i] holding the i-th
+static void makeChain(atCommand* chain, char text [][40], uint8_t count)
+{
+  for(uint8_t i = 0; i < count; i++)
+  {
+    snprintf(text[i], sizeof(text[i]), "+CGDCONT=%u,\"IP\",\"internet.example\"", i + 1);
+    atCommand step = { text[i], NULL, 1000, NULL, 0 };
+    chain[i] = step;
+  }
+}
+
+
+/*
+checkChain()
+Steps that wait for "OK" are joined on as few lines as fit into AT_LINE_SIZE, in order, and a step that
+waits for another answer ends its line.
+*/
+static void checkChain(my4G* modem)
+{
+  atModem at;
+  hostUseModem(&at);
+
+  char text [12][40];
+  atCommand chain [12];
+  makeChain(chain, text, 12);
+  check(modem->atRun(chain, 12) == AT_OK, "long chain succeeded");
+
+  std::string joined;
+  bool fits = true;
+  for(size_t i = 0; i < at.lines.size(); i++)
+  {
+    fits = fits && at.lines[i].size() + 1 < AT_LINE_SIZE && at.lines[i].compare(0, 2, "AT") == 0;
+    joined += ( i == 0 ? "" : ";" ) + at.lines[i].substr(2);
+  }
+  std::string expected;
+  for(uint8_t i = 0; i < 12; i++)
+  {
+    expected += ( i == 0 ? "" : ";" ) + std::string(text[i]);
+  }
+  size_t perLine = ( AT_LINE_SIZE - 3 ) / ( strlen(text[0]) + 1 );
+  check(fits && joined == expected, "long chain split at AT_LINE_SIZE, every step once and in order");
+  check(at.lines.size() == ( 12 + perLine - 1 ) / perLine, "as few lines as fit");
+
+  at.lines.clear();
+  chain[1].ok = "OK";
+  modem->atRun(chain, 3);
+  check(at.lines.size() == 2 && at.lines[0] == "AT" + std::string(text[0]) + ";" + text[1],
+        "a step with its own answer ends its line");
+}
+
+
+/*
+checkFailures()
+A step too long for a line is refused before anything is sent, and an ERROR names the last step of its line.
+*/
+static void checkFailures(my4G* modem)
+{
+  atModem at;
+  hostUseModem(&at);
+
+  char text [3][40];
+  atCommand chain [3];
+  makeChain(chain, text, 3);
+  std::string huge(AT_LINE_SIZE, 'X');
+  chain[0].text = huge.c_str();
+  check(modem->atRun(chain, 3) == AT_TOO_LONG && modem->atFailed == 0 && at.lines.empty(),
+        "step longer than a line refused");
+
+  makeChain(chain, text, 3);
+  chain[0].ok = "OK";
+  at.failOn = "=2,";
+  check(modem->atRun(chain, 3) == AT_ERROR && modem->atFailed == 2 && at.lines.size() == 2,
+        "ERROR reported with the last step of its line");
+}
+
+
+/*
+checkUrc()
+The parameters of an awaited URC end up in atUrc, and an URC that doesn't come is reported.
+*/
+static void checkUrc(my4G* modem)
+{
+  atModem at;
+  hostUseModem(&at);
+  at.body = "0123456789";
+
+  char qry [] = "#HTTPQRY=0,0,\"/get\"";
+  atCommand chain [] = { { qry, NULL, 5000, "#HTTPRING: ", 30000 } };
+  check(modem->atRun(chain, 1) == AT_OK && strcmp(modem->atUrc, "0,200,\"text/plain\",10") == 0,
+        "URC parameters kept in atUrc");
+
+  at.ring = false;
+  uint32_t before = millis();
+  check(modem->atRun(chain, 1) == AT_NO_URC && millis() - before >= 30000, "missing URC reported at its deadline");
+}
+
+
+/*
+checkDweet()
+receiveDweetCommand() reads exactly the body #HTTPRING announced after the "<<<" prompt, keeps what fits in
+_buffer and leaves the final OK for the next command.
+*/
+static void checkDweet(my4G* modem)
+{
+  atModem at;
+  hostUseModem(&at);
+  char name [] = "probe";
+
+  at.body = "{\"with\":[{\"content\":{\"cmd\":\"$NETWORK!\"}}]}";
+  check(modem->receiveDweetCommand(name) == 8, "command found in the body");
+  check(modem->_length == at.body.size() && at.available() == 6, "body read to its size, final OK left");
+
+  at.body = "{\"cmd\":\"$TIME!\"," + std::string(1000, 'x') + "}";
+  check(modem->receiveDweetCommand(name) == 1, "command found in a body larger than the buffer");
+  check(modem->_length == sizeof(modem->_buffer) - 1 && modem->_buffer[modem->_length] == 0 &&
+        at.available() == 6, "large body clamped to the buffer and read to its end");
+
+  at.size = at.body.size() + 100;
+  uint32_t before = millis();
+  check(modem->receiveDweetCommand(name) == -2 && millis() - before < 60000, "short body reported");
+}
+
+
+int main()
+{
+  my4G modem((char*) "apn", (char*) "", (char*) "");
+  checkChain(&modem);
+  checkFailures(&modem);
+  checkUrc(&modem);
+  checkDweet(&modem);
+
+  printf("%d failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}
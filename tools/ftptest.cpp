@@ -0,0 +1,433 @@
+/*
+ftptest.cpp
+Drives the resumable FTP upload of the my4G library (my4G::ftpUploadResume and ftpUploadBatch) against an
+FTP server stand-in that drops the connection at scripted points, on the host instead of a Waspmote with a
+real modem:
+
+  g++ -Itools/hostwasp -Imy4G -Istrbuf -o ftptest tools/ftptest.cpp tools/hostwasp/hostwasp.cpp \
+      my4G/my4G.cpp my4G/serializer.cpp strbuf/strbuf.cpp
+  ./ftptest
+
+Every check prints one line. The exit code is 0 if all of them passed, 1 otherwise. Run with
+HOSTWASP_VERBOSE=1 to see the library's own debug output.
+*/
+
+#include <map>
+#include <string>
+#include <unistd.h>
+#include "hostwasp.h"
+#include "my4G.h"
+
+#define FILE_SIZE         3000                  //  size of the test files, a bit under 12 chunks
+
+
+/*
+ftpServer
+The FTP server as seen through the modem: AT#FTPPUT and AT#FTPAPP open a file in command mode,
+AT#FTPAPPEXT sends chunks of it, and the library's ftpUpload() and ftpFileSize() are answered directly.
+After drop(n) the connection breaks once the server has taken n more bytes, keeping them; every command
+fails after that until the next ftpOpenSession().
+*/
+class ftpServer : public hostModem
+{
+public:
+  std::map<std::string, std::string> files;
+  bool sizeSupported;
+  bool appendSupported;
+  uint16_t appext;                              //  AT#FTPAPPEXT commands
+  uint16_t appextEmpty;                         //  of them with no data
+  uint16_t uploads;                             //  ftpUpload() calls
+  bool lastEof;                                 //  eof flag of the last AT#FTPAPPEXT
+
+  ftpServer() : sizeSupported(true), appendSupported(true), appext(0), appextEmpty(0), uploads(0),
+                lastEof(false), _connected(false), _open(false), _dropAfter(0), _chunk(0) {}
+
+  void drop(uint32_t bytes)
+  {
+    _dropAfter = bytes;
+  }
+
+  virtual void command(const char* line)
+  {
+    char path [80] = {0};
+    unsigned n = 0, eof = 0;
+    if( !_connected )
+    {
+      this->reply("\r\nERROR\r\n");
+    }
+    else if( sscanf(line, "AT#FTPPUT=\"%79[^\"]\",1", path) == 1 )
+    {
+      _path = path;
+      files[_path].clear();
+      _open = true;
+      this->reply("\r\nOK\r\n");
+    }
+    else if( sscanf(line, "AT#FTPAPP=\"%79[^\"]\",1", path) == 1 )
+    {
+      _path = path;
+      _open = appendSupported && files.count(_path) > 0;
+      this->reply(_open ? "\r\nOK\r\n" : "\r\nERROR\r\n");
+    }
+    else if( sscanf(line, "AT#FTPAPPEXT=%u,%u", &n, &eof) == 2 )
+    {
+      appext++;
+      appextEmpty += ( n == 0 );
+      lastEof = eof != 0;
+      if( !_open )
+      {
+        this->reply("\r\nERROR\r\n");
+        return;
+      }
+      _chunk = n;
+      this->reply("\r\n>");
+      this->expectData(n);
+      if( n == 0 )
+      {
+        this->chunkDone();
+      }
+    }
+    else
+    {
+      this->reply("\r\nOK\r\n");
+    }
+  }
+
+  virtual void data(uint8_t c)
+  {
+    if( _connected )
+    {
+      files[_path] += (char) c;
+      this->take();
+    }
+    if( --_chunk == 0 )
+    {
+      this->chunkDone();
+    }
+  }
+
+  virtual uint8_t ftpOpenSession()
+  {
+    _connected = true;
+    _open = false;
+    return 0;
+  }
+
+  virtual uint8_t ftpCloseSession()
+  {
+    _open = false;
+    return 0;
+  }
+
+  virtual uint8_t ftpFileSize(const char* serverPath, uint32_t* size)
+  {
+    if( !_connected || !sizeSupported || files.count(serverPath) == 0 )
+    {
+      return 1;
+    }
+    *size = files[serverPath].size();
+    return 0;
+  }
+
+  virtual uint8_t ftpUpload(const char* serverPath, const char* sdPath)
+  {
+    uploads++;
+    FILE* fp = fopen(sdPath, "rb");
+    if( !_connected || fp == NULL )
+    {
+      if( fp != NULL )
+      {
+        fclose(fp);
+      }
+      return 1;
+    }
+
+    std::string& file = files[serverPath];
+    file.clear();
+    int c;
+    while( _connected && ( c = fgetc(fp) ) != EOF )
+    {
+      file += (char) c;
+      this->take();
+    }
+    fclose(fp);
+    return _connected ? 0 : 7;
+  }
+
+private:
+  bool _connected;
+  bool _open;                                   //  a data connection of AT#FTPPUT or AT#FTPAPP
+  uint32_t _dropAfter;
+  uint32_t _chunk;                              //  bytes of the current AT#FTPAPPEXT still to come
+  std::string _path;
+
+  //  counts a byte the server kept against a scripted drop
+  void take()
+  {
+    if( _dropAfter > 0 && --_dropAfter == 0 )
+    {
+      _connected = false;
+      _open = false;
+    }
+  }
+
+  void chunkDone()
+  {
+    if( !_connected )
+    {
+      return;                                   //  the mote only sees the timeout
+    }
+    char answer [40];
+    snprintf(answer, sizeof(answer), "\r\n#FTPAPPEXT: %u\r\n\r\nOK\r\n", (unsigned) _chunk);
+    this->reply(answer);
+    if( lastEof )
+    {
+      _open = false;
+    }
+  }
+};
+
+
+//  what the progress callback was told
+struct progressLog {
+  uint32_t last;
+  uint16_t calls;
+};
+
+static void logProgress(void* context, uint32_t offset)
+{
+  progressLog* log = (progressLog*) context;
+  log->last = offset;
+  log->calls++;
+}
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+  printf("%s %s\n", ok ? "ok  " : "FAIL", what);
+  failures += !ok;
+}
+
+static std::string local;                       //  contents of the test files
+
+static void writeFile(const char* name, uint32_t size)
+{
+  FILE* fp = fopen(name, "wb");
+  fwrite(local.data(), 1, size, fp);
+  fclose(fp);
+}
+
+static char SERVER [] = "/data/18-07-26.bin";
+static char SDPATH [] = "18-07-26.bin";
+
+
+/*
+checkFresh()
+A new file that fits the budget goes out in one ftpUpload() transfer, and if that breaks off, the next call
+appends the rest in chunks from what the server got, without sending the start again.
+*/
+static void checkFresh(my4G* modem)
+{
+  ftpServer server;
+  hostUseModem(&server);
+  progressLog log = {0, 0};
+  server.ftpOpenSession();
+
+  uint8_t result = modem->ftpUploadResume(SERVER, SDPATH, 0, logProgress, &log);
+  check(result == 0 && server.files[SERVER] == local, "fresh file uploaded");
+  check(server.uploads == 1 && server.appext == 0, "fresh file sent in one transfer, not in chunks");
+  check(log.last == FILE_SIZE, "fresh file reported complete");
+
+  server.files.clear();
+  log.last = 0;
+  server.drop(1000);
+  result = modem->ftpUploadResume(SERVER, SDPATH, 0, logProgress, &log);
+  check(result == 3 && server.files[SERVER].size() == 1000, "broken transfer reported");
+
+  server.ftpOpenSession();
+  log.calls = 0;
+  result = modem->ftpUploadResume(SERVER, SDPATH, log.last, logProgress, &log);
+  check(result == 0 && server.files[SERVER] == local, "broken transfer resumed");
+  check(server.uploads == 2, "resume didn't start over");
+  check(log.calls == ( FILE_SIZE - 1000 + FTP_CHUNK_SIZE - 1 ) / FTP_CHUNK_SIZE, "progress after every chunk");
+}
+
+/*
+checkChunks()
+A file larger than the budget is sent in chunks and paused at the budget. A drop in the middle of a chunk
+loses at most that chunk: the reported offset is never more than a chunk behind what the server got.
+*/
+static void checkChunks(my4G* modem)
+{
+  ftpServer server;
+  hostUseModem(&server);
+  progressLog log = {0, 0};
+  server.ftpOpenSession();
+
+  uint8_t result = modem->ftpUploadResume(SERVER, SDPATH, 0, logProgress, &log, 0, 1024);
+  check(result == 5 && server.files[SERVER].size() == 1024, "paused at the byte budget");
+  check(log.last == 1024 && server.lastEof, "pause reported and closed the data connection");
+
+  server.drop(300);
+  result = modem->ftpUploadResume(SERVER, SDPATH, log.last, logProgress, &log);
+  uint32_t got = server.files[SERVER].size();
+  check(result == 3 && got == 1324, "drop in the middle of a chunk reported");
+  check(log.last <= got && got - log.last < FTP_CHUNK_SIZE, "less than a chunk behind the server");
+
+  server.ftpOpenSession();
+  uint16_t before = server.appext;
+  result = modem->ftpUploadResume(SERVER, SDPATH, log.last, logProgress, &log);
+  check(result == 0 && server.files[SERVER] == local, "resumed from the server's size");
+  check((uint32_t) ( server.appext - before ) == ( FILE_SIZE - got + FTP_CHUNK_SIZE - 1 ) / FTP_CHUNK_SIZE,
+        "nothing sent twice");
+}
+
+/*
+checkFallback()
+A server that can't report sizes, or refuses to append, gets the whole file again.
+*/
+static void checkFallback(my4G* modem)
+{
+  ftpServer server;
+  hostUseModem(&server);
+  progressLog log = {0, 0};
+  server.ftpOpenSession();
+
+  server.sizeSupported = false;
+  server.files[SERVER] = local.substr(0, 500);
+  uint8_t result = modem->ftpUploadResume(SERVER, SDPATH, 500, logProgress, &log);
+  check(result == 0 && server.files[SERVER] == local && server.uploads == 1, "no SIZE: whole file again");
+
+  server.sizeSupported = true;
+  server.appendSupported = false;
+  server.files[SERVER] = local.substr(0, 1000);
+  result = modem->ftpUploadResume(SERVER, SDPATH, 1000, logProgress, &log);
+  check(result == 0 && server.files[SERVER] == local && server.uploads == 2, "no APPE: whole file again");
+}
+
+/*
+checkLength()
+A growing file is uploaded up to length only, the way sendRecent() does, and nothing is sent once the
+server has that much, not even an empty AT#FTPAPPEXT.
+*/
+static void checkLength(my4G* modem)
+{
+  ftpServer server;
+  hostUseModem(&server);
+  progressLog log = {0, 0};
+  server.ftpOpenSession();
+
+  uint8_t result = modem->ftpUploadResume(SERVER, SDPATH, 0, logProgress, &log, 2000);
+  check(result == 0 && server.files[SERVER] == local.substr(0, 2000) && server.lastEof, "first 2000 bytes");
+
+  uint16_t before = server.appext;
+  result = modem->ftpUploadResume(SERVER, SDPATH, 2000, logProgress, &log, 2000);
+  check(result == 0 && server.appext == before, "nothing new, nothing sent");
+
+  result = modem->ftpUploadResume(SERVER, SDPATH, 2000, logProgress, &log, FILE_SIZE);
+  check(result == 0 && server.files[SERVER] == local, "the rest appended");
+
+  writeFile("empty.bin", 0);
+  result = modem->ftpUploadResume((char*) "/data/empty.bin", (char*) "empty.bin", 0, logProgress, &log);
+  check(result == 0 && server.files.count("/data/empty.bin") == 1, "empty file created");
+  check(server.appextEmpty == 0, "no empty AT#FTPAPPEXT");
+}
+
+
+//  the batch: three files, with their progress and results
+struct batchFiles {
+  uint8_t next;
+  uint8_t current;
+  uint32_t offset [3];
+  uint8_t error [3];
+};
+
+static const char* BATCH_SD [] = { "a.bin", "b.bin", "c.bin" };
+
+static bool nextFile(void* context, char* sdPath, uint8_t sdSize, char* serverPath, uint8_t serverSize,
+                     uint32_t* fileSize, uint32_t* resumeFrom)
+{
+  batchFiles* batch = (batchFiles*) context;
+  while( batch->next < 3 && batch->error[batch->next] == 0 )
+  {
+    batch->next++;                              //  on the server already
+  }
+  if( batch->next == 3 )
+  {
+    return false;
+  }
+  batch->current = batch->next++;
+  snprintf(sdPath, sdSize, "%s", BATCH_SD[batch->current]);
+  snprintf(serverPath, serverSize, "/data/%s", BATCH_SD[batch->current]);
+  *fileSize = FILE_SIZE;
+  *resumeFrom = batch->offset[batch->current];
+  return true;
+}
+
+static void fileProgress(void* context, uint32_t offset)
+{
+  batchFiles* batch = (batchFiles*) context;
+  batch->offset[batch->current] = offset;
+}
+
+static void fileDone(void* context, uint8_t error)
+{
+  batchFiles* batch = (batchFiles*) context;
+  batch->error[batch->current] = error;
+}
+
+/*
+checkBatch()
+A batch that loses the connection in its second file stops after FTP_BATCH_MAX_FAILS failures, and the
+next batch finishes the second file from where it broke off and sends the third.
+*/
+static void checkBatch(my4G* modem)
+{
+  ftpServer server;
+  hostUseModem(&server);
+  for(uint8_t i = 0; i < 3; i++)
+  {
+    writeFile(BATCH_SD[i], FILE_SIZE);
+  }
+
+  batchFiles files = { 0, 0, {0, 0, 0}, {255, 255, 255} };
+  ftpBatch batch = { nextFile, fileProgress, fileDone, &files, 100000, 60000, 0 };
+  server.drop(FILE_SIZE + 1200);
+  uint8_t result = modem->ftpUploadBatch((char*) "ftp", 21, (char*) "user", (char*) "pass", &batch);
+  check(result == 3 && batch.sent == 1 && batch.failed == 2, "batch stopped after the drop");
+  check(files.error[0] == 0 && server.files["/data/b.bin"].size() == 1200, "first file sent, second broken");
+
+  files.next = 0;
+  uint16_t uploads = server.uploads;
+  result = modem->ftpUploadBatch((char*) "ftp", 21, (char*) "user", (char*) "pass", &batch);
+  check(result == 0 && batch.sent == 2 && batch.failed == 0, "next batch finished");
+  check(server.files["/data/b.bin"] == local && server.files["/data/c.bin"] == local, "all files on the server");
+  check(server.uploads == uploads + 1, "second file resumed, third sent in one transfer");
+}
+
+
+int main()
+{
+  char dir [] = "/tmp/ftptestXXXXXX";
+  if( mkdtemp(dir) == NULL || chdir(dir) != 0 )
+  {
+    perror("ftptest");
+    return 1;
+  }
+
+  for(uint32_t i = 0; i < FILE_SIZE; i++)
+  {
+    local += (char) ( i * 7 + i / 256 );
+  }
+  writeFile(SDPATH, FILE_SIZE);
+
+  my4G modem((char*) "apn", (char*) "", (char*) "");
+  checkFresh(&modem);
+  checkChunks(&modem);
+  checkFallback(&modem);
+  checkLength(&modem);
+  checkBatch(&modem);
+
+  printf("%d failed\n", failures);
+  return failures == 0 ? 0 : 1;
+}
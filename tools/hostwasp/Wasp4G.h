@@ -0,0 +1,47 @@
+/*
+Wasp4G.h
+Host stand-in for the Wasp4G library. Everything the library would send over the UART goes to the modem
+stand-in installed with hostUseModem(), and everything it answers is read back the way the library does,
+one byte at a time until an expected answer or the timeout (see hostwasp.h). The library's FTP calls are
+handed to the stand-in as they are, since they run their own AT dialogue inside the library.
+*/
+
+#ifndef HOSTWASP_4G_H
+#define HOSTWASP_4G_H
+
+#include "WaspClasses.h"
+
+class Wasp4G
+{
+public:
+  uint8_t _buffer [512];
+  uint16_t _length;
+  uint16_t _errorCode;
+  uint32_t _filesize;
+  uint8_t _uart;
+
+  Wasp4G();
+  uint8_t ON();
+  void OFF();
+  uint8_t set_APN(char* apn, char* login, char* password);
+  uint8_t checkDataConnection(uint8_t seconds);
+
+  uint8_t sendCommand(const char* command, const char* ans1, const char* ans2);
+  uint8_t sendCommand(const char* command, const char* ans1, const char* ans2, uint32_t timeout);
+  uint8_t waitFor(const char* ans1, uint32_t timeout);
+  uint8_t waitFor(const char* ans1, const char* ans2, uint32_t timeout);
+  void printString(const char* text, uint8_t uart);
+  void printByte(uint8_t data, uint8_t uart);
+  int serialAvailable(uint8_t uart);
+  int serialRead(uint8_t uart);
+  void serialFlush(uint8_t uart);
+
+  uint8_t ftpOpenSession(char* server, uint16_t port, char* user, char* password);
+  uint8_t ftpCloseSession();
+  uint8_t ftpFileSize(char* serverPath);
+  uint8_t ftpUpload(char* serverPath, char* sdPath);
+};
+
+extern Wasp4G _4G;
+
+#endif
@@ -0,0 +1,109 @@
+/*
+WaspClasses.h
+Host stand-in for the parts of the Waspmote API that the my4G library uses, so it can be built and
+driven by the checks in tools/ on a PC. PROGMEM strings are plain strings, the SD works on files below
+the current directory, the EEPROM is an array and millis() is a clock that only moves when the modem
+stand-in waits (see hostwasp.h). Nothing here runs on the Waspmote.
+*/
+
+#ifndef HOSTWASP_CLASSES_H
+#define HOSTWASP_CLASSES_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define PROGMEM
+#define PSTR(s)               (s)
+#define F(s)                  (s)
+#define DEC                   10
+#define HEX                   16
+#define strcpy_P              strcpy
+#define strncpy_P             strncpy
+#define strcmp_P              strcmp
+#define strncmp_P             strncmp
+#define strlen_P              strlen
+#define memcpy_P              memcpy
+#define sprintf_P             sprintf
+#define snprintf_P            snprintf
+#define vsnprintf_P           vsnprintf
+#define pgm_read_byte(p)      ( *(const uint8_t*) (p) )
+#define pgm_read_word(p)      ( *(p) )
+#define min(a, b)             ( (a) < (b) ? (a) : (b) )
+#define max(a, b)             ( (a) > (b) ? (a) : (b) )
+
+typedef uint8_t byte;
+
+unsigned long millis();
+void delay(unsigned long ms);
+char* dtostrf(double value, signed char width, unsigned char decimals, char* out);
+
+//  the USB console, quiet unless HOSTWASP_VERBOSE is set in the environment
+struct hostSerial {
+  void ON();
+  void OFF();
+  void print(const char* s);
+  void print(char c);
+  void print(int value, int base = DEC);
+  void print(unsigned value, int base = DEC);
+  void print(long value, int base = DEC);
+  void print(unsigned long value, int base = DEC);
+  void print(double value);
+  void println();
+  void println(const char* s);
+  void println(char c);
+  void println(int value, int base = DEC);
+  void println(unsigned value, int base = DEC);
+  void println(long value, int base = DEC);
+  void println(unsigned long value, int base = DEC);
+  void println(double value);
+  void printf(const char* format, ...);
+  void flush();
+  int available();
+  int read();
+};
+extern hostSerial USB;
+
+struct WaspRTC {
+  uint8_t year, month, date, day, hour, minute, second;
+  void setWatchdog(uint16_t) {}
+  void unSetWatchdog() {}
+};
+extern WaspRTC RTC;
+
+#define O_READ    0x01
+#define O_WRITE   0x02
+#define O_RDWR    ( O_READ | O_WRITE )
+#define O_APPEND  0x04
+#define O_CREAT   0x10
+
+//  an open file, backed by a host file
+struct SdFile {
+  FILE* fp;
+  SdFile() : fp(NULL) {}
+  int16_t read(void* data, uint16_t size);
+  int16_t write(const void* data, uint16_t size);
+  uint8_t seekSet(uint32_t offset);
+  uint32_t fileSize();
+  uint8_t close();
+};
+
+struct WaspSD {
+  char buffer [256];
+  uint8_t ON();
+  void OFF();
+  uint8_t openFile(const char* path, SdFile* file, uint8_t mode);
+  uint8_t closeFile(SdFile* file);
+  int8_t isFile(const char* path);
+  int32_t getFileSize(const char* path);
+  uint8_t del(const char* path);
+};
+extern WaspSD SD;
+
+#define EEPROM_START          1024
+void eeprom_read_block(void* data, const void* address, size_t size);
+void eeprom_update_block(const void* data, void* address, size_t size);
+
+#endif
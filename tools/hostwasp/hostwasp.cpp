@@ -0,0 +1,362 @@
+/*
+hostwasp.cpp
+The host stand-ins declared in WaspClasses.h, Wasp4G.h and hostwasp.h.
+*/
+
+#include "hostwasp.h"
+
+hostSerial USB;
+WaspRTC RTC;
+WaspSD SD;
+Wasp4G _4G;
+
+static uint32_t hostClock = 0;
+static hostModem* modem = NULL;
+static uint8_t eeprom [4096];
+static bool verbose = getenv("HOSTWASP_VERBOSE") != NULL;
+
+
+unsigned long millis()
+{
+  return hostClock;
+}
+
+void delay(unsigned long ms)
+{
+  hostClock += ms;
+}
+
+void hostAdvance(uint32_t ms)
+{
+  hostClock += ms;
+}
+
+char* dtostrf(double value, signed char width, unsigned char decimals, char* out)
+{
+  sprintf(out, "%*.*f", width, decimals, value);
+  return out;
+}
+
+void hostUseModem(hostModem* m)
+{
+  modem = m;
+}
+
+void eeprom_read_block(void* data, const void* address, size_t size)
+{
+  memcpy(data, eeprom + (size_t) address, size);
+}
+
+void eeprom_update_block(const void* data, void* address, size_t size)
+{
+  memcpy(eeprom + (size_t) address, data, size);
+}
+
+
+/*
+hostSerial
+Everything goes to stderr, and only with HOSTWASP_VERBOSE, so a check prints just its own results.
+*/
+void hostSerial::ON() {}
+void hostSerial::OFF() {}
+void hostSerial::flush() {}
+int hostSerial::available() { return 0; }
+int hostSerial::read() { return -1; }
+
+void hostSerial::printf(const char* format, ...)
+{
+  if( verbose )
+  {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+  }
+}
+
+void hostSerial::print(const char* s) { this->printf("%s", s); }
+void hostSerial::print(char c) { this->printf("%c", c); }
+void hostSerial::print(int value, int base) { this->printf(base == HEX ? "%x" : "%d", value); }
+void hostSerial::print(unsigned value, int base) { this->printf(base == HEX ? "%x" : "%u", value); }
+void hostSerial::print(long value, int base) { this->printf(base == HEX ? "%lx" : "%ld", value); }
+void hostSerial::print(unsigned long value, int base) { this->printf(base == HEX ? "%lx" : "%lu", value); }
+void hostSerial::print(double value) { this->printf("%.2f", value); }
+void hostSerial::println() { this->printf("\n"); }
+void hostSerial::println(const char* s) { this->printf("%s\n", s); }
+void hostSerial::println(char c) { this->printf("%c\n", c); }
+void hostSerial::println(int value, int base) { this->print(value, base); this->println(); }
+void hostSerial::println(unsigned value, int base) { this->print(value, base); this->println(); }
+void hostSerial::println(long value, int base) { this->print(value, base); this->println(); }
+void hostSerial::println(unsigned long value, int base) { this->print(value, base); this->println(); }
+void hostSerial::println(double value) { this->print(value); this->println(); }
+
+
+/*
+SdFile / WaspSD
+SD paths are taken relative to the current directory.
+*/
+int16_t SdFile::read(void* data, uint16_t size)
+{
+  return fp != NULL ? (int16_t) fread(data, 1, size, fp) : -1;
+}
+
+int16_t SdFile::write(const void* data, uint16_t size)
+{
+  return fp != NULL ? (int16_t) fwrite(data, 1, size, fp) : -1;
+}
+
+uint8_t SdFile::seekSet(uint32_t offset)
+{
+  return fp != NULL && fseek(fp, offset, SEEK_SET) == 0;
+}
+
+uint32_t SdFile::fileSize()
+{
+  if( fp == NULL )
+  {
+    return 0;
+  }
+  long at = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, at, SEEK_SET);
+  return size;
+}
+
+uint8_t SdFile::close()
+{
+  bool closed = fp != NULL && fclose(fp) == 0;
+  fp = NULL;
+  return closed;
+}
+
+uint8_t WaspSD::ON() { return 1; }
+void WaspSD::OFF() {}
+
+uint8_t WaspSD::openFile(const char* path, SdFile* file, uint8_t mode)
+{
+  const char* how = "rb";
+  if( mode & O_WRITE )
+  {
+    how = ( mode & O_APPEND ) ? "ab" : ( ( isFile(path) == 1 ) ? "r+b" : "w+b" );
+  }
+  file->fp = fopen(path, how);
+  return file->fp != NULL;
+}
+
+uint8_t WaspSD::closeFile(SdFile* file)
+{
+  return file->close();
+}
+
+int8_t WaspSD::isFile(const char* path)
+{
+  FILE* fp = fopen(path, "rb");
+  if( fp == NULL )
+  {
+    return -1;
+  }
+  fclose(fp);
+  return 1;
+}
+
+int32_t WaspSD::getFileSize(const char* path)
+{
+  SdFile file;
+  if( !openFile(path, &file, O_READ) )
+  {
+    return -1;
+  }
+  int32_t size = file.fileSize();
+  file.close();
+  return size;
+}
+
+uint8_t WaspSD::del(const char* path)
+{
+  return remove(path) == 0;
+}
+
+
+/*
+hostModem
+Command lines end at "\r". While data is expected, bytes go to data() instead, as after the ">" prompt of
+AT#FTPAPPEXT or AT#HTTPSND.
+*/
+hostModem::hostModem() : _data(0) {}
+
+void hostModem::reply(const char* text)
+{
+  _out.append(text);
+}
+
+void hostModem::reply(const uint8_t* data, uint16_t size)
+{
+  _out.append((const char*) data, size);
+}
+
+void hostModem::expectData(uint32_t size)
+{
+  _data = size;
+}
+
+void hostModem::receive(uint8_t c)
+{
+  if( _data > 0 )
+  {
+    _data--;
+    this->data(c);
+    return;
+  }
+  if( c == '\r' )
+  {
+    std::string line = _line;
+    _line.clear();
+    this->command(line.c_str());
+    return;
+  }
+  _line += (char) c;
+}
+
+int hostModem::available()
+{
+  return _out.size();
+}
+
+int hostModem::read()
+{
+  if( _out.empty() )
+  {
+    return -1;
+  }
+  uint8_t c = _out[0];
+  _out.erase(0, 1);
+  return c;
+}
+
+
+/*
+Wasp4G
+Follows the library: sendCommand() drops whatever the modem said before, sends the command and waits, and
+waitFor() collects the answer in _buffer one byte at a time, returning as soon as it ends with one of the
+expected answers. What comes after that stays unread for the next call. An answer the modem doesn't give
+costs the whole timeout.
+*/
+Wasp4G::Wasp4G() : _length(0), _errorCode(0), _filesize(0), _uart(1)
+{
+  memset(_buffer, 0, sizeof(_buffer));
+}
+
+uint8_t Wasp4G::ON() { return 0; }
+void Wasp4G::OFF() {}
+uint8_t Wasp4G::set_APN(char*, char*, char*) { return 0; }
+
+uint8_t Wasp4G::checkDataConnection(uint8_t seconds)
+{
+  return modem->checkDataConnection();
+}
+
+uint8_t Wasp4G::sendCommand(const char* command, const char* ans1, const char* ans2)
+{
+  return this->sendCommand(command, ans1, ans2, 5000);
+}
+
+uint8_t Wasp4G::sendCommand(const char* command, const char* ans1, const char* ans2, uint32_t timeout)
+{
+  this->serialFlush(_uart);
+  this->printString(command, _uart);
+  return this->waitFor(ans1, ans2, timeout);
+}
+
+uint8_t Wasp4G::waitFor(const char* ans1, uint32_t timeout)
+{
+  return this->waitFor(ans1, NULL, timeout);
+}
+
+static bool endsWith(const uint8_t* buffer, uint16_t length, const char* answer)
+{
+  size_t n = ( answer != NULL ) ? strlen(answer) : 0;
+  return n > 0 && n <= length && memcmp(buffer + length - n, answer, n) == 0;
+}
+
+uint8_t Wasp4G::waitFor(const char* ans1, const char* ans2, uint32_t timeout)
+{
+  memset(_buffer, 0, sizeof(_buffer));
+  _length = 0;
+  while( true )
+  {
+    int c = modem->read();
+    if( c < 0 )
+    {
+      hostClock += timeout;
+      return 0;
+    }
+    if( _length == sizeof(_buffer) - 1 )                //  keep the newest half, like a ring
+    {
+      memmove(_buffer, _buffer + _length / 2, _length - _length / 2);
+      _length -= _length / 2;
+      memset(_buffer + _length, 0, sizeof(_buffer) - _length);
+    }
+    _buffer[_length++] = c;
+
+    if( endsWith(_buffer, _length, ans1) )
+    {
+      return 1;
+    }
+    if( endsWith(_buffer, _length, ans2) )
+    {
+      return 2;
+    }
+  }
+}
+
+void Wasp4G::printString(const char* text, uint8_t uart)
+{
+  while( *text != 0 )
+  {
+    modem->receive(*text++);
+  }
+}
+
+void Wasp4G::printByte(uint8_t data, uint8_t uart)
+{
+  modem->receive(data);
+}
+
+int Wasp4G::serialAvailable(uint8_t uart)
+{
+  return modem->available();
+}
+
+int Wasp4G::serialRead(uint8_t uart)
+{
+  return modem->read();
+}
+
+void Wasp4G::serialFlush(uint8_t uart)
+{
+  while( modem->read() >= 0 )
+  {
+  }
+}
+
+uint8_t Wasp4G::ftpOpenSession(char* server, uint16_t port, char* user, char* password)
+{
+  return modem->ftpOpenSession();
+}
+
+uint8_t Wasp4G::ftpCloseSession()
+{
+  return modem->ftpCloseSession();
+}
+
+uint8_t Wasp4G::ftpFileSize(char* serverPath)
+{
+  _filesize = 0;
+  return modem->ftpFileSize(serverPath, &_filesize);
+}
+
+uint8_t Wasp4G::ftpUpload(char* serverPath, char* sdPath)
+{
+  return modem->ftpUpload(serverPath, sdPath);
+}
@@ -0,0 +1,52 @@
+/*
+hostwasp.h
+The modem stand-in behind the host Wasp4G (see Wasp4G.h). A check derives from hostModem, answers the
+command lines the mote sends in command(), takes raw data after a prompt in data(), and queues what the
+modem says with reply(). The clock only moves when the mote waits for an answer the modem has nothing left
+to give, by the whole timeout, or when a check calls hostAdvance(), so timings are exact and repeatable.
+*/
+
+#ifndef HOSTWASP_H
+#define HOSTWASP_H
+
+#include <string>
+#include "Wasp4G.h"
+
+class hostModem
+{
+public:
+  hostModem();
+  virtual ~hostModem() {}
+
+  //  a command line the mote sent, without its "\r"
+  virtual void command(const char* line) = 0;
+
+  //  a byte the mote sent while expectData() bytes were outstanding
+  virtual void data(uint8_t c) {}
+
+  //  the library's own FTP dialogue, see Wasp4G::ftpOpenSession() and the others. 0 is success.
+  virtual uint8_t ftpOpenSession() { return 1; }
+  virtual uint8_t ftpCloseSession() { return 0; }
+  virtual uint8_t ftpFileSize(const char* serverPath, uint32_t* size) { return 1; }
+  virtual uint8_t ftpUpload(const char* serverPath, const char* sdPath) { return 1; }
+  virtual uint8_t checkDataConnection() { return 0; }
+
+  void reply(const char* text);
+  void reply(const uint8_t* data, uint16_t size);
+  void expectData(uint32_t size);
+
+  //  used by the host Wasp4G
+  void receive(uint8_t c);
+  int available();
+  int read();
+
+private:
+  std::string _line;
+  std::string _out;
+  uint32_t _data;
+};
+
+void hostUseModem(hostModem* modem);
+void hostAdvance(uint32_t ms);
+
+#endif
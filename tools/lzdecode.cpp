@@ -0,0 +1,71 @@
+/*
+lzdecode.cpp
+Restores the original data file from a file packed with UPLOAD_LZSS (".gpc", see glacierProbe/packing.h),
+byte for byte, for checking uploads on the server. Runs on the host, not the Waspmote:
+
+  g++ -DLZSS_HOST -Ilzss -o lzdecode tools/lzdecode.cpp lzss/lzss.cpp
+  ./lzdecode 18-07-26.gpc > 18-07-26.csv
+
+The exit code is 0 if the whole file decoded and its byte count matched, 1 otherwise. Files packed with
+UPLOAD_TSCODEC are decoded by tsdecode.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "lzss.h"
+
+//  layout of the packed file, from glacierProbe/header.h
+#define PACK_MAGIC        "GPTC"
+#define PACK_VERSION      1
+#define PACK_HEADER_SIZE  8
+#define UPLOAD_LZSS       2
+
+
+static uint8_t readFile(void* context, uint8_t* data, uint8_t len)
+{
+  return fread(data, 1, len, (FILE*) context);
+}
+
+int main(int argc, char** argv)
+{
+  if( argc != 2 )
+  {
+    fprintf(stderr, "usage: %s file.gpc > file\n", argv[0]);
+    return 1;
+  }
+
+  FILE* file = fopen(argv[1], "rb");
+  if( file == NULL )
+  {
+    perror(argv[1]);
+    return 1;
+  }
+
+  uint8_t packHeader [PACK_HEADER_SIZE];
+  if( fread(packHeader, 1, sizeof(packHeader), file) != sizeof(packHeader) ||
+      memcmp(packHeader, PACK_MAGIC, 4) != 0 ||
+      packHeader[4] != PACK_VERSION ||
+      packHeader[5] != UPLOAD_LZSS )
+  {
+    fprintf(stderr, "%s: not a file packed with LZSS\n", argv[1]);
+    return 1;
+  }
+
+  lzDecoder decoder(readFile, file);
+  uint8_t data [LZ_MAX_MATCH];
+  uint8_t len;
+  uint8_t result;
+  while( ( result = decoder.next(data, &len) ) == LZ_DATA )
+  {
+    fwrite(data, 1, len, stdout);
+  }
+  fclose(file);
+
+  if( result != LZ_END )
+  {
+    fprintf(stderr, "%s: stream broken off after %lu bytes\n", argv[1], (unsigned long) decoder.out);
+    return 1;
+  }
+  fprintf(stderr, "%s: %lu bytes\n", argv[1], (unsigned long) decoder.out);
+  return 0;
+}
@@ -0,0 +1,154 @@
+/*
+tsdecode.cpp
+Turns a packed data file (".gpc", see glacierProbe/packing.h) back into a CSV file with one line per
+record, for checking uploads on the server and feeding them to the ingestion. Runs on the host, not the
+Waspmote:
+
+  g++ -DTSCODEC_HOST -Itscodec -o tsdecode tools/tsdecode.cpp tscodec/tscodec.cpp
+  ./tsdecode 18-07-26.gpc > 18-07-26.csv
+
+The first line holds the column names: "seq" for journaled files, "epoch", then the key of every channel.
+Values are written with the decimals of their channel, and values that weren't measured are left empty.
+The exit code is 0 if the whole file decoded and its record count matched, 1 otherwise. Files packed with
+UPLOAD_LZSS are restored by lzdecode.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "tscodec.h"
+
+//  layout of the packed file, from glacierProbe/header.h
+#define PACK_MAGIC        "GPTC"
+#define PACK_VERSION      1
+#define PACK_HEADER_SIZE  8
+#define UPLOAD_TSCODEC    1
+#define LOG_MAGIC         "GPBL"
+#define LOG_HEADER_SIZE   12
+#define LOG_CHANNEL_SIZE  23
+#define LOG_NAME_SIZE     16
+#define LOG_MISSING       ((int32_t) 0x80000000)
+
+
+static uint8_t readFile(void* context, uint8_t* data, uint8_t len)
+{
+  return fread(data, 1, len, (FILE*) context);
+}
+
+/*
+printScaled()
+Prints value / 10^decimals without going through a float, like strbuf::appendScaled().
+*/
+static void printScaled(int32_t value, uint8_t decimals)
+{
+  int64_t v = value;
+  const char* sign = "";
+  if( v < 0 )
+  {
+    sign = "-";
+    v = -v;
+  }
+
+  int64_t scale = 1;
+  for(uint8_t i = 0; i < decimals; i++)
+  {
+    scale *= 10;
+  }
+
+  if( decimals == 0 )
+  {
+    printf("%s%lld", sign, (long long) v);
+  }
+  else
+  {
+    printf("%s%lld.%0*lld", sign, (long long) ( v / scale ), decimals, (long long) ( v % scale ));
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if( argc != 2 )
+  {
+    fprintf(stderr, "usage: %s file.gpc\n", argv[0]);
+    return 1;
+  }
+
+  FILE* file = fopen(argv[1], "rb");
+  if( file == NULL )
+  {
+    perror(argv[1]);
+    return 1;
+  }
+
+  uint8_t packHeader [PACK_HEADER_SIZE];
+  uint8_t logHeader [LOG_HEADER_SIZE];
+  if( fread(packHeader, 1, sizeof(packHeader), file) != sizeof(packHeader) ||
+      memcmp(packHeader, PACK_MAGIC, 4) != 0 ||
+      packHeader[4] != PACK_VERSION ||
+      packHeader[5] != UPLOAD_TSCODEC ||
+      fread(logHeader, 1, sizeof(logHeader), file) != sizeof(logHeader) ||
+      memcmp(logHeader, LOG_MAGIC, 4) != 0 )
+  {
+    fprintf(stderr, "%s: not a data file packed with tscodec\n", argv[1]);
+    return 1;
+  }
+
+  uint8_t fields = packHeader[6];
+  uint8_t timeFields = packHeader[7];
+  uint8_t channels = logHeader[5];
+  if( fields != timeFields + channels || fields > TS_MAX_FIELDS )
+  {
+    fprintf(stderr, "%s: %u fields don't match %u channels\n", argv[1], fields, channels);
+    return 1;
+  }
+
+  uint8_t decimals [TS_MAX_FIELDS] = {0};
+  printf(timeFields == 2 ? "seq,epoch" : "epoch");
+  for(uint8_t ch = 0; ch < channels; ch++)
+  {
+    uint8_t descriptor [LOG_CHANNEL_SIZE];
+    if( fread(descriptor, 1, sizeof(descriptor), file) != sizeof(descriptor) )
+    {
+      fprintf(stderr, "%s: truncated header\n", argv[1]);
+      return 1;
+    }
+    char name [LOG_NAME_SIZE + 1] = {0};
+    memcpy(name, descriptor, LOG_NAME_SIZE);
+    decimals[timeFields + ch] = descriptor[LOG_CHANNEL_SIZE - 1];
+    printf(",%s", name);
+  }
+  printf("\n");
+
+  tsDecoder decoder(readFile, file);
+  decoder.begin(fields, timeFields);
+
+  int32_t row [TS_MAX_FIELDS];
+  uint8_t result;
+  while( ( result = decoder.next(row) ) == TS_ROW )
+  {
+    for(uint8_t i = 0; i < fields; i++)
+    {
+      if( i > 0 )
+      {
+        printf(",");
+      }
+      if( i < timeFields )
+      {
+        printf("%lu", (unsigned long) (uint32_t) row[i]);
+      }
+      else if( row[i] != LOG_MISSING )
+      {
+        printScaled(row[i], decimals[i]);
+      }
+    }
+    printf("\n");
+  }
+  fclose(file);
+
+  if( result != TS_END )
+  {
+    fprintf(stderr, "%s: stream broken off after %lu records\n", argv[1], (unsigned long) decoder.rows);
+    return 1;
+  }
+  fprintf(stderr, "%s: %lu records\n", argv[1], (unsigned long) decoder.rows);
+  return 0;
+}
@@ -0,0 +1,136 @@
+/*
+unbundle.cpp
+Splits a catch-up bundle (".gpb", see glacierProbe/bundle.h) back into the files it holds, under their
+SD paths below outdir, for the ingestion on the server. Runs on the host, not the Waspmote:
+
+  g++ -o unbundle tools/unbundle.cpp
+  ./unbundle 18-07-26.gpb restored
+
+Files that were packed for the bundle come out as ".gpc" files, to be decoded with tsdecode or lzdecode.
+The exit code is 0 if every file was restored and the sizes in the table of contents add up to the
+bundle, 1 otherwise.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//  layout of the bundle, from glacierProbe/header.h
+#define BUNDLE_MAGIC      "GPBN"
+#define BUNDLE_VERSION    1
+#define BUNDLE_MAX_FILES  16
+#define BUNDLE_HEADER_SIZE 8
+#define FILENAME_SIZE     24
+#define BUNDLE_ENTRY_SIZE ( FILENAME_SIZE + 8 )
+
+
+/*
+makeParentDirs()
+Creates the directories leading up to path, like makeParentDir() does on the SD.
+*/
+static bool makeParentDirs(char* path)
+{
+  for(char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+  {
+    *slash = '\0';
+    bool made = mkdir(path, 0755) == 0 || errno == EEXIST;
+    *slash = '/';
+    if( !made )
+    {
+      perror(path);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  if( argc != 2 && argc != 3 )
+  {
+    fprintf(stderr, "usage: %s file.gpb [outdir]\n", argv[0]);
+    return 1;
+  }
+  const char* outdir = ( argc == 3 ) ? argv[2] : ".";
+
+  FILE* file = fopen(argv[1], "rb");
+  if( file == NULL )
+  {
+    perror(argv[1]);
+    return 1;
+  }
+
+  uint8_t header [BUNDLE_HEADER_SIZE];
+  uint8_t toc [BUNDLE_MAX_FILES][BUNDLE_ENTRY_SIZE];
+  if( fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      memcmp(header, BUNDLE_MAGIC, 4) != 0 ||
+      header[4] != BUNDLE_VERSION ||
+      header[5] == 0 || header[5] > BUNDLE_MAX_FILES ||
+      fread(toc, 1, sizeof(toc), file) != sizeof(toc) )
+  {
+    fprintf(stderr, "%s: not a bundle\n", argv[1]);
+    return 1;
+  }
+
+  uint8_t count = header[5];
+  uint64_t total = sizeof(header) + sizeof(toc);
+  int result = 0;
+  for(uint8_t i = 0; i < count && result == 0; i++)
+  {
+    char name [FILENAME_SIZE + 1] = {0};
+    memcpy(name, toc[i], FILENAME_SIZE);
+    uint32_t size;
+    memcpy(&size, toc[i] + FILENAME_SIZE, sizeof(size));
+    uint8_t codec = toc[i][FILENAME_SIZE + 4];
+
+    char path [1024];
+    snprintf(path, sizeof(path), "%s/%s", outdir, name);
+    if( name[0] == '\0' || name[0] == '/' || strstr(name, "..") != NULL || !makeParentDirs(path) )
+    {
+      fprintf(stderr, "%s: bad entry %u \"%s\"\n", argv[1], i, name);
+      result = 1;
+      break;
+    }
+
+    FILE* out = fopen(path, "wb");
+    if( out == NULL )
+    {
+      perror(path);
+      result = 1;
+      break;
+    }
+
+    uint8_t chunk [512];
+    uint32_t left = size;
+    while( left > 0 )
+    {
+      size_t n = fread(chunk, 1, left < sizeof(chunk) ? left : sizeof(chunk), file);
+      if( n == 0 || fwrite(chunk, 1, n, out) != n )
+      {
+        break;
+      }
+      left -= n;
+    }
+    fclose(out);
+
+    if( left > 0 )
+    {
+      fprintf(stderr, "%s: %s broken off after %lu of %lu bytes\n", argv[1], name,
+              (unsigned long) ( size - left ), (unsigned long) size);
+      result = 1;
+      break;
+    }
+    total += size;
+    fprintf(stderr, "%s: %lu bytes%s\n", path, (unsigned long) size, codec != 0 ? ", packed" : "");
+  }
+
+  if( result == 0 && fgetc(file) != EOF )
+  {
+    fprintf(stderr, "%s: %lu bytes don't match the table of contents\n", argv[1], (unsigned long) total);
+    result = 1;
+  }
+  fclose(file);
+  return result;
+}
@@ -0,0 +1,290 @@
+/******************************************************************************************
+
+TSCODEC.CPP
+
+See tscodec.h for a description of the stream.
+
+******************************************************************************************/
+
+#include "tscodec.h"
+
+//	payload widths of the 10, 110 and 1110 prefixes, 1111 is always followed by 32 bits
+static const uint8_t TIME_WIDTHS [3] = { 7, 9, 12 };
+static const uint8_t VALUE_WIDTHS [3] = { 6, 10, 16 };
+
+
+void tsCodec::reset(uint8_t fields, uint8_t timeFields)
+{
+	_fields = fields;
+	_timeFields = timeFields;
+	memset(_prev, 0, sizeof(_prev));
+	memset(_step, 0, sizeof(_step));
+	memset(_buffer, 0, sizeof(_buffer));
+	_pos = 0;
+	_bit = 7;
+	rows = 0;
+}
+
+
+/*****************************************************************************************
+tsEncoder
+*****************************************************************************************/
+
+tsEncoder::tsEncoder(tsWrite write, void* context)
+{
+	_write = write;
+	_context = context;
+	reset(0, 0);
+	bytes = 0;
+	failed = false;
+}
+
+bool tsEncoder::begin(uint8_t fields, uint8_t timeFields)
+{
+	if( fields > TS_MAX_FIELDS || timeFields > fields )
+	{
+		return false;
+	}
+	reset(fields, timeFields);
+	bytes = 0;
+	failed = false;
+	return true;
+}
+
+bool tsEncoder::flush()
+{
+	if( _pos > 0 && !failed )
+	{
+		if( _write(_context, _buffer, _pos) )
+		{
+			bytes += _pos;
+		}
+		else
+		{
+			failed = true;
+		}
+	}
+	memset(_buffer, 0, sizeof(_buffer));
+	_pos = 0;
+	return !failed;
+}
+
+/*
+putBits()
+Appends the low count bits of value, most significant first.
+*/
+void tsEncoder::putBits(uint32_t value, uint8_t count)
+{
+	while( count-- )
+	{
+		if( ( value >> count ) & 1 )
+		{
+			_buffer[_pos] |= 1 << _bit;
+		}
+
+		if( _bit == 0 )
+		{
+			_bit = 7;
+			if( ++_pos == sizeof(_buffer) )
+			{
+				flush();
+			}
+		}
+		else
+		{
+			_bit--;
+		}
+	}
+}
+
+/*
+putCoded()
+Writes a difference with the shortest prefix whose payload it fits into.
+*/
+void tsEncoder::putCoded(int32_t diff, const uint8_t* widths)
+{
+	if( diff == 0 )
+	{
+		putBits(0, 1);
+		return;
+	}
+
+	for(uint8_t i = 0; i < 3; i++)
+	{
+		int32_t limit = (int32_t) 1 << ( widths[i] - 1 );
+		if( diff >= -limit && diff < limit )
+		{
+			putBits(( 1UL << ( i + 2 ) ) - 2, i + 2);			//	10, 110 or 1110
+			putBits((uint32_t) diff, widths[i]);
+			return;
+		}
+	}
+
+	putBits(0x0F, 4);
+	putBits((uint32_t) diff, 32);
+}
+
+bool tsEncoder::add(const int32_t* row)
+{
+	if( failed )
+	{
+		return false;
+	}
+
+	putBits(1, 1);
+	for(uint8_t i = 0; i < _fields; i++)
+	{
+		uint32_t value = (uint32_t) row[i];
+		uint32_t diff = value - _prev[i];
+		if( i < _timeFields )
+		{
+			putCoded((int32_t) ( diff - _step[i] ), TIME_WIDTHS);
+			_step[i] = diff;
+		}
+		else
+		{
+			putCoded((int32_t) diff, VALUE_WIDTHS);
+		}
+		_prev[i] = value;
+	}
+	rows++;
+	return !failed;
+}
+
+bool tsEncoder::finish()
+{
+	putBits(0, 1);
+	putBits(rows, 32);
+	if( _bit != 7 )							//	pad the last byte
+	{
+		_pos++;
+		_bit = 7;
+	}
+	return flush();
+}
+
+
+/*****************************************************************************************
+tsDecoder
+*****************************************************************************************/
+
+tsDecoder::tsDecoder(tsRead read, void* context)
+{
+	_read = read;
+	_context = context;
+	reset(0, 0);
+	_len = 0;
+}
+
+bool tsDecoder::begin(uint8_t fields, uint8_t timeFields)
+{
+	if( fields > TS_MAX_FIELDS || timeFields > fields )
+	{
+		return false;
+	}
+	reset(fields, timeFields);
+	_len = 0;
+	return true;
+}
+
+bool tsDecoder::getBits(uint8_t count, uint32_t* value)
+{
+	*value = 0;
+	while( count-- )
+	{
+		if( _pos == _len )
+		{
+			_len = _read(_context, _buffer, sizeof(_buffer));
+			_pos = 0;
+			if( _len == 0 )
+			{
+				return false;
+			}
+		}
+
+		*value = ( *value << 1 ) | ( ( _buffer[_pos] >> _bit ) & 1 );
+		if( _bit == 0 )
+		{
+			_bit = 7;
+			_pos++;
+		}
+		else
+		{
+			_bit--;
+		}
+	}
+	return true;
+}
+
+bool tsDecoder::getCoded(const uint8_t* widths, int32_t* diff)
+{
+	uint32_t bit;
+	uint8_t ones = 0;
+	while( ones < 4 )
+	{
+		if( !getBits(1, &bit) )
+		{
+			return false;
+		}
+		if( bit == 0 )
+		{
+			break;
+		}
+		ones++;
+	}
+
+	if( ones == 0 )
+	{
+		*diff = 0;
+		return true;
+	}
+
+	uint8_t width = ( ones == 4 ) ? 32 : widths[ones - 1];
+	uint32_t payload;
+	if( !getBits(width, &payload) )
+	{
+		return false;
+	}
+	if( width < 32 && ( payload & ( 1UL << ( width - 1 ) ) ) )	//	sign extend
+	{
+		payload |= ~( ( 1UL << width ) - 1 );
+	}
+	*diff = (int32_t) payload;
+	return true;
+}
+
+uint8_t tsDecoder::next(int32_t* row)
+{
+	uint32_t more;
+	if( !getBits(1, &more) )
+	{
+		return TS_ERROR;
+	}
+
+	if( !more )
+	{
+		uint32_t count;
+		return ( getBits(32, &count) && count == rows ) ? TS_END : TS_ERROR;
+	}
+
+	for(uint8_t i = 0; i < _fields; i++)
+	{
+		int32_t diff;
+		if( !getCoded(i < _timeFields ? TIME_WIDTHS : VALUE_WIDTHS, &diff) )
+		{
+			return TS_ERROR;
+		}
+		if( i < _timeFields )
+		{
+			_step[i] += (uint32_t) diff;
+			_prev[i] += _step[i];
+		}
+		else
+		{
+			_prev[i] += (uint32_t) diff;
+		}
+		row[i] = (int32_t) _prev[i];
+	}
+	rows++;
+	return TS_ROW;
+}
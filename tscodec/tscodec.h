@@ -0,0 +1,126 @@
+#ifndef TSCODEC_H
+#define TSCODEC_H
+
+/******************************************************************************************
+
+TSCODEC.H
+
+A streaming codec for rows of int32 fields that change slowly from one row to the next,
+such as the records of a data log, in the style of Facebook's Gorilla time-series format.
+Every row is coded against the row before it, bit by bit, so a day of one-minute samples
+shrinks to a fraction of its binary or text size without ever holding more than one row.
+
+The first timeFields fields of a row are timestamps or counters, which grow by about the
+same step every row, and are coded as the difference of their differences:
+
+  0                           same step as last time
+  10   + 7 bits               step changed by -64 .. 63
+  110  + 9 bits               -256 .. 255
+  1110 + 12 bits              -2048 .. 2047
+  1111 + 32 bits              anything else
+
+The other fields are measurements stored as scaled integers. Gorilla XORs the bits of
+floats, which doesn't suit integers that cross zero, so they are coded as the plain
+difference to the previous row instead:
+
+  0                           unchanged
+  10   + 6 bits               changed by -32 .. 31
+  110  + 10 bits              -512 .. 511
+  1110 + 16 bits              -32768 .. 32767
+  1111 + 32 bits              anything else
+
+Every row starts with a 1 bit. The stream ends with a 0 bit, the number of rows as 32 bits
+and zero bits up to the next byte. Bits are written most significant first, and all
+differences wrap around modulo 2^32, so every int32 row comes back exactly. Before the
+first row every field and step counts as 0.
+
+The encoder keeps two int32 per field and a TS_BUFFER_SIZE byte buffer, which is handed
+to the tsWrite callback whenever it fills up. The decoder reads through a tsRead callback
+the same way. Build with TSCODEC_HOST defined to use the codec off the Waspmote, such as
+in the decoder in tools/.
+
+******************************************************************************************/
+
+#ifdef TSCODEC_HOST
+#include <stdint.h>
+#include <string.h>
+#else
+#ifndef __WPROGRAM_H__
+#include "WaspClasses.h"
+#endif
+#endif
+
+#define TS_MAX_FIELDS	20				//	most fields per row
+#define TS_BUFFER_SIZE	32				//	bytes buffered between calls to tsWrite or tsRead
+
+//	results of tsDecoder::next()
+#define TS_ROW			0				//	a row was decoded
+#define TS_END			1				//	the end of the stream, and the row count matched
+#define TS_ERROR		2				//	the stream ended early or the row count didn't match
+
+//	writes len bytes somewhere, returns false if it couldn't
+typedef bool (*tsWrite)(void* context, const uint8_t* data, uint8_t len);
+
+//	reads up to len bytes into data, returns the number of bytes read, 0 at the end
+typedef uint8_t (*tsRead)(void* context, uint8_t* data, uint8_t len);
+
+
+class tsCodec
+{
+public:
+	uint32_t rows;						//	rows encoded or decoded so far
+
+protected:
+	void reset(uint8_t fields, uint8_t timeFields);
+
+	uint8_t _fields;
+	uint8_t _timeFields;
+	uint32_t _prev [TS_MAX_FIELDS];		//	every field of the previous row
+	uint32_t _step [TS_MAX_FIELDS];		//	the last step of the time fields
+
+	uint8_t _buffer [TS_BUFFER_SIZE];
+	uint8_t _pos;						//	next byte of _buffer
+	uint8_t _bit;						//	next bit of that byte, 7 is the most significant
+};
+
+
+class tsEncoder : public tsCodec
+{
+public:
+	tsEncoder(tsWrite write, void* context);
+
+	bool begin(uint8_t fields, uint8_t timeFields);	//	false if there are more than TS_MAX_FIELDS
+	bool add(const int32_t* row);					//	row holds fields values
+	bool finish();									//	ends the stream and flushes the buffer
+
+	uint32_t bytes;						//	bytes handed to write so far
+	bool failed;						//	set once write fails, later calls do nothing
+
+private:
+	void putBits(uint32_t value, uint8_t count);
+	void putCoded(int32_t diff, const uint8_t* widths);
+	bool flush();
+
+	tsWrite _write;
+	void* _context;
+};
+
+
+class tsDecoder : public tsCodec
+{
+public:
+	tsDecoder(tsRead read, void* context);
+
+	bool begin(uint8_t fields, uint8_t timeFields);
+	uint8_t next(int32_t* row);			//	TS_ROW, TS_END or TS_ERROR
+
+private:
+	bool getBits(uint8_t count, uint32_t* value);
+	bool getCoded(const uint8_t* widths, int32_t* diff);
+
+	tsRead _read;
+	void* _context;
+	uint8_t _len;						//	bytes in _buffer
+};
+
+#endif